@@ -1,6 +1,10 @@
 /* Disk layout:
 
-24 byte header:
+4 byte bucket count, then records.  Records are written as v2;
+v1 records (from older files) are still read, and compaction
+rewrites them as v2.
+
+v1, 24 byte header:
 
 |      crc      |  ver  |  kl   |
 | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 |
@@ -14,21 +18,51 @@
 <kl-octet key>
 <vlen-octet value>
 
+v2, 12 to 18 byte header:
+
+|      crc      | V2_MARK|flags |  previous_offset_in_bucket  |
+| 0 | 1 | 2 | 3 |       4       | 5 | 6 | 7 | 8 | 9 |
+
+| kl varint | vlen varint |
+|    1-3    |     1-5     |
+
+<kl-octet key>
+<vlen-octet value>
+
+Varints are LEB128; the previous offset is 40 bits, all ones for
+none, which caps a file at 1TB.  Byte 4 tells the versions
+apart: v1 has its version's low byte (1) there, v2 has the high
+bit set.  The CRC covers everything after itself in both.
+
 */
+#define _GNU_SOURCE /* O_DIRECT */
 #include "springfield.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define SPRINGFIELD_HAVE_URING 1
+#endif
+#endif
+
 #include "uthash.h"
 
 typedef struct springfield_header_v1 {
@@ -37,51 +71,721 @@ typedef struct springfield_header_v1 {
     uint16_t klen;
 
     uint32_t vlen;
-    uint32_t flags; /* snappy compressed? */
+    uint32_t flags; /* FLAG_* */
 
     uint64_t last;
 } springfield_header_v1;
 
-typedef struct springfield_key_t {
+#define V2_MARK 0x80
+#define V2_LAST_MASK ((uint64_t)0xffffffffff)
+#define V2_MIN_SIZE 13 /* header, 1 byte key (the NUL), no value */
+
+/* A record header of either version, decoded */
+typedef struct springfield_rec {
+    uint32_t hlen; /* header bytes; the key follows */
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t flags;
+    uint64_t last;
+} springfield_rec;
+
+/* The value is a springfield_blob_ptr into a blob file */
+#define FLAG_BLOB 1
+/* Filler written by compaction; never indexed */
+#define FLAG_PAD 2
+/* The value is a merge operand, applied to the key's older
+   records when read */
+#define FLAG_MERGE 4
+/* The value is a fragment, to be appended to the key's older
+   records when read */
+#define FLAG_APPEND 8
+#define FLAG_OPERAND (FLAG_MERGE | FLAG_APPEND)
+
+typedef struct springfield_blob_ptr {
+    uint64_t off;
+    uint32_t vlen;
+    uint32_t gen;
+} springfield_blob_ptr;
+
+typedef struct springfield_blob_header {
+    uint32_t crc;
+    uint32_t vlen;
+    uint16_t klen;
+    uint16_t flags;
+} springfield_blob_header;
+
+typedef struct springfield_blobs_t {
+    uint32_t gen;
+    int fd;
+    uint8_t *map;
+    uint64_t alloc;
+    uint64_t eof;
+} springfield_blobs_t;
+
+typedef struct springfield_keyent_t {
     char *key;
+    uint32_t hash;
     UT_hash_handle hh;
-} springfield_key_t;
+} springfield_keyent_t;
+
+typedef struct springfield_cache_t springfield_cache_t;
+typedef struct springfield_stripe_t springfield_stripe_t;
+typedef struct springfield_bloom_t springfield_bloom_t;
+
+typedef struct springfield_wtable_t springfield_wtable_t;
+typedef struct springfield_pool_t springfield_pool_t;
+typedef struct springfield_frame_t springfield_frame_t;
+
+#define BLOB_GENS 4
 
 struct springfield_t {
+    springfield_options_t opts;
     uint32_t num_buckets;
     uint64_t *offsets;
     int mapfd;
     char *path;
     uint8_t *map;
     uint64_t mmap_alloc;
+    springfield_pool_t *pool;   /* SPRINGFIELD_BACKEND_POOL; else map */
+    uint8_t *scratch;           /* pool: records on their way out */
+    uint64_t scratch_alloc;
     uint64_t eof;
-    uint32_t seeks[100];
-    int seek_pos;
+    springfield_stripe_t *stats;
+    uint64_t compactions;
+    int compact_running;
+    uint32_t compact_buckets_done;
+    uint32_t compact_buckets_total;
     pthread_rwlock_t main_lock;
     pthread_mutex_t iter_lock;
     int in_rewrite;
-    springfield_key_t *rewrite_keys;
+    springfield_keyent_t *rewrite_keys;
+    springfield_cache_t *cache;
+    springfield_bloom_t *bloom;
+    springfield_bloom_t *bloom_next; /* being rebuilt */
+    uint32_t bloom_rebuilt; /* buckets walked into bloom_next */
+    volatile int bloom_full;
+    springfield_blobs_t *blobs[BLOB_GENS];
+    uint32_t blob_gen;
+    uint64_t blob_gcs;
+    uint64_t checkpoints;
+    pthread_t warmup_thread;
+    int warmup_running;
+    pthread_t scrub_thread;
+    int scrub_running;
+    pthread_t autopilot_thread;
+    int autopilot_running;
+    volatile int closing;
+
+    pthread_mutex_t wbuf_lock;
+    pthread_cond_t wbuf_wake;
+    pthread_cond_t wbuf_flushed;
+    springfield_wtable_t *wbuf;
+    springfield_wtable_t *wbuf_flushing;
+    uint64_t wbuf_entries;
+    uint64_t wbuf_flushes;
+    uint64_t wbuf_stalls;
+    pthread_t wbuf_thread;
+    int wbuf_stop;
+
+    springfield_tail_t *tails;
+    uint64_t tail_base;     /* stream position of offset 0 */
+    uint64_t compacted_eof; /* left by the last compaction (0: none);
+                               the stream goes on from it at tail_base */
 };
 
-#define HEADER_SIZE (sizeof(springfield_header_v1))
-#define HEADER_SIZE_MINUS_CRC (sizeof(springfield_header_v1) - 4)
+#define HEADER_V1_SIZE (sizeof(springfield_header_v1))
+#define HEADER_MAX_SIZE 24 /* covers v1 and the longest v2 */
 #define MMAP_OVERFLOW (128 * 1024)
 #define NO_BACKTRACE (~((uint64_t)0) )
 #define MAX_KLEN ((uint16_t)0xffff)
-#define MAX_VLEN (((uint32_t)0xffffffff) - MAX_KLEN - HEADER_SIZE)
+#define MAX_VLEN (((uint32_t)0xffffffff) - MAX_KLEN - HEADER_MAX_SIZE)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define STAT_STRIPES 16
+#define STAT_SEEKS 8
+#define WARMUP_CHUNK (4 * 1024 * 1024)
+#define BLOB_MAGIC 0x31424653 /* "SFB1" */
+#define BLOB_FILE_HEADER 8
+#define BLOB_HEADER_SIZE (sizeof(springfield_blob_header))
+#define BLOB_GC_BATCH 256
+#define BLOOM_REBUILD_SLICE 4096
+#define TAIL_BASE_MAX (HEADER_MAX_SIZE + 1 + 2 * sizeof(uint64_t))
 
 static uint32_t jenkins_one_at_a_time_hash(char *key, size_t len);
 static uint32_t crc32(uint32_t crc, uint8_t *buf, int len);
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+static void * springfield_warmup_thread(void *arg);
+static void * springfield_scrub_thread(void *arg);
+static void * springfield_autopilot_thread(void *arg);
+static int springfield_wbuf_get(springfield_t *r, springfield_key_t *k,
+    uint8_t **res, uint32_t *len);
+static void springfield_wbuf_start(springfield_t *r);
+static void springfield_wbuf_flush(springfield_t *r);
+static void springfield_wbuf_stop(springfield_t *r);
+static void springfield_grow(springfield_t *r, uint64_t step);
+static void springfield_wbuf_stats(springfield_t *r, springfield_stats_t *out);
+static uint8_t * springfield_fold(springfield_t *r, uint64_t off, uint32_t *len,
+        uint64_t *rewrite);
+static void springfield_tail_notify(springfield_t *r);
+static void springfield_tail_reserve(springfield_t *tmp);
+static void springfield_tail_swap(springfield_t *r, springfield_t *tmp);
+static void springfield_tail_base_parse(springfield_t *r, uint8_t *p,
+    uint64_t avail);
+static void springfield_bloom_maintain(springfield_t *r);
+static int springfield_sync_i(springfield_t *r);
+static void springfield_fold_rewrite(springfield_t *r, springfield_key_t *k,
+    uint64_t off);
+
+#define hash(key, len) jenkins_one_at_a_time_hash(key, len)
+
+uint32_t springfield_hash(char *key) {
+    return hash(key, strlen(key));
+}
+
+void springfield_key_init(springfield_key_t *k, char *key) {
+    size_t len = strlen(key);
+    assert(len + 1 < MAX_KLEN);
+    k->key = key;
+    k->klen = len + 1;
+    k->hash = hash(key, len);
+}
+
+void springfield_key_init_hashed(springfield_key_t *k, char *key, uint32_t h) {
+    size_t len = strlen(key);
+    assert(len + 1 < MAX_KLEN);
+    k->key = key;
+    k->klen = len + 1;
+    k->hash = h;
+}
+
+/* -- record headers -- */
+
+static inline uint32_t springfield_varint_size(uint64_t v) {
+    uint32_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline uint32_t springfield_varint_put(uint8_t *p, uint64_t v) {
+    uint32_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Bytes consumed, or 0 if the varint runs past `end` or 64 bits */
+static inline uint32_t springfield_varint_get(uint8_t *p, uint8_t *end, uint64_t *v) {
+    uint32_t n = 0, shift = 0;
+    *v = 0;
+    while (p + n < end && shift < 64) {
+        uint8_t b = p[n++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return n;
+        shift += 7;
+    }
+    return 0;
+}
+
+static inline uint32_t springfield_rec_hlen(uint32_t klen, uint32_t vlen) {
+    return 10 + springfield_varint_size(klen) + springfield_varint_size(vlen);
+}
+
+/* Write a v2 header to `p`; returns its length */
+static uint32_t springfield_rec_encode(uint8_t *p, uint32_t flags,
+        uint32_t klen, uint32_t vlen, uint64_t last) {
+    uint32_t n = 10;
+    uint64_t l = last & V2_LAST_MASK;
+    assert(flags < V2_MARK);
+    p[4] = V2_MARK | flags;
+    memcpy(p + 5, &l, 5);
+    n += springfield_varint_put(p + n, klen);
+    n += springfield_varint_put(p + n, vlen);
+    return n;
+}
+
+/* A v2 record is at least V2_MIN_SIZE bytes, so this can load 8
+   bytes and mask rather than assemble 5 */
+static inline uint64_t springfield_rec_last(uint8_t *p) {
+    uint64_t l;
+    memcpy(&l, p + 5, 8);
+    l &= V2_LAST_MASK;
+    return l == V2_LAST_MASK ? NO_BACKTRACE : l;
+}
+
+/* Decode the header of the record at `off`, which has `avail`
+   bytes of file behind it.  Returns 0 if the header is zeroed,
+   torn or nonsense; key and value may still run past `avail`. */
+static int springfield_rec_decode(uint8_t *p, uint64_t off, uint64_t avail,
+        springfield_rec *rec) {
+    if (avail < 5)
+        return 0;
+    if (p[4] & V2_MARK) {
+        uint8_t *end = p + (avail < HEADER_MAX_SIZE ? avail : HEADER_MAX_SIZE);
+        uint64_t klen, vlen;
+        uint32_t n = 10, c;
+        if (avail < V2_MIN_SIZE)
+            return 0;
+        if (!(c = springfield_varint_get(p + n, end, &klen)))
+            return 0;
+        n += c;
+        if (!(c = springfield_varint_get(p + n, end, &vlen)))
+            return 0;
+        n += c;
+        if (klen == 0 || klen >= MAX_KLEN || vlen > MAX_VLEN)
+            return 0;
+        rec->hlen = n;
+        rec->klen = klen;
+        rec->vlen = vlen;
+        rec->flags = p[4] & ~V2_MARK;
+        rec->last = springfield_rec_last(p);
+        return rec->last == NO_BACKTRACE || rec->last < off;
+    }
+
+    springfield_header_v1 *h = (springfield_header_v1 *)p;
+    if (avail < HEADER_V1_SIZE || h->version != 1 || h->klen == 0 ||
+            h->vlen > MAX_VLEN)
+        return 0;
+    rec->hlen = HEADER_V1_SIZE;
+    rec->klen = h->klen;
+    rec->vlen = h->vlen;
+    rec->flags = h->flags;
+    rec->last = h->last;
+    return 1;
+}
+
+static inline uint32_t springfield_varint_get_unchecked(uint8_t *p, uint64_t *v) {
+    uint32_t n = 0, shift = 0;
+    uint64_t x = 0;
+    uint8_t c;
+    do {
+        c = p[n++];
+        x |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *v = x;
+    return n;
+}
+
+/* Decode a record already known good (linked from the index, so
+   load checked it); this is the chain walk's inner loop */
+static inline void springfield_rec_parse(uint8_t *p, springfield_rec *rec) {
+    if (p[4] & V2_MARK) {
+        uint64_t klen, vlen;
+        uint32_t n = 10;
+        n += springfield_varint_get_unchecked(p + n, &klen);
+        n += springfield_varint_get_unchecked(p + n, &vlen);
+        rec->hlen = n;
+        rec->klen = klen;
+        rec->vlen = vlen;
+        rec->flags = p[4] & ~V2_MARK;
+        rec->last = springfield_rec_last(p);
+    } else {
+        springfield_header_v1 *h = (springfield_header_v1 *)p;
+        rec->hlen = HEADER_V1_SIZE;
+        rec->klen = h->klen;
+        rec->vlen = h->vlen;
+        rec->flags = h->flags;
+        rec->last = h->last;
+    }
+}
+
+static inline void springfield_rec_at(springfield_t *r, uint64_t off,
+        springfield_rec *rec) {
+    springfield_rec_parse(r->map + off, rec);
+}
+
+#define REC_KEY(r, off, rec) ((r)->map + (off) + (rec).hlen)
+#define REC_VAL(r, off, rec) ((r)->map + (off) + (rec).hlen + (rec).klen)
+
+/* -- storage backends --
+
+   By default the data file is one MAP_SHARED mapping and the
+   kernel decides what stays cached.  SPRINGFIELD_BACKEND_POOL
+   drops the mapping: records are read with pread() (O_DIRECT
+   where the filesystem allows, with options.direct_io) into a
+   fixed size pool of POOL_BLOCK frames, and appended with
+   pwrite().  The pool is split into POOL_SHARDS, each with its
+   own lock, hash of resident blocks and CLOCK hand.
+
+   Readers hold main_lock for read and pin the frames they look
+   at; appends hold it for write, so they can patch any cached
+   frame they overlap without a reader seeing half of it.  A
+   range straddling two blocks is copied out instead of pinned.
+   Blob files stay mapped in either backend. */
+
+#define POOL_BLOCK 4096
+#define POOL_SHARD_BITS 4
+#define POOL_SHARDS (1 << POOL_SHARD_BITS)
+#define POOL_MIN_BYTES (POOL_SHARDS * 4 * POOL_BLOCK)
+#define POOL_DEFAULT_BYTES (64 * 1024 * 1024)
+#define POOL_NO_BLOCK (~(uint64_t)0)
+
+struct springfield_frame_t {
+    uint64_t block;
+    uint32_t len;       /* bytes of file read in (short at eof) */
+    uint32_t pins;
+    int ref;
+    int loading;
+    int stray;          /* not in the pool: freed on unpin */
+    uint8_t *data;
+    UT_hash_handle hh;
+};
+
+typedef struct springfield_pool_shard_t {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    springfield_frame_t *frames;
+    springfield_frame_t *resident;
+    uint32_t count;
+    uint32_t hand;
+} springfield_pool_shard_t;
+
+struct springfield_pool_t {
+    int fd;             /* for reads; O_DIRECT if we got it */
+    int direct;
+    uint8_t *slab;
+    springfield_pool_shard_t shards[POOL_SHARDS];
+};
+
+static springfield_pool_t * springfield_pool_create(springfield_options_t *opts,
+        char *path, uint64_t bytes) {
+    springfield_pool_t *p = calloc(1, sizeof(springfield_pool_t));
+    uint32_t per, i, j;
+    if (bytes < POOL_MIN_BYTES)
+        bytes = POOL_MIN_BYTES;
+    per = bytes / POOL_BLOCK / POOL_SHARDS;
+
+    p->fd = opts->direct_io ? open(path, O_RDONLY | O_DIRECT) : -1;
+    p->direct = p->fd > -1;
+    if (p->fd < 0)
+        p->fd = open(path, O_RDONLY);
+    assert(p->fd > -1);
+
+    int s = posix_memalign((void **)&p->slab, POOL_BLOCK,
+        (uint64_t)per * POOL_SHARDS * POOL_BLOCK);
+    assert(!s);
+    for (i = 0; i < POOL_SHARDS; i++) {
+        springfield_pool_shard_t *sh = &p->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->loaded, NULL);
+        sh->count = per;
+        sh->frames = calloc(per, sizeof(springfield_frame_t));
+        for (j = 0; j < per; j++) {
+            sh->frames[j].block = POOL_NO_BLOCK;
+            sh->frames[j].data = p->slab + ((uint64_t)i * per + j) * POOL_BLOCK;
+        }
+    }
+    return p;
+}
+
+static void springfield_pool_destroy(springfield_pool_t *p) {
+    int i;
+    for (i = 0; i < POOL_SHARDS; i++) {
+        springfield_pool_shard_t *sh = &p->shards[i];
+        HASH_CLEAR(hh, sh->resident);
+        free(sh->frames);
+        pthread_mutex_destroy(&sh->lock);
+        pthread_cond_destroy(&sh->loaded);
+    }
+    if (p->fd > -1)
+        close(p->fd);
+    free(p->slab);
+    free(p);
+}
+
+/* Forget every block, once compaction has swapped the file
+   underneath; caller holds main_lock for write */
+static void springfield_pool_reset(springfield_pool_t *p) {
+    int i;
+    uint32_t j;
+    for (i = 0; i < POOL_SHARDS; i++) {
+        springfield_pool_shard_t *sh = &p->shards[i];
+        HASH_CLEAR(hh, sh->resident);
+        for (j = 0; j < sh->count; j++) {
+            assert(!sh->frames[j].pins);
+            sh->frames[j].block = POOL_NO_BLOCK;
+            sh->frames[j].ref = 0;
+        }
+    }
+}
+
+/* Blocks resident and blocks the pool can hold */
+static void springfield_pool_usage(springfield_pool_t *p, uint64_t *used,
+        uint64_t *cap) {
+    int i;
+    *used = *cap = 0;
+    for (i = 0; i < POOL_SHARDS; i++) {
+        springfield_pool_shard_t *sh = &p->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        *used += HASH_COUNT(sh->resident);
+        *cap += sh->count;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+static inline springfield_pool_shard_t * springfield_pool_shard(springfield_pool_t *p,
+        uint64_t block) {
+    return &p->shards[(block * 0x9e3779b97f4a7c15ULL) >> (64 - POOL_SHARD_BITS)];
+}
+
+/* Read block `block` into `f` */
+static void springfield_pool_fill(springfield_pool_t *p, springfield_frame_t *f,
+        uint64_t block) {
+    ssize_t n;
+    do {
+        n = pread(p->fd, f->data, POOL_BLOCK, block * POOL_BLOCK);
+    } while (n < 0 && errno == EINTR);
+    assert(n >= 0);
+    memset(f->data + n, 0, POOL_BLOCK - n);
+    f->len = n;
+}
+
+/* Read block `block` into `buf` if the page cache has it, else -1.
+   O_DIRECT skips the page cache, so there it's always -1. */
+static ssize_t springfield_pool_read_cached(springfield_pool_t *p,
+        uint64_t block, uint8_t *buf) {
+#ifdef RWF_NOWAIT
+    if (!p->direct) {
+        struct iovec iov = {buf, POOL_BLOCK};
+        ssize_t n;
+        do {
+            n = preadv2(p->fd, &iov, 1, block * POOL_BLOCK, RWF_NOWAIT);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+#endif
+    return -1;
+}
+
+/* Pin `block`, reading it in if need be.  With `noio`, NULL unless
+   it's resident or can be copied from the page cache. */
+static springfield_frame_t * springfield_pool_get(springfield_pool_t *p,
+        uint64_t block, int noio) {
+    springfield_pool_shard_t *sh = springfield_pool_shard(p, block);
+    springfield_frame_t *f;
+    uint8_t buf[POOL_BLOCK];
+    ssize_t got = -1;
+    uint32_t i;
+
+    pthread_mutex_lock(&sh->lock);
+    while (1) {
+        HASH_FIND(hh, sh->resident, &block, sizeof(uint64_t), f);
+        if (f && !(noio && f->loading)) {
+            f->pins++;
+            f->ref = 1;
+            while (f->loading)
+                pthread_cond_wait(&sh->loaded, &sh->lock);
+            pthread_mutex_unlock(&sh->lock);
+            return f;
+        }
+        if (!noio || got >= 0)
+            break;
+        pthread_mutex_unlock(&sh->lock);
+        if ((got = springfield_pool_read_cached(p, block, buf)) < 0)
+            return NULL;
+        /* look again: someone may have loaded it meanwhile */
+        pthread_mutex_lock(&sh->lock);
+    }
+
+    /* CLOCK: two sweeps clear every ref bit, so a third finding
+       nothing means everything is pinned */
+    f = NULL;
+    for (i = 0; i < sh->count * 2 && !f; i++) {
+        springfield_frame_t *c = &sh->frames[sh->hand];
+        sh->hand = (sh->hand + 1) % sh->count;
+        if (c->pins)
+            continue;
+        if (c->ref)
+            c->ref = 0;
+        else
+            f = c;
+    }
+    if (!f) {
+        pthread_mutex_unlock(&sh->lock);
+        f = calloc(1, sizeof(springfield_frame_t));
+        int s = posix_memalign((void **)&f->data, POOL_BLOCK, POOL_BLOCK);
+        assert(!s);
+        f->stray = 1;
+        f->pins = 1;
+    } else {
+        if (f->block != POOL_NO_BLOCK)
+            HASH_DEL(sh->resident, f);
+        f->block = block;
+        f->pins = 1;
+        f->ref = 1;
+        f->loading = got < 0;
+        HASH_ADD(hh, sh->resident, block, sizeof(uint64_t), f);
+    }
+
+    if (got >= 0) {
+        /* a copy, so no one waits on it */
+        memcpy(f->data, buf, got);
+        memset(f->data + got, 0, POOL_BLOCK - got);
+        f->len = got;
+        if (!f->stray)
+            pthread_mutex_unlock(&sh->lock);
+        return f;
+    }
+    if (f->stray) {
+        springfield_pool_fill(p, f, block);
+        return f;
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    springfield_pool_fill(p, f, block);
+
+    pthread_mutex_lock(&sh->lock);
+    f->loading = 0;
+    pthread_cond_broadcast(&sh->loaded);
+    pthread_mutex_unlock(&sh->lock);
+    return f;
+}
+
+static void springfield_pool_put(springfield_pool_t *p, springfield_frame_t *f) {
+    if (f->stray) {
+        free(f->data);
+        free(f);
+        return;
+    }
+    springfield_pool_shard_t *sh = springfield_pool_shard(p, f->block);
+    pthread_mutex_lock(&sh->lock);
+    f->pins--;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Patch cached blocks after `len` bytes were written at `off`;
+   caller holds main_lock for write */
+static void springfield_pool_wrote(springfield_pool_t *p, uint64_t off,
+        uint8_t *buf, uint64_t len) {
+    uint64_t end = off + len, block;
+    for (block = off / POOL_BLOCK; block * POOL_BLOCK < end; block++) {
+        springfield_pool_shard_t *sh = springfield_pool_shard(p, block);
+        springfield_frame_t *f;
+        pthread_mutex_lock(&sh->lock);
+        HASH_FIND(hh, sh->resident, &block, sizeof(uint64_t), f);
+        if (f) {
+            uint64_t from = off > block * POOL_BLOCK ? off : block * POOL_BLOCK;
+            uint64_t to = end < (block + 1) * POOL_BLOCK ? end : (block + 1) * POOL_BLOCK;
+            memcpy(f->data + from % POOL_BLOCK, buf + (from - off), to - from);
+            if (to - block * POOL_BLOCK > f->len)
+                f->len = to - block * POOL_BLOCK;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+/* What a reader holds on to while it looks at data file bytes */
+typedef struct springfield_pin_t {
+    springfield_frame_t *frame;
+    uint8_t *copy;
+    int noio;
+} springfield_pin_t;
+
+#define PIN_INIT {NULL, NULL, 0}
+
+/* `len` bytes at `off` of the data file, readable until
+   springfield_unpin().  NULL only for pin->noio, when a block
+   isn't resident. */
+static uint8_t * springfield_bytes(springfield_t *r, uint64_t off, uint64_t len,
+        springfield_pin_t *pin) {
+    if (!r->pool)
+        return r->map + off;
+    uint64_t block = off / POOL_BLOCK, last = (off + (len ? len : 1) - 1) / POOL_BLOCK;
+    if (block == last) {
+        pin->frame = springfield_pool_get(r->pool, block, pin->noio);
+        return pin->frame ? pin->frame->data + off % POOL_BLOCK : NULL;
+    }
 
-#define hash jenkins_one_at_a_time_hash
+    pin->copy = malloc(len);
+    uint64_t done = 0;
+    for (; block <= last; block++) {
+        springfield_frame_t *f = springfield_pool_get(r->pool, block, pin->noio);
+        if (!f) {
+            free(pin->copy);
+            pin->copy = NULL;
+            return NULL;
+        }
+        uint64_t from = (off + done) % POOL_BLOCK;
+        uint64_t n = POOL_BLOCK - from < len - done ? POOL_BLOCK - from : len - done;
+        memcpy(pin->copy + done, f->data + from, n);
+        done += n;
+        springfield_pool_put(r->pool, f);
+    }
+    return pin->copy;
+}
+
+static inline void springfield_unpin(springfield_t *r, springfield_pin_t *pin) {
+    if (pin->frame)
+        springfield_pool_put(r->pool, pin->frame);
+    free(pin->copy);
+    pin->frame = NULL;
+    pin->copy = NULL;
+}
+
+/* The record at `off`, decoded into `h`, with its header and key
+   (and with `whole`, its value) readable at the pointer returned
+   until springfield_unpin() */
+static uint8_t * springfield_rec_pin(springfield_t *r, uint64_t off,
+        springfield_rec *h, int whole, springfield_pin_t *pin) {
+    if (!r->pool) {
+        springfield_rec_at(r, off, h);
+        return r->map + off;
+    }
+    uint64_t avail = r->eof - off;
+    uint64_t hdr = avail < HEADER_MAX_SIZE ? avail : HEADER_MAX_SIZE;
+    uint8_t *p = springfield_bytes(r, off, hdr, pin);
+    if (!p)
+        return NULL;
+    springfield_rec_parse(p, h);
+    uint64_t need = (uint64_t)h->hlen + h->klen + (whole ? h->vlen : 0);
+    if (need <= hdr || (pin->frame && off % POOL_BLOCK + need <= POOL_BLOCK))
+        return p;
+    springfield_unpin(r, pin);
+    return springfield_bytes(r, off, need, pin);
+}
 
-static uint64_t springfield_index_lookup(springfield_t *r, char *key) {
-    uint32_t fh = hash(key, strlen(key)) % r->num_buckets;
+/* Room for a `step` byte record at eof: the map itself, or a
+   scratch buffer for springfield_append_end() to write out */
+static uint8_t * springfield_append_begin(springfield_t *r, uint64_t step) {
+    if (!r->pool) {
+        if (r->eof + step > r->mmap_alloc)
+            springfield_grow(r, step);
+        return r->map + r->eof;
+    }
+    if (step > r->scratch_alloc) {
+        r->scratch = realloc(r->scratch, step);
+        r->scratch_alloc = step;
+    }
+    return r->scratch;
+}
+
+static void springfield_append_end(springfield_t *r, uint8_t *p, uint64_t step) {
+    if (!r->pool)
+        return;
+    uint64_t done = 0;
+    while (done < step) {
+        ssize_t n = pwrite(r->mapfd, p + done, step - done, r->eof + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        assert(n > 0);
+        done += n;
+    }
+    springfield_pool_wrote(r->pool, r->eof, p, step);
+}
+
+static uint64_t springfield_index_lookup(springfield_t *r, springfield_key_t *k) {
+    uint32_t fh = k->hash % r->num_buckets;
     return r->offsets[fh];
 }
 
-static uint64_t springfield_index_keyval(springfield_t *r, char *key, uint64_t off) {
-    uint32_t fh = hash(key, strlen(key)) % r->num_buckets;
+static uint64_t springfield_index_keyval(springfield_t *r, springfield_key_t *k, uint64_t off) {
+    uint32_t fh = k->hash % r->num_buckets;
 
     uint64_t last = r->offsets[fh];
     r->offsets[fh] = off;
@@ -89,390 +793,5345 @@ static uint64_t springfield_index_keyval(springfield_t *r, char *key, uint64_t o
     return last;
 }
 
-double springfield_bucket_count(springfield_t *r) {
-    return r->num_buckets;
+/* -- statistics --
+
+   Counters and histograms are striped: each thread picks a
+   stripe (its own cache line(s)) the first time it records
+   anything, and springfield_stats() sums the stripes.  Threads
+   only share a stripe when there are more than STAT_STRIPES of
+   them, and even then the relaxed atomic adds stay correct.
+   Latency and lock-wait timing cost two clock reads per op, so
+   they are only taken with options.latency_stats.
+
+   Compaction's scratch db has no stats. */
+
+struct springfield_stripe_t {
+    uint64_t gets;
+    uint64_t get_hits;
+    uint64_t sets;
+    uint64_t dels;
+    uint64_t dels_skipped;
+    uint64_t bloom_negatives;
+    uint64_t try_wouldblocks;
+    uint64_t rmws;
+    uint64_t merge_folds;
+    uint64_t grows;
+    uint64_t bytes_appended;
+    uint64_t crc_errors;
+    uint64_t scrub_bytes;
+    uint64_t scrub_passes;
+    uint32_t seeks[STAT_SEEKS];
+    uint32_t seek_pos;
+    uint64_t chain_lengths[SPRINGFIELD_CHAIN_BUCKETS];
+    springfield_histogram_t ops[SPRINGFIELD_OP_COUNT];
+    springfield_histogram_t lock_waits[SPRINGFIELD_LOCK_COUNT];
+} __attribute__((aligned(64)));
+
+static __thread int stat_stripe = -1;
+static int stat_next_stripe;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+
+static springfield_stripe_t * springfield_stripe(springfield_t *r) {
+    if (stat_stripe < 0)
+        stat_stripe = __sync_fetch_and_add(&stat_next_stripe, 1) % STAT_STRIPES;
+    return &r->stats[stat_stripe];
 }
 
-static void springfield_load(springfield_t *r) {
+/* STAT_ADD to r's stripe, unless r is a scratch db */
+#define STAT_BUMP(r, field, n) do { \
+    if ((r)->stats) \
+        STAT_ADD(springfield_stripe(r)->field, (n)); \
+} while (0)
 
-    struct stat st;
+static uint64_t springfield_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    r->mapfd = open(r->path,
-            O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    assert(r->mapfd > -1);
+/* Log-linear buckets: four per power of two */
+static int springfield_hist_index(uint64_t v) {
+    if (v < 4)
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    int ind = (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+    return ind < SPRINGFIELD_HIST_BUCKETS ? ind : SPRINGFIELD_HIST_BUCKETS - 1;
+}
 
-    int s = fstat(r->mapfd, &st);
-    if (!s) {
-        r->eof = st.st_size >= 4 ? st.st_size : 0;
+static uint64_t springfield_hist_upper(int ind) {
+    if (ind < 4)
+        return ind;
+    int msb = ind / 4 + 1;
+    uint64_t lower = (uint64_t)(4 + ind % 4) << (msb - 2);
+    return lower + ((uint64_t)1 << (msb - 2)) - 1;
+}
+
+static void springfield_hist_record(springfield_histogram_t *h, uint64_t v) {
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, v);
+    STAT_ADD(h->buckets[springfield_hist_index(v)], 1);
+}
+
+void springfield_histogram_record(springfield_histogram_t *h, uint64_t v) {
+    springfield_hist_record(h, v);
+}
+
+static void springfield_hist_merge(springfield_histogram_t *into,
+        springfield_histogram_t *from) {
+    int i;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (i = 0; i < SPRINGFIELD_HIST_BUCKETS; i++)
+        into->buckets[i] += from->buckets[i];
+}
+
+uint64_t springfield_histogram_percentile(springfield_histogram_t *h, double p) {
+    uint64_t want, seen = 0;
+    int i;
+    if (!h->count)
+        return 0;
+    want = (uint64_t)(p * h->count);
+    if (want >= h->count)
+        want = h->count - 1;
+    for (i = 0; i < SPRINGFIELD_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > want)
+            break;
     }
+    return springfield_hist_upper(i);
+}
 
-    r->map = NULL;
+static uint64_t springfield_op_start(springfield_t *r) {
+    return r->stats && r->opts.latency_stats ? springfield_now_ns() : 0;
+}
 
-    if (!r->eof) {
-        r->offsets = malloc(r->num_buckets * sizeof(uint64_t));
-        memset(r->offsets, 0xff, r->num_buckets * sizeof(uint64_t));
+static void springfield_op_end(springfield_t *r, int op, uint64_t start) {
+    if (start)
+        springfield_hist_record(&springfield_stripe(r)->ops[op],
+            springfield_now_ns() - start);
+}
+
+static void springfield_rdlock(springfield_t *r) {
+    uint64_t start = springfield_op_start(r);
+    pthread_rwlock_rdlock(&r->main_lock);
+    if (start)
+        springfield_hist_record(
+            &springfield_stripe(r)->lock_waits[SPRINGFIELD_LOCK_MAIN_READ],
+            springfield_now_ns() - start);
+}
+
+static void springfield_wrlock(springfield_t *r) {
+    uint64_t start = springfield_op_start(r);
+    pthread_rwlock_wrlock(&r->main_lock);
+    if (start)
+        springfield_hist_record(
+            &springfield_stripe(r)->lock_waits[SPRINGFIELD_LOCK_MAIN_WRITE],
+            springfield_now_ns() - start);
+}
+
+static void springfield_iter_lock(springfield_t *r) {
+    uint64_t start = springfield_op_start(r);
+    pthread_mutex_lock(&r->iter_lock);
+    if (start)
+        springfield_hist_record(
+            &springfield_stripe(r)->lock_waits[SPRINGFIELD_LOCK_ITER],
+            springfield_now_ns() - start);
+}
+
+/* -- hot value cache --
+
+   Values copied out of the map live here, packed right behind
+   their entry, so memory spent on the cache holds hot values
+   rather than mostly-cold 4 KB pages.  It is split into shards
+   by the high bits of the key hash, each with its own mutex.
+
+   Eviction is CLOCK; admission is TinyLFU: every lookup bumps a
+   small count-min sketch, and a newcomer only displaces the
+   CLOCK victim if it has been asked for more often.  A one-off
+   scan therefore can't flush the hot set.
+
+   The cache never holds tombstones or misses.  Callers hold
+   main_lock (read for get/put, write for invalidate), so a put
+   can't race with the set that would invalidate it. */
+
+#define CACHE_SHARDS 16
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_MIN_TABLE 64
+
+typedef struct springfield_centry_t {
+    struct springfield_centry_t *chain;
+    struct springfield_centry_t *prev;
+    struct springfield_centry_t *next;
+    uint32_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+    uint8_t ref;
+    /* key then value follow */
+} springfield_centry_t;
+
+typedef struct springfield_cshard_t {
+    pthread_mutex_t lock;
+    springfield_centry_t **table;
+    uint32_t table_size;
+    uint32_t count;
+    springfield_centry_t *hand;
+    uint64_t bytes;
+    uint64_t budget;
+    uint8_t *sketch;
+    uint32_t sketch_mask;
+    uint32_t sketch_adds;
+    uint32_t sketch_reset;
+    uint64_t hits;
+    uint64_t misses;
+} springfield_cshard_t;
 
+struct springfield_cache_t {
+    springfield_cshard_t shards[CACHE_SHARDS];
+};
+
+#define CENTRY_KEY(e) ((char *)((e) + 1))
+#define CENTRY_VAL(e) ((uint8_t *)((e) + 1) + (e)->klen)
+#define CENTRY_SIZE(e) (sizeof(springfield_centry_t) + (e)->klen + (e)->vlen)
+
+static const uint32_t sketch_seeds[CACHE_SKETCH_ROWS] = {
+    0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+};
+
+static springfield_cshard_t * springfield_cache_shard(springfield_cache_t *c,
+        uint32_t h) {
+    return &c->shards[h >> 28];
+}
+
+static springfield_cache_t * springfield_cache_create(uint64_t bytes) {
+    springfield_cache_t *c = calloc(1, sizeof(springfield_cache_t));
+    uint64_t per = bytes / CACHE_SHARDS;
+    uint32_t width = 1024;
+    /* ~one counter per 64 cached bytes */
+    while (width < per / 64 && width < (1 << 24))
+        width <<= 1;
+
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        springfield_cshard_t *s = &c->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->budget = per;
+        s->table_size = CACHE_MIN_TABLE;
+        s->table = calloc(s->table_size, sizeof(springfield_centry_t *));
+        s->sketch = calloc(width, CACHE_SKETCH_ROWS);
+        s->sketch_mask = width - 1;
+        s->sketch_reset = width * 10;
+    }
+    return c;
+}
+
+static void springfield_cache_destroy(springfield_cache_t *c) {
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        springfield_cshard_t *s = &c->shards[i];
+        uint32_t b;
+        for (b = 0; b < s->table_size; b++) {
+            springfield_centry_t *e = s->table[b], *n;
+            for (; e; e = n) {
+                n = e->chain;
+                free(e);
+            }
+        }
+        free(s->table);
+        free(s->sketch);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(c);
+}
+
+static uint8_t springfield_sketch_estimate(springfield_cshard_t *s, uint32_t h) {
+    uint8_t min = 0xff;
+    int i;
+    for (i = 0; i < CACHE_SKETCH_ROWS; i++) {
+        uint32_t ind = ((h * sketch_seeds[i]) >> 8) & s->sketch_mask;
+        uint8_t v = s->sketch[i * (s->sketch_mask + 1) + ind];
+        if (v < min)
+            min = v;
+    }
+    return min;
+}
+
+static void springfield_sketch_add(springfield_cshard_t *s, uint32_t h) {
+    int i;
+    for (i = 0; i < CACHE_SKETCH_ROWS; i++) {
+        uint32_t ind = ((h * sketch_seeds[i]) >> 8) & s->sketch_mask;
+        uint8_t *v = &s->sketch[i * (s->sketch_mask + 1) + ind];
+        if (*v < 15)
+            ++*v;
+    }
+    if (++s->sketch_adds >= s->sketch_reset) {
+        /* age: halve every counter so old popularity fades */
+        uint32_t j, n = (s->sketch_mask + 1) * CACHE_SKETCH_ROWS;
+        for (j = 0; j < n; j++)
+            s->sketch[j] >>= 1;
+        s->sketch_adds /= 2;
+    }
+}
+
+static springfield_centry_t ** springfield_cache_slot(springfield_cshard_t *s,
+        springfield_key_t *k) {
+    springfield_centry_t **pe = &s->table[k->hash & (s->table_size - 1)];
+    while (*pe) {
+        springfield_centry_t *e = *pe;
+        if (e->hash == k->hash && e->klen == k->klen &&
+                !memcmp(CENTRY_KEY(e), k->key, k->klen))
+            break;
+        pe = &e->chain;
+    }
+    return pe;
+}
+
+static void springfield_cache_unlink(springfield_cshard_t *s,
+        springfield_centry_t **pe) {
+    springfield_centry_t *e = *pe;
+    *pe = e->chain;
+    if (e->next == e) {
+        s->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (s->hand == e)
+            s->hand = e->next;
+    }
+    s->bytes -= CENTRY_SIZE(e);
+    s->count--;
+    free(e);
+}
+
+static void springfield_cache_grow(springfield_cshard_t *s) {
+    uint32_t nsize = s->table_size * 2, b;
+    springfield_centry_t **nt = calloc(nsize, sizeof(springfield_centry_t *));
+    for (b = 0; b < s->table_size; b++) {
+        springfield_centry_t *e = s->table[b], *n;
+        for (; e; e = n) {
+            n = e->chain;
+            e->chain = nt[e->hash & (nsize - 1)];
+            nt[e->hash & (nsize - 1)] = e;
+        }
+    }
+    free(s->table);
+    s->table = nt;
+    s->table_size = nsize;
+}
+
+/* Returns a heap copy of the cached value, or NULL on a miss */
+static uint8_t * springfield_cache_get(springfield_cache_t *c,
+        springfield_key_t *k, uint32_t *len) {
+    springfield_cshard_t *s = springfield_cache_shard(c, k->hash);
+    uint8_t *res = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    springfield_sketch_add(s, k->hash);
+    springfield_centry_t *e = *springfield_cache_slot(s, k);
+    if (e) {
+        e->ref = 1;
+        res = malloc(e->vlen);
+        memcpy(res, CENTRY_VAL(e), e->vlen);
+        *len = e->vlen;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return res;
+}
+
+static void springfield_cache_put(springfield_cache_t *c,
+        springfield_key_t *k, uint8_t *val, uint32_t vlen) {
+    springfield_cshard_t *s = springfield_cache_shard(c, k->hash);
+    uint64_t size = sizeof(springfield_centry_t) + k->klen + vlen;
+    if (size > s->budget)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    springfield_centry_t **pe = springfield_cache_slot(s, k);
+    if (*pe) {
+        /* raced with another reader of the same key */
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    uint8_t freq = springfield_sketch_estimate(s, k->hash);
+    while (s->bytes + size > s->budget) {
+        /* sweep the hand to a victim without its ref bit */
+        springfield_centry_t *v = s->hand;
+        while (v->ref) {
+            v->ref = 0;
+            v = v->next;
+        }
+        s->hand = v;
+        if (springfield_sketch_estimate(s, v->hash) >= freq) {
+            /* not popular enough to displace anything */
+            s->hand = v->next;
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        springfield_key_t vk = {CENTRY_KEY(v), v->klen, v->hash};
+        springfield_cache_unlink(s, springfield_cache_slot(s, &vk));
+    }
+
+    springfield_centry_t *e = malloc(size);
+    e->hash = k->hash;
+    e->klen = k->klen;
+    e->vlen = vlen;
+    e->ref = 0;
+    memcpy(CENTRY_KEY(e), k->key, k->klen);
+    memcpy(CENTRY_VAL(e), val, vlen);
+
+    pe = springfield_cache_slot(s, k);
+    e->chain = NULL;
+    *pe = e;
+    if (s->hand) {
+        /* insert just behind the hand: last to be considered */
+        e->next = s->hand;
+        e->prev = s->hand->prev;
+        e->prev->next = e;
+        s->hand->prev = e;
+    } else {
+        e->next = e->prev = e;
+        s->hand = e;
+    }
+    s->bytes += size;
+    if (++s->count > s->table_size)
+        springfield_cache_grow(s);
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void springfield_cache_invalidate(springfield_cache_t *c,
+        springfield_key_t *k) {
+    springfield_cshard_t *s = springfield_cache_shard(c, k->hash);
+    pthread_mutex_lock(&s->lock);
+    springfield_centry_t **pe = springfield_cache_slot(s, k);
+    if (*pe)
+        springfield_cache_unlink(s, pe);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* -- index memory --
+
+   The bucket offsets and the Bloom filter are touched on every
+   lookup and are far too big for the TLB in 4 KB pages, so
+   they can be backed by transparent huge pages (an anonymous
+   map, 2 MB aligned) and mlock()ed.  Both are best effort:
+   a kernel without THP or a low RLIMIT_MEMLOCK just gets
+   ordinary pages. */
+
+static void * springfield_index_alloc(springfield_options_t *o, uint64_t size) {
+    void *p;
+    if (o->index_hugepages) {
+        size = (size + HUGE_PAGE_SIZE - 1) & ~((uint64_t)HUGE_PAGE_SIZE - 1);
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(p != MAP_FAILED);
+        madvise(p, size, MADV_HUGEPAGE);
     } else {
-        r->mmap_alloc = r->eof;
-        r->map = (uint8_t *)mmap(
-            NULL, r->mmap_alloc, PROT_READ, MAP_PRIVATE, r->mapfd, 0);
-        assert(r->map);
+        p = calloc(1, size);
+        assert(p);
+    }
+    if (o->index_mlock)
+        mlock(p, size);
+    return p;
+}
+
+static void springfield_index_free(springfield_options_t *o, void *p, uint64_t size) {
+    if (!p)
+        return;
+    if (o->index_hugepages)
+        size = (size + HUGE_PAGE_SIZE - 1) & ~((uint64_t)HUGE_PAGE_SIZE - 1);
+    if (o->index_mlock)
+        munlock(p, size);
+    if (o->index_hugepages) {
+        munmap(p, size);
+    } else {
+        free(p);
+    }
+}
+
+static uint64_t * springfield_offsets_alloc(springfield_t *r) {
+    uint64_t *offsets = springfield_index_alloc(&r->opts,
+        r->num_buckets * sizeof(uint64_t));
+    memset(offsets, 0xff, r->num_buckets * sizeof(uint64_t));
+    return offsets;
+}
+
+static int springfield_map_advice(springfield_options_t *o) {
+    switch (o->map_advice) {
+    case SPRINGFIELD_ADVICE_NORMAL:
+        return MADV_NORMAL;
+    case SPRINGFIELD_ADVICE_SEQUENTIAL:
+        return MADV_SEQUENTIAL;
+    case SPRINGFIELD_ADVICE_WILLNEED:
+        return MADV_WILLNEED;
+    default:
+        return MADV_RANDOM;
+    }
+}
+
+/* -- negative lookup filter --
+
+   A blocked Bloom filter over the key hashes of every live
+   record: all of a key's probe bits fall in one 64-byte block,
+   so a check costs a single cache miss.  Lookups that the
+   filter rules out never touch the file.
+
+   Built at load, fed by set_i (tombstones aren't added; a key
+   that is only a tombstone is as absent as one never written)
+   and rebuilt for free by compaction, which writes every live
+   key into the new db.  Readers hold main_lock for read and
+   set_i holds it for write, so plain loads/stores suffice.
+
+   `count` only goes up for hashes that set a new bit, so it
+   tracks distinct keys rather than writes.  Once it passes
+   `capacity`, writers rebuild the filter twice as big from the
+   chains, a slice at a time (see springfield_bloom_maintain()). */
+
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+
+struct springfield_bloom_t {
+    uint64_t *bits;
+    uint64_t num_blocks;
+    uint64_t capacity;
+    uint64_t count;
+    int probes;
+};
+
+static springfield_bloom_t * springfield_bloom_create(springfield_options_t *o,
+        uint64_t capacity, uint32_t bits_per_key) {
+    springfield_bloom_t *b = calloc(1, sizeof(springfield_bloom_t));
+    if (capacity < 1024)
+        capacity = 1024;
+    b->capacity = capacity;
+    b->num_blocks = (capacity * bits_per_key + BLOOM_BLOCK_BITS - 1)
+        / BLOOM_BLOCK_BITS;
+    b->bits = springfield_index_alloc(o,
+        b->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    /* k = ln 2 * bits/key */
+    b->probes = (bits_per_key * 69 + 50) / 100;
+    if (b->probes < 1)
+        b->probes = 1;
+    if (b->probes > 16)
+        b->probes = 16;
+    return b;
+}
+
+static void springfield_bloom_destroy(springfield_options_t *o,
+        springfield_bloom_t *b) {
+    springfield_index_free(o, b->bits,
+        b->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    free(b);
+}
+
+static uint64_t * springfield_bloom_block(springfield_bloom_t *b, uint32_t h,
+        uint32_t *a, uint32_t *step) {
+    /* remix so the block doesn't correlate with hash % num_buckets */
+    uint64_t x = (uint64_t)h * 0x9e3779b97f4a7c15ULL;
+    uint64_t block = ((x >> 32) * b->num_blocks) >> 32;
+    *a = (uint32_t)x;
+    *step = (uint32_t)(x >> 17) | 1;
+    return &b->bits[block * BLOOM_BLOCK_WORDS];
+}
+
+static void springfield_bloom_add(springfield_bloom_t *b, uint32_t h) {
+    uint32_t a, step;
+    uint64_t *w = springfield_bloom_block(b, h, &a, &step);
+    uint64_t fresh = 0;
+    int i;
+    for (i = 0; i < b->probes; i++) {
+        uint32_t bit = a % BLOOM_BLOCK_BITS;
+        fresh |= ~w[bit / 64] & (1ULL << (bit % 64));
+        w[bit / 64] |= 1ULL << (bit % 64);
+        a += step;
+    }
+    if (fresh)
+        b->count++;
+}
+
+static int springfield_bloom_maybe(springfield_bloom_t *b, uint32_t h) {
+    uint32_t a, step;
+    uint64_t *w = springfield_bloom_block(b, h, &a, &step);
+    int i;
+    for (i = 0; i < b->probes; i++) {
+        uint32_t bit = a % BLOOM_BLOCK_BITS;
+        if (!(w[bit / 64] & (1ULL << (bit % 64))))
+            return 0;
+        a += step;
+    }
+    return 1;
+}
+
+/* -- blob files --
+
+   Values of at least options.blob_threshold bytes are appended
+   to a separate blob file and the db record holds only a
+   springfield_blob_ptr (flagged FLAG_BLOB).  Compaction then
+   copies the pointer, not the value, and chains stay short.
+
+   Blob files are `<path>.blob.<gen>`:
+
+   |     magic     |      gen      |
+   | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 |
+
+   followed by entries of a 12 byte header (crc, vlen, klen,
+   flags), the key and the value.  The key is there so blob GC
+   can ask the index whether an entry is still live.
+
+   A blob file's eof isn't stored: load takes it from the
+   furthest pointer it sees, and anything past that was never
+   linked from the db.  The map may write a record back before
+   its blob, so load checks the entry behind every pointer whose
+   record it CRC-checks, and sync writes the blob files out
+   first.  GC copies live entries into gen + 1, appends fresh
+   pointers for them, syncs the db and only then deletes the old
+   file, so a crash at any point leaves every live pointer with a
+   file behind it.  Up to BLOB_GENS
+   generations can be open at once (more only after repeated
+   crashes mid-GC). */
+
+static void springfield_blob_path(springfield_t *r, uint32_t gen,
+        char *buf, size_t len) {
+    snprintf(buf, len, "%s.blob.%u", r->path, gen);
+}
+
+static springfield_blobs_t * springfield_blobs_for(springfield_t *r, uint32_t gen) {
+    springfield_blobs_t *b = r->blobs[gen % BLOB_GENS];
+    return b && b->gen == gen ? b : NULL;
+}
+
+static void springfield_blobs_map(springfield_blobs_t *b) {
+    int s = ftruncate(b->fd, (off_t)b->alloc);
+    assert(!s);
+    b->map = (uint8_t *)mmap(
+        NULL, b->alloc, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+    assert(b->map != MAP_FAILED);
+    madvise(b->map, b->alloc, MADV_RANDOM);
+}
+
+/* Open (or create) generation `gen`, whose live data ends at
+   `eof`.  Returns NULL if it doesn't exist and !create. */
+static springfield_blobs_t * springfield_blobs_open(springfield_t *r,
+        uint32_t gen, uint64_t eof, int create) {
+    char path[1200];
+    struct stat st;
+    springfield_blob_path(r, gen, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        assert(!create);
+        return NULL;
+    }
+    int s = fstat(fd, &st);
+    assert(!s);
+
+    springfield_blobs_t *b = calloc(1, sizeof(springfield_blobs_t));
+    b->gen = gen;
+    b->fd = fd;
+    b->eof = eof > BLOB_FILE_HEADER ? eof : BLOB_FILE_HEADER;
+    b->alloc = (uint64_t)st.st_size > b->eof ? (uint64_t)st.st_size : b->eof;
+    b->alloc += MMAP_OVERFLOW;
+    springfield_blobs_map(b);
+
+    uint32_t *hdr = (uint32_t *)b->map;
+    hdr[0] = BLOB_MAGIC;
+    hdr[1] = gen;
+
+    return b;
+}
+
+static void springfield_blobs_close(springfield_blobs_t *b) {
+    munmap(b->map, b->alloc);
+    close(b->fd);
+    free(b);
+}
+
+static void springfield_blobs_reserve(springfield_blobs_t *b, uint64_t step) {
+    if (b->eof + step <= b->alloc)
+        return;
+    msync(b->map, b->alloc, MS_SYNC);
+    munmap(b->map, b->alloc);
+    b->alloc += (b->eof + step) * 2;
+    springfield_blobs_map(b);
+}
+
+/* Append an entry, whose CRC is `crc`, to `b`; caller holds
+   main_lock for write (or owns `b` outright, as GC does for the
+   generation it fills) */
+static springfield_blob_ptr springfield_blobs_append(springfield_blobs_t *b,
+        springfield_key_t *k, uint8_t *val, uint32_t vlen, uint32_t crc) {
+    uint64_t step = BLOB_HEADER_SIZE + k->klen + vlen;
+    springfield_blobs_reserve(b, step);
+
+    uint8_t *p = b->map + b->eof;
+    springfield_blob_header *h = (springfield_blob_header *)p;
+    h->vlen = vlen;
+    h->klen = k->klen;
+    h->flags = 0;
+    memcpy(p + BLOB_HEADER_SIZE, k->key, k->klen);
+    memcpy(p + BLOB_HEADER_SIZE + k->klen, val, vlen);
+    h->crc = crc;
+
+    springfield_blob_ptr ptr = {b->eof, vlen, b->gen};
+    b->eof += step;
+    return ptr;
+}
+
+/* The value behind a FLAG_BLOB record, or NULL if its file is
+   gone (only ever true of superseded records) or the entry there
+   isn't the one the pointer was made for */
+static uint8_t * springfield_blob_value(springfield_t *r, uint8_t *rec_val) {
+    springfield_blob_ptr ptr;
+    memcpy(&ptr, rec_val, sizeof(ptr));
+    springfield_blobs_t *b = springfield_blobs_for(r, ptr.gen);
+    if (!b || ptr.off + BLOB_HEADER_SIZE > b->eof)
+        return NULL;
+    springfield_blob_header *h = (springfield_blob_header *)(b->map + ptr.off);
+    if (h->vlen != ptr.vlen ||
+            ptr.off + BLOB_HEADER_SIZE + h->klen + h->vlen > b->eof)
+        return NULL;
+    return b->map + ptr.off + BLOB_HEADER_SIZE + h->klen;
+}
+
+double springfield_bucket_count(springfield_t *r) {
+    return r->num_buckets;
+}
+
+/* Map the file for reading and appending */
+static void springfield_load_map(springfield_t *r) {
+    r->mmap_alloc = r->eof + MMAP_OVERFLOW;
+    int s = ftruncate(r->mapfd, (off_t)r->mmap_alloc);
+    assert(!s);
+
+    r->map = (uint8_t *)mmap(
+        NULL, r->mmap_alloc, PROT_READ | PROT_WRITE, MAP_SHARED |
+        (r->opts.warmup == SPRINGFIELD_WARMUP_POPULATE ? MAP_POPULATE : 0),
+        r->mapfd, 0);
+    s = madvise(r->map, r->mmap_alloc, springfield_map_advice(&r->opts));
+    assert(!s);
+
+    uint32_t buckets_on_record = *(uint32_t *)r->map;
+    if (buckets_on_record) {
+        assert(buckets_on_record == r->num_buckets);
+    } else {
+        *(uint32_t *)r->map = r->num_buckets;
+        assert(r->eof == 0);
+        r->eof = 4;
+    }
+
+    assert(r->map);
+}
+
+/* Write the bucket count into a new file; reads go through the pool */
+static void springfield_load_pool(springfield_t *r) {
+    if (!r->eof) {
+        ssize_t n = pwrite(r->mapfd, &r->num_buckets, 4, 0);
+        assert(n == 4);
+        r->eof = 4;
+    }
+    r->pool = springfield_pool_create(&r->opts, r->path,
+        r->opts.pool_bytes ? r->opts.pool_bytes : POOL_DEFAULT_BYTES);
+}
+
+/* Load's view of the file: the (read-only) map, or for the pool
+   backend a window read in LOAD_CHUNK at a time */
+typedef struct springfield_loader_t {
+    uint8_t *map;
+    int fd;
+    uint8_t *buf;
+    uint64_t start;
+    uint64_t len;
+    uint64_t alloc;
+} springfield_loader_t;
+
+#define LOAD_CHUNK (4 * 1024 * 1024)
+
+/* `len` bytes at `off`, or as many as there are before `eof` */
+static uint8_t * springfield_loader_at(springfield_loader_t *l, uint64_t off,
+        uint64_t len, uint64_t eof) {
+    if (l->map)
+        return l->map + off;
+    if (off + len > eof)
+        len = eof - off;
+    if (off >= l->start && off + len <= l->start + l->len)
+        return l->buf + (off - l->start);
+
+    uint64_t want = len > LOAD_CHUNK ? len : LOAD_CHUNK;
+    if (want > eof - off)
+        want = eof - off;
+    if (want > l->alloc) {
+        l->buf = realloc(l->buf, want);
+        l->alloc = want;
+    }
+    l->start = off;
+    l->len = 0;
+    while (l->len < want) {
+        ssize_t n = pread(l->fd, l->buf + l->len, want - l->len, off + l->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        assert(n > 0);
+        l->len += n;
+    }
+    return l->buf;
+}
+
+/* Load's look at blob entries, one open file per generation */
+typedef struct springfield_blob_check_t {
+    uint32_t gen;
+    uint64_t size;
+    springfield_loader_t l;
+} springfield_blob_check_t;
+
+/* Whether the blob entry behind a record of key length `klen`
+   was written out whole and matches its CRC.  A pointer into a
+   file that's gone is superseded (GC deleted the file) and
+   passes. */
+static int springfield_blob_check(springfield_t *r,
+        springfield_blob_check_t *checks, springfield_blob_ptr *ptr,
+        uint32_t klen) {
+    springfield_blob_check_t *c = &checks[ptr->gen % BLOB_GENS];
+    if (c->gen != ptr->gen) {
+        char path[1200];
+        struct stat st;
+        if (c->l.fd > -1)
+            close(c->l.fd);
+        c->gen = ptr->gen;
+        c->size = 0;
+        c->l.len = 0;
+        springfield_blob_path(r, ptr->gen, path, sizeof(path));
+        c->l.fd = open(path, O_RDONLY);
+        if (c->l.fd > -1 && !fstat(c->l.fd, &st))
+            c->size = st.st_size;
+    }
+    if (c->l.fd < 0)
+        return 1;
+
+    uint64_t step = BLOB_HEADER_SIZE + klen + (uint64_t)ptr->vlen;
+    if (ptr->off < BLOB_FILE_HEADER || ptr->off + step > c->size)
+        return 0;
+    uint8_t *p = springfield_loader_at(&c->l, ptr->off, step, c->size);
+    springfield_blob_header *bh = (springfield_blob_header *)p;
+    return bh->vlen == ptr->vlen && bh->klen == klen &&
+        crc32(0, p + 4, step - 4) == bh->crc;
+}
+
+/* -- checkpoints --
+
+   Records below eof never change, so a consistent copy of the db
+   is just its first eof bytes (and of each blob file, its first
+   eof bytes): springfield_checkpoint() notes the watermarks, then
+   copies with copy_file_range() (a reflink where the filesystem
+   can) from dup()s of the files, so compaction or blob GC
+   swapping them out midway doesn't matter.
+
+   Alongside goes the index as of the watermark, in `path`.idx,
+   so opening the copy with options.trusted_open needn't scan it.
+   The live index is read a
+   chunk of buckets at a time under the read lock, and a head
+   appended since the watermark is walked back down its chain to
+   the last record before it.  Taking the index means not checking
+   the CRCs of what it covers, so load only looks at an index file
+   with options.trusted_open, and only takes one that matches: same
+   bucket count, covering no more than the file holds, and naming
+   a record there that has the CRC it says (a compacted file
+   won't).  Records past its eof are then scanned as usual; with a
+   Bloom filter, only the keys it covers are hashed.  trusted_open
+   also writes a db's own index file at close. */
+
+#define INDEX_MAGIC 0x31494653 /* "SFI1" */
+#define INDEX_CHUNK 65536
+#define CHECKPOINT_CHUNK (8 * 1024 * 1024)
+
+typedef struct springfield_index_header {
+    uint32_t crc;           /* of the rest, then the offsets */
+    uint32_t magic;
+    uint32_t num_buckets;
+    uint32_t check_crc;     /* the CRC of the record at check_off */
+    uint64_t check_off;
+    uint64_t eof;
+    springfield_blob_ptr blob_ends[BLOB_GENS];
+} springfield_index_header;
+
+static void springfield_index_path(char *path, char *buf, size_t len) {
+    snprintf(buf, len, "%s.idx", path);
+}
+
+/* Fill r->offsets and `blob_ends` from r's index file; returns
+   where load's scan should start */
+static uint64_t springfield_index_restore(springfield_t *r,
+        springfield_loader_t *l, springfield_blob_ptr *blob_ends) {
+    char path[1200];
+    springfield_index_header ih;
+    springfield_rec h;
+    uint64_t bytes = r->num_buckets * sizeof(uint64_t);
+
+    springfield_index_path(r->path, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 4;
+    int ok = pread(fd, &ih, sizeof(ih), 0) == sizeof(ih) &&
+        ih.magic == INDEX_MAGIC && ih.num_buckets == r->num_buckets &&
+        ih.eof > 4 && ih.eof <= r->eof &&
+        ih.check_off >= 4 && ih.check_off < ih.eof;
+    if (ok) {
+        uint8_t *p = springfield_loader_at(l, ih.check_off, HEADER_MAX_SIZE, r->eof);
+        ok = springfield_rec_decode(p, ih.check_off, r->eof - ih.check_off, &h) &&
+            *(uint32_t *)p == ih.check_crc;
+    }
+    if (ok) {
+        uint64_t done = 0;
+        while (done < bytes) {
+            ssize_t n = pread(fd, (uint8_t *)r->offsets + done, bytes - done,
+                sizeof(ih) + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        uint32_t crc = crc32(0, (uint8_t *)&ih + 4, sizeof(ih) - 4);
+        ok = done == bytes &&
+            crc32(crc, (uint8_t *)r->offsets, bytes) == ih.crc;
+        if (!ok)
+            memset(r->offsets, 0xff, bytes);
+    }
+    close(fd);
+    if (!ok)
+        return 4;
+    memcpy(blob_ends, ih.blob_ends, sizeof(ih.blob_ends));
+    return ih.eof;
+}
+
+static int springfield_write_all(int fd, uint8_t *buf, uint64_t len, uint64_t off) {
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Copy the first `len` bytes of `in` to a new file at `path`,
+   `rate` bytes a second at most (0 for flat out) */
+static int springfield_copy_prefix(int in, char *path, uint64_t len, uint64_t rate) {
+    int out = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+        S_IRUSR | S_IWUSR);
+    if (out < 0)
+        return -1;
+    uint64_t done = 0, start = springfield_now_ns();
+    uint8_t *buf = NULL;
+    int s = 0;
+    while (done < len) {
+        uint64_t want = len - done < CHECKPOINT_CHUNK ? len - done : CHECKPOINT_CHUNK;
+        ssize_t n;
+        if (!buf) {
+            loff_t from = done, to = done;
+            n = copy_file_range(in, &from, out, &to, want, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS ||
+                    errno == EINVAL || errno == EOPNOTSUPP)) {
+                /* across filesystems, or an old kernel */
+                buf = malloc(CHECKPOINT_CHUNK);
+                continue;
+            }
+        } else {
+            n = pread(in, buf, want, done);
+            if (n > 0 && springfield_write_all(out, buf, n, done))
+                n = -1;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            s = -1;
+            break;
+        }
+        done += n;
+
+        if (rate) {
+            uint64_t due = start + (uint64_t)((double)done * 1e9 / rate);
+            uint64_t now = springfield_now_ns();
+            if (due > now) {
+                struct timespec ts = {(due - now) / 1000000000ULL,
+                    (due - now) % 1000000000ULL};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    free(buf);
+    if (!s)
+        s = fsync(out);
+    close(out);
+    return s;
+}
+
+static int springfield_index_write(char *path, springfield_index_header *ih,
+        uint64_t *offsets) {
+    char ipath[1200], tpath[1210];
+    uint64_t bytes = ih->num_buckets * sizeof(uint64_t);
+    springfield_index_path(path, ipath, sizeof(ipath));
+    snprintf(tpath, sizeof(tpath), "%s.tmp", ipath);
+
+    ih->crc = crc32(crc32(0, (uint8_t *)ih + 4, sizeof(*ih) - 4),
+        (uint8_t *)offsets, bytes);
+    int fd = open(tpath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+        S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return -1;
+    int s = springfield_write_all(fd, (uint8_t *)ih, sizeof(*ih), 0);
+    if (!s)
+        s = springfield_write_all(fd, (uint8_t *)offsets, bytes, sizeof(*ih));
+    if (!s)
+        s = fsync(fd);
+    close(fd);
+    if (!s)
+        s = rename(tpath, ipath);
+    if (s)
+        unlink(tpath);
+    return s;
+}
+
+/* Write r's own index file; nothing may be appending */
+static void springfield_index_save(springfield_t *r) {
+    springfield_index_header ih;
+    springfield_pin_t pin = PIN_INIT;
+    uint64_t i;
+    int g;
+
+    memset(&ih, 0, sizeof(ih));
+    ih.magic = INDEX_MAGIC;
+    ih.num_buckets = r->num_buckets;
+    ih.eof = r->eof;
+    for (i = 0; i < r->num_buckets; i++) {
+        if (r->offsets[i] != NO_BACKTRACE && r->offsets[i] > ih.check_off)
+            ih.check_off = r->offsets[i];
+    }
+    if (!ih.check_off)
+        return;
+    ih.check_crc = *(uint32_t *)springfield_bytes(r, ih.check_off, 4, &pin);
+    springfield_unpin(r, &pin);
+    for (g = 0; g < BLOB_GENS; g++) {
+        if (r->blobs[g]) {
+            ih.blob_ends[g].gen = r->blobs[g]->gen;
+            ih.blob_ends[g].off = r->blobs[g]->eof;
+        }
+    }
+    /* the index vouches for what it covers, so that has to be on
+       disk before it is; best effort: without it the next open scans */
+    if (!springfield_sync_i(r))
+        springfield_index_write(r->path, &ih, r->offsets);
+}
+
+int springfield_checkpoint(springfield_t *r, char *path, uint64_t bytes_per_sec) {
+    springfield_index_header ih;
+    int fds[BLOB_GENS], g, s;
+    uint64_t i, j;
+    char bpath[1200];
+
+    memset(&ih, 0, sizeof(ih));
+    ih.magic = INDEX_MAGIC;
+
+    /* a stale index must not outlive the data it indexed */
+    springfield_index_path(path, bpath, sizeof(bpath));
+    unlink(bpath);
+
+    springfield_wbuf_flush(r);
+    /* no compaction until the index is captured */
+    springfield_iter_lock(r);
+    springfield_rdlock(r);
+    ih.eof = r->eof;
+    ih.num_buckets = r->num_buckets;
+    int fd = dup(r->mapfd);
+    assert(fd > -1);
+    for (g = 0; g < BLOB_GENS; g++) {
+        fds[g] = -1;
+        if (r->blobs[g]) {
+            ih.blob_ends[g].gen = r->blobs[g]->gen;
+            ih.blob_ends[g].off = r->blobs[g]->eof;
+            fds[g] = dup(r->blobs[g]->fd);
+            assert(fds[g] > -1);
+        }
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+
+    uint64_t *offsets = malloc(ih.num_buckets * sizeof(uint64_t));
+    for (i = 0; i < ih.num_buckets; i += INDEX_CHUNK) {
+        uint64_t end = i + INDEX_CHUNK < ih.num_buckets ? i + INDEX_CHUNK : ih.num_buckets;
+        springfield_rdlock(r);
+        for (j = i; j < end; j++) {
+            uint64_t off = r->offsets[j];
+            while (off != NO_BACKTRACE && off >= ih.eof) {
+                springfield_pin_t pin = PIN_INIT;
+                springfield_rec h;
+                springfield_rec_pin(r, off, &h, 0, &pin);
+                springfield_unpin(r, &pin);
+                off = h.last;
+            }
+            offsets[j] = off;
+            if (off != NO_BACKTRACE && off >= ih.check_off)
+                ih.check_off = off;
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    if (ih.check_off) {
+        springfield_rdlock(r);
+        springfield_pin_t pin = PIN_INIT;
+        ih.check_crc = *(uint32_t *)springfield_bytes(r, ih.check_off, 4, &pin);
+        springfield_unpin(r, &pin);
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    r->checkpoints++;
+    pthread_mutex_unlock(&r->iter_lock);
+
+    s = springfield_copy_prefix(fd, path, ih.eof, bytes_per_sec);
+    close(fd);
+    for (g = 0; g < BLOB_GENS; g++) {
+        if (fds[g] < 0)
+            continue;
+        snprintf(bpath, sizeof(bpath), "%s.blob.%u", path, ih.blob_ends[g].gen);
+        if (!s)
+            s = springfield_copy_prefix(fds[g], bpath, ih.blob_ends[g].off,
+                bytes_per_sec);
+        close(fds[g]);
+    }
+    if (!s && ih.check_off)
+        s = springfield_index_write(path, &ih, offsets);
+    free(offsets);
+    return s ? -1 : 0;
+}
+
+static void springfield_load(springfield_t *r, uint64_t bloom_capacity) {
+
+    struct stat st;
+    uint32_t *live_hashes = NULL;
+    uint64_t num_live = 0, live_alloc = 0;
+    springfield_blob_ptr blob_ends[BLOB_GENS] = {{0}};
+    springfield_blob_check_t checks[BLOB_GENS];
+    int i;
+
+    for (i = 0; i < BLOB_GENS; i++) {
+        memset(&checks[i], 0, sizeof(checks[i]));
+        checks[i].l.fd = -1;
+    }
+
+    r->mapfd = open(r->path,
+            O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(r->mapfd > -1);
+
+    int s = fstat(r->mapfd, &st);
+    if (!s) {
+        r->eof = st.st_size >= 4 ? st.st_size : 0;
+    }
+
+    r->map = NULL;
+
+    if (!r->eof) {
+        r->offsets = springfield_offsets_alloc(r);
+
+    } else {
+        springfield_loader_t l = {NULL, r->mapfd, NULL, 0, 0, 0};
+        if (r->opts.backend == SPRINGFIELD_BACKEND_MMAP) {
+            r->mmap_alloc = r->eof;
+            r->map = (uint8_t *)mmap(
+                NULL, r->mmap_alloc, PROT_READ, MAP_PRIVATE, r->mapfd, 0);
+            assert(r->map);
+
+            s = madvise(r->map, r->mmap_alloc, MADV_SEQUENTIAL);
+            assert(!s);
+            l.map = r->map;
+        } else {
+            posix_fadvise(r->mapfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        uint8_t *p = springfield_loader_at(&l, 0, 4, r->eof);
+
+        r->num_buckets = *(uint32_t *)p;
+        r->offsets = springfield_offsets_alloc(r);
+
+        if (r->eof > 4) {
+            p = springfield_loader_at(&l, 4, TAIL_BASE_MAX, r->eof);
+            springfield_tail_base_parse(r, p, r->eof - 4);
+        }
+
+        uint64_t off = 4, covered = 4;
+        if (r->opts.trusted_open)
+            covered = springfield_index_restore(r, &l, blob_ends);
+        /* the Bloom filter wants every key, indexed or not */
+        if (!r->opts.bloom_bits_per_key)
+            off = covered;
+
+        while (1) {
+            springfield_rec h;
+            p = springfield_loader_at(&l, off, HEADER_MAX_SIZE, r->eof);
+            if (!springfield_rec_decode(p, off, r->eof - off, &h)) {
+                r->eof = off;
+                break;
+            }
+            uint64_t jump = (uint64_t)h.hlen + h.klen + h.vlen;
+            if (off + jump > r->eof) {
+                r->eof = off;
+                break;
+            }
+            p = springfield_loader_at(&l, off, jump, r->eof);
+
+            /* Check CRC32, unless the index file vouches for it */
+            if (off >= covered && crc32(0, p + 4, jump - 4) != *(uint32_t *)p) {
+                r->eof = off;
+                break;
+            }
+
+            /* A blob record may have reached the disk before its
+               blob did; then it was never really written */
+            if (off >= covered && (h.flags & FLAG_BLOB)) {
+                springfield_blob_ptr ptr;
+                memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+                if (!springfield_blob_check(r, checks, &ptr, h.klen)) {
+                    r->eof = off;
+                    break;
+                }
+            }
+
+            if (h.flags & FLAG_PAD) {
+                off += jump;
+                continue;
+            }
+
+            springfield_key_t k;
+            springfield_key_init(&k, (char *)(p + h.hlen));
+
+            if (off >= covered) {
+                uint64_t prev = springfield_index_keyval(r, &k, off);
+                assert(prev == h.last);
+            }
+
+            if (h.flags & FLAG_BLOB) {
+                springfield_blob_ptr ptr, *end;
+                memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+                end = &blob_ends[ptr.gen % BLOB_GENS];
+                if (ptr.gen > end->gen) {
+                    end->gen = ptr.gen;
+                    end->off = 0;
+                }
+                if (ptr.gen == end->gen) {
+                    uint64_t e = ptr.off + BLOB_HEADER_SIZE + h.klen + ptr.vlen;
+                    if (e > end->off)
+                        end->off = e;
+                }
+            }
+
+            if (r->opts.bloom_bits_per_key && h.vlen) {
+                if (num_live == live_alloc) {
+                    live_alloc = live_alloc ? live_alloc * 2 : 4096;
+                    live_hashes = realloc(live_hashes,
+                        live_alloc * sizeof(uint32_t));
+                }
+                live_hashes[num_live++] = k.hash;
+            }
+
+            off += jump;
+        }
+
+        if (r->map) {
+            munmap(r->map, r->mmap_alloc);
+            r->map = NULL;
+            r->mmap_alloc = 0;
+        }
+        free(l.buf);
+        for (i = 0; i < BLOB_GENS; i++) {
+            if (checks[i].l.fd > -1)
+                close(checks[i].l.fd);
+            free(checks[i].l.buf);
+        }
+    }
+
+    if (r->opts.backend == SPRINGFIELD_BACKEND_POOL)
+        springfield_load_pool(r);
+    else
+        springfield_load_map(r);
+
+    if (r->opts.bloom_bits_per_key) {
+        uint64_t i;
+        r->bloom = springfield_bloom_create(&r->opts,
+            num_live > bloom_capacity ? num_live : bloom_capacity,
+            r->opts.bloom_bits_per_key);
+        for (i = 0; i < num_live; i++)
+            springfield_bloom_add(r->bloom, live_hashes[i]);
+        free(live_hashes);
+    }
+
+    r->blob_gen = 1;
+    for (i = 0; i < BLOB_GENS; i++) {
+        if (blob_ends[i].gen) {
+            r->blobs[i] = springfield_blobs_open(r, blob_ends[i].gen,
+                blob_ends[i].off, 0);
+            if (blob_ends[i].gen > r->blob_gen)
+                r->blob_gen = blob_ends[i].gen;
+        }
+    }
+}
+
+void springfield_options_init(springfield_options_t *o) {
+    memset(o, 0, sizeof(springfield_options_t));
+}
+
+/* `bloom_capacity` sizes the filter when the caller knows how
+   many keys are coming (compaction does) */
+static springfield_t * springfield_create_i(char *path, uint32_t num_buckets,
+        springfield_options_t *opts, uint64_t bloom_capacity, int scratch) {
+    assert(sizeof(void *) == 8); // Springfield needs 64-bit system
+    springfield_t *r = calloc(1, sizeof(springfield_t));
+    if (opts)
+        r->opts = *opts;
+    else
+        springfield_options_init(&r->opts);
+    r->num_buckets = num_buckets;
+    r->path = malloc(strlen(path) + 1);
+    strcpy(r->path, path);
+    r->mmap_alloc = 0;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    int res = pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    assert(!res);
+    pthread_rwlock_init(&r->main_lock, &attr);
+    pthread_mutex_init(&r->iter_lock, NULL);
+
+    springfield_load(r, bloom_capacity > num_buckets ?
+        bloom_capacity : num_buckets);
+
+    if (r->opts.cache_bytes)
+        r->cache = springfield_cache_create(r->opts.cache_bytes);
+
+    if (!scratch) {
+        res = posix_memalign((void **)&r->stats, 64,
+            STAT_STRIPES * sizeof(springfield_stripe_t));
+        assert(!res);
+        memset(r->stats, 0, STAT_STRIPES * sizeof(springfield_stripe_t));
+    }
+
+    if (r->opts.warmup == SPRINGFIELD_WARMUP_BACKGROUND) {
+        res = pthread_create(&r->warmup_thread, NULL,
+            springfield_warmup_thread, r);
+        assert(!res);
+        r->warmup_running = 1;
+    }
+
+    if (r->opts.scrub_bytes_per_sec && !scratch) {
+        res = pthread_create(&r->scrub_thread, NULL,
+            springfield_scrub_thread, r);
+        assert(!res);
+        r->scrub_running = 1;
+    }
+
+    if (r->opts.autopilot && !scratch) {
+        res = pthread_create(&r->autopilot_thread, NULL,
+            springfield_autopilot_thread, r);
+        assert(!res);
+        r->autopilot_running = 1;
+    }
+
+    if (r->opts.write_buffer_bytes)
+        springfield_wbuf_start(r);
+
+    return r;
+}
+
+springfield_t * springfield_create_opts(char *path, uint32_t num_buckets,
+        springfield_options_t *opts) {
+    return springfield_create_i(path, num_buckets, opts, 0, 0);
+}
+
+springfield_t * springfield_create(char *path, uint32_t num_buckets) {
+    return springfield_create_opts(path, num_buckets, NULL);
+}
+
+static void springfield_record_seeks(springfield_t *r, int seeks, int hit) {
+    if (!r->stats)
+        return;
+    springfield_stripe_t *st = springfield_stripe(r);
+    STAT_ADD(st->chain_lengths[seeks < SPRINGFIELD_CHAIN_BUCKETS ?
+        seeks : SPRINGFIELD_CHAIN_BUCKETS - 1], 1);
+    if (hit) {
+        /* this stripe's ring is only shared past STAT_STRIPES threads;
+           a lost store there is harmless */
+        st->seeks[st->seek_pos++ % STAT_SEEKS] = seeks;
+    }
+}
+
+/* Offset of the newest record for `k` (possibly a tombstone),
+   or NO_BACKTRACE.  `*seeks` gets the number of records visited. */
+static uint64_t springfield_find_i(springfield_t *r, springfield_key_t *k, int *seeks) {
+    uint64_t off = springfield_index_lookup(r, k);
+
+    *seeks = 0;
+    if (r->pool) {
+        while (off != NO_BACKTRACE) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            ++*seeks;
+            uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+            int match = h.klen == k->klen && !memcmp(p + h.hlen, k->key, k->klen);
+            springfield_unpin(r, &pin);
+            if (match)
+                return off;
+            off = h.last;
+        }
+        return NO_BACKTRACE;
+    }
+
+    while (off != NO_BACKTRACE) {
+        springfield_rec h;
+        ++*seeks;
+        springfield_rec_at(r, off, &h);
+        /* start fetching the next hop while comparing this one */
+        if (h.last != NO_BACKTRACE)
+            __builtin_prefetch(r->map + h.last);
+        if (h.klen == k->klen &&
+                !memcmp(REC_KEY(r, off, h), k->key, k->klen))
+            return off;
+        off = h.last;
+    }
+    return NO_BACKTRACE;
+}
+
+/* The logical value of the record at `off`: bytes in the file, or
+   behind a blob pointer.  NULL for tombstones.  Good until `pin`
+   is released.  `rewrite` (if not NULL) is as for springfield_fold(). */
+static uint8_t * springfield_value_at(springfield_t *r, uint64_t off, uint32_t *len,
+        springfield_pin_t *pin, uint64_t *rewrite) {
+    springfield_rec h;
+    uint8_t *val = springfield_rec_pin(r, off, &h, 1, pin);
+    val += h.hlen + h.klen;
+    if (h.vlen == 0)
+        return NULL;
+    if (h.flags & FLAG_OPERAND) {
+        springfield_unpin(r, pin);
+        return pin->copy = springfield_fold(r, off, len, rewrite);
+    }
+    if (h.flags & FLAG_BLOB) {
+        springfield_blob_ptr ptr;
+        memcpy(&ptr, val, sizeof(ptr));
+        *len = ptr.vlen;
+        return springfield_blob_value(r, val);
+    }
+    *len = h.vlen;
+    return val;
+}
+
+/* The operand records of the key whose newest record is at `off`,
+   newest first (malloc'd, *n of them), and the offset of the plain
+   record below them in *base (NO_BACKTRACE if none) */
+static uint64_t * springfield_operands(springfield_t *r, uint64_t off,
+        uint64_t *n, uint64_t *base) {
+    springfield_pin_t pin = PIN_INIT;
+    springfield_rec h;
+    uint64_t *ops = NULL, alloc = 0;
+
+    uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+    uint32_t klen = h.klen;
+    char *key = strdup((char *)p + h.hlen);
+    springfield_unpin(r, &pin);
+
+    *n = 0;
+    *base = NO_BACKTRACE;
+    while (off != NO_BACKTRACE) {
+        p = springfield_rec_pin(r, off, &h, 0, &pin);
+        int match = h.klen == klen && !memcmp(p + h.hlen, key, klen);
+        springfield_unpin(r, &pin);
+        if (match && !(h.flags & FLAG_OPERAND)) {
+            *base = off;
+            break;
+        }
+        if (match) {
+            if (*n == alloc) {
+                alloc = alloc ? alloc * 2 : 16;
+                ops = realloc(ops, alloc * sizeof(uint64_t));
+            }
+            ops[(*n)++] = off;
+        }
+        off = h.last;
+    }
+    free(key);
+    return ops;
+}
+
+/* A value being folded: `cur` (NULL for none) is malloc'd with
+   room for `cap` bytes once `owned`, and until then points at
+   the base value wherever that is */
+typedef struct springfield_folding_t {
+    uint8_t *cur;
+    uint32_t len;
+    uint64_t cap;
+    int owned;
+} springfield_folding_t;
+
+/* Apply one operand (FLAG_APPEND or FLAG_MERGE) of `key` to `f` */
+static void springfield_fold_one(springfield_t *r, char *key,
+        springfield_folding_t *f, uint32_t flags, uint8_t *operand,
+        uint32_t olen) {
+    if (flags & FLAG_APPEND) {
+        assert((uint64_t)f->len + olen < MAX_VLEN);
+        if (!f->owned || f->len + olen > f->cap) {
+            f->cap = (f->len + olen) * 2;
+            uint8_t *grown = f->owned ? realloc(f->cur, f->cap) : malloc(f->cap);
+            if (!f->owned && f->len)
+                memcpy(grown, f->cur, f->len);
+            f->cur = grown;
+        }
+        memcpy(f->cur + f->len, operand, olen);
+        f->len += olen;
+    } else {
+        /* a db with merge records can't be read without its operator */
+        assert(r->opts.merge);
+        uint32_t next_len = 0;
+        uint8_t *next = r->opts.merge(key, f->cur, f->len, operand, olen,
+            &next_len, r->opts.merge_passthrough);
+        if (f->owned)
+            free(f->cur);
+        if (next && !next_len) {
+            free(next);
+            next = NULL;
+        }
+        f->cur = next;
+        f->len = f->cap = next ? next_len : 0;
+    }
+    f->owned = 1;
+}
+
+/* Gets that fold more operands than this write the folded value
+   back (springfield_fold_rewrite()), so a key appended to over
+   and over doesn't cost more and more to read until the next
+   compaction */
+#define FOLD_REWRITE_OPERANDS 32
+
+/* The value of the key whose newest record, at `off`, is an
+   operand: the key's last plain value with every operand since
+   applied, oldest first.  malloc'd; NULL if it comes out absent.
+   If the fold took more than FOLD_REWRITE_OPERANDS, `off` goes in
+   *rewrite (when not NULL) for the caller to write it back. */
+static uint8_t * springfield_fold(springfield_t *r, uint64_t off, uint32_t *len,
+        uint64_t *rewrite) {
+    springfield_pin_t pin = PIN_INIT, base_pin = PIN_INIT;
+    springfield_rec h;
+    uint64_t n, base;
+
+    uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+    char *key = strdup((char *)p + h.hlen);
+    springfield_unpin(r, &pin);
+    uint64_t *ops = springfield_operands(r, off, &n, &base);
+
+    STAT_BUMP(r, merge_folds, n);
+    if (rewrite && n > FOLD_REWRITE_OPERANDS)
+        *rewrite = off;
+    /* the base stays in base_pin until an operand needs it copied */
+    springfield_folding_t f = {NULL, 0, 0, 0};
+    if (base != NO_BACKTRACE)
+        f.cur = springfield_value_at(r, base, &f.len, &base_pin, NULL);
+    if (!f.cur)
+        f.len = 0;
+    while (n--) {
+        int owned = f.owned;
+        p = springfield_rec_pin(r, ops[n], &h, 1, &pin);
+        springfield_fold_one(r, key, &f, h.flags, p + h.hlen + h.klen, h.vlen);
+        springfield_unpin(r, &pin);
+        if (!owned)
+            springfield_unpin(r, &base_pin);
+    }
+    free(ops);
+    free(key);
+    *len = f.len;
+    return f.cur;
+}
+
+/* The Bloom filter's verdict, counted */
+static int springfield_bloom_rules_out(springfield_t *r, springfield_key_t *k) {
+    if (r->bloom && !springfield_bloom_maybe(r->bloom, k->hash)) {
+        STAT_BUMP(r, bloom_negatives, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether the record at `off`, and the blob entry behind it if
+   any, still match their CRCs */
+static int springfield_verify_at(springfield_t *r, uint64_t off) {
+    springfield_pin_t pin = PIN_INIT;
+    springfield_rec h;
+    uint8_t *p = springfield_rec_pin(r, off, &h, 1, &pin);
+    uint64_t step = (uint64_t)h.hlen + h.klen + h.vlen;
+    int ok = crc32(0, p + 4, step - 4) == *(uint32_t *)p;
+    if (ok && (h.flags & FLAG_BLOB)) {
+        springfield_blob_ptr ptr;
+        memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+        springfield_blobs_t *b = springfield_blobs_for(r, ptr.gen);
+        if (b && ptr.off + BLOB_HEADER_SIZE <= b->eof) {
+            springfield_blob_header *bh = (springfield_blob_header *)(b->map + ptr.off);
+            ok = bh->vlen == ptr.vlen && ptr.off + BLOB_HEADER_SIZE +
+                bh->klen + (uint64_t)bh->vlen <= b->eof &&
+                crc32(0, b->map + ptr.off + 4,
+                    BLOB_HEADER_SIZE - 4 + bh->klen + bh->vlen) == bh->crc;
+        }
+    }
+    springfield_unpin(r, &pin);
+    return ok;
+}
+
+static __thread uint32_t verify_tick;
+
+/* A malloc'd copy of the value found at `off` by a `seeks` long
+   walk (NO_BACKTRACE for none); `rewrite` as for springfield_fold() */
+static uint8_t * springfield_get_found(springfield_t *r, uint64_t off,
+        int seeks, uint32_t *len, uint64_t *rewrite) {
+    springfield_record_seeks(r, seeks, off != NO_BACKTRACE);
+    if (off == NO_BACKTRACE)
+        return NULL;
+    if (r->opts.verify_reads && ++verify_tick >= r->opts.verify_reads) {
+        verify_tick = 0;
+        if (!springfield_verify_at(r, off)) {
+            STAT_BUMP(r, crc_errors, 1);
+            return NULL;
+        }
+    }
+
+    uint32_t vlen;
+    springfield_pin_t pin = PIN_INIT;
+    uint8_t *val = springfield_value_at(r, off, &vlen, &pin, rewrite);
+    uint8_t *res = NULL;
+    if (val) {
+        res = malloc(vlen);
+        *len = vlen;
+        memmove(res, val, vlen);
+    }
+    springfield_unpin(r, &pin);
+    return res;
+}
+
+static uint8_t * springfield_get_i(springfield_t *r, springfield_key_t *k, uint32_t *len,
+        uint64_t *rewrite) {
+    if (springfield_bloom_rules_out(r, k))
+        return NULL;
+
+    int seeks;
+    uint64_t off = springfield_find_i(r, k, &seeks);
+    return springfield_get_found(r, off, seeks, len, rewrite);
+}
+
+/* Cache fill and counters for a get that's been answered */
+static void springfield_get_settle(springfield_t *r, springfield_key_t *k,
+        uint8_t *res, uint32_t len, int from_cache) {
+    if (res && r->cache && !from_cache)
+        springfield_cache_put(r->cache, k, res, len);
+
+    STAT_BUMP(r, gets, 1);
+    if (res)
+        STAT_BUMP(r, get_hits, 1);
+}
+
+/* get_i, but consulting and filling the value cache */
+static uint8_t * springfield_get_cached(springfield_t *r, springfield_key_t *k, uint32_t *len,
+        uint64_t *rewrite) {
+    uint8_t *res = NULL;
+    int from_cache = 0;
+    *len = 0;
+    if (r->cache)
+        from_cache = !!(res = springfield_cache_get(r->cache, k, len));
+    if (!res)
+        res = springfield_get_i(r, k, len, rewrite);
+
+    springfield_get_settle(r, k, res, *len, from_cache);
+    return res;
+}
+
+/* -- batched lookups --
+
+   get_multi walks up to AMAC_WINDOW chains at once ("asynchronous
+   memory access chaining"): each step issues a prefetch for one
+   lookup's next record and moves on to the next lookup, so by
+   the time it comes back round the record is (hopefully) in
+   cache and the misses of the whole window overlap. */
+
+#define AMAC_WINDOW 8
+
+typedef struct springfield_amac_t {
+    int idx;        /* into keys, or -1 for a free slot */
+    int seeks;
+    uint64_t off;   /* record to look at next */
+} springfield_amac_t;
+
+static void springfield_get_multi_i(springfield_t *r, springfield_key_t *keys,
+        int count, uint8_t **vals, uint32_t *lens) {
+    springfield_amac_t win[AMAC_WINDOW];
+    int next = 0, active = 0, s;
+
+    if (r->pool) {
+        /* nothing to prefetch: one lookup at a time */
+        for (s = 0; s < count; s++)
+            vals[s] = springfield_get_cached(r, &keys[s], &lens[s], NULL);
+        return;
+    }
+
+    for (s = 0; s < AMAC_WINDOW; s++)
+        win[s].idx = -1;
+
+    while (next < count || active) {
+        for (s = 0; s < AMAC_WINDOW; s++) {
+            springfield_amac_t *a = &win[s];
+
+            if (a->idx < 0) {
+                /* refill: the cache and the Bloom filter answer
+                   without touching the map */
+                while (next < count) {
+                    springfield_key_t *k = &keys[next];
+                    uint8_t *res = NULL;
+                    vals[next] = NULL;
+                    if (r->cache)
+                        res = springfield_cache_get(r->cache, k, &lens[next]);
+                    if (res || springfield_bloom_rules_out(r, k)) {
+                        vals[next] = res;
+                        springfield_get_settle(r, k, res, lens[next], 1);
+                        next++;
+                        continue;
+                    }
+                    a->off = springfield_index_lookup(r, k);
+                    if (a->off == NO_BACKTRACE) {
+                        springfield_record_seeks(r, 0, 0);
+                        springfield_get_settle(r, k, NULL, 0, 0);
+                        next++;
+                        continue;
+                    }
+                    __builtin_prefetch(r->map + a->off);
+                    a->idx = next++;
+                    a->seeks = 0;
+                    active++;
+                    break;
+                }
+                continue;
+            }
+
+            springfield_key_t *k = &keys[a->idx];
+            springfield_rec h;
+            a->seeks++;
+            springfield_rec_at(r, a->off, &h);
+            uint64_t found = NO_BACKTRACE;
+            if (h.klen == k->klen &&
+                    !memcmp(REC_KEY(r, a->off, h), k->key, k->klen))
+                found = a->off;
+            else if (h.last != NO_BACKTRACE) {
+                a->off = h.last;
+                __builtin_prefetch(r->map + a->off);
+                continue;
+            }
+
+            vals[a->idx] = springfield_get_found(r, found, a->seeks,
+                &lens[a->idx], NULL);
+            springfield_get_settle(r, k, vals[a->idx], lens[a->idx], 0);
+            a->idx = -1;
+            active--;
+        }
+    }
+}
+
+uint8_t * springfield_get_k(springfield_t *r, springfield_key_t *k, uint32_t *len) {
+    uint64_t start = springfield_op_start(r);
+    uint8_t *res;
+    if (springfield_wbuf_get(r, k, &res, len)) {
+        springfield_get_settle(r, k, res, *len, 1);
+        springfield_op_end(r, SPRINGFIELD_OP_GET, start);
+        return res;
+    }
+    uint64_t rewrite = NO_BACKTRACE;
+    springfield_rdlock(r);
+    res = springfield_get_cached(r, k, len, &rewrite);
+    pthread_rwlock_unlock(&r->main_lock);
+    if (rewrite != NO_BACKTRACE)
+        springfield_fold_rewrite(r, k, rewrite);
+    springfield_op_end(r, SPRINGFIELD_OP_GET, start);
+    return res;
+}
+
+uint8_t * springfield_get(springfield_t *r, char *key, uint32_t *len) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_get_k(r, &k, len);
+}
+
+/* -- try get --
+
+   springfield_try_get() walks the chain like get, but asks
+   mincore() about each page before touching it and gives up
+   rather than fault.  The walk remembers the last page it found
+   resident, so a clustered chain usually costs one call. */
+
+typedef struct springfield_residency_t {
+    long page;
+    uint8_t *base;      /* of the last page found resident */
+    uint8_t *miss;      /* where the walk stopped, and how much */
+    uint64_t miss_len;
+    uint64_t miss_off;  /* the same, as a data file offset, for the pool */
+} springfield_residency_t;
+
+/* 1 if every page of `len` bytes at `off` of `map` is in the
+   page cache */
+static int springfield_resident(springfield_residency_t *res, uint8_t *map,
+        uint64_t off, uint64_t len) {
+    unsigned char vec[64];
+    uint64_t pg = res->page, p, i, n;
+    uint64_t first = off & ~(pg - 1);
+    uint64_t last = (off + (len ? len : 1) - 1) & ~(pg - 1);
+    if (first == last && map + first == res->base)
+        return 1;
+
+    for (p = first; p <= last; p += n * pg) {
+        n = (last - p) / pg + 1;
+        if (n > sizeof(vec))
+            n = sizeof(vec);
+        int s = mincore(map + p, n * pg, vec);
+        assert(!s);
+        for (i = 0; i < n; i++) {
+            if (!(vec[i] & 1)) {
+                res->miss = map + p + i * pg;
+                res->miss_len = last + pg - (p + i * pg);
+                return 0;
+            }
+        }
+    }
+    res->base = map + last;
+    return 1;
+}
+
+/* The pool's version of the walk below: pin without reading */
+static int springfield_try_walk_pool(springfield_t *r, springfield_key_t *k,
+        springfield_residency_t *res, uint64_t *found, int *seeks) {
+    springfield_pin_t pin = {NULL, NULL, 1};
+    uint64_t off = springfield_index_lookup(r, k), first = NO_BACKTRACE;
+    while (off != NO_BACKTRACE) {
+        springfield_rec h;
+        uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+        res->miss_off = off;
+        res->miss_len = HEADER_MAX_SIZE;
+        if (!p)
+            return SPRINGFIELD_TRY_WOULDBLOCK;
+        (*seeks)++;
+        if (h.klen == k->klen && !memcmp(p + h.hlen, k->key, k->klen)) {
+            springfield_unpin(r, &pin);
+            res->miss_len = h.hlen + h.klen + h.vlen;
+            if (!(p = springfield_rec_pin(r, off, &h, 1, &pin)))
+                return SPRINGFIELD_TRY_WOULDBLOCK;
+            if (h.flags & FLAG_BLOB) {
+                springfield_blob_ptr ptr;
+                memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+                springfield_blobs_t *b = springfield_blobs_for(r, ptr.gen);
+                if (b && !springfield_resident(res, b->map, ptr.off,
+                        BLOB_HEADER_SIZE + k->klen + ptr.vlen)) {
+                    springfield_unpin(r, &pin);
+                    return SPRINGFIELD_TRY_WOULDBLOCK;
+                }
+            }
+            springfield_unpin(r, &pin);
+            if (!(h.flags & FLAG_OPERAND))
+                break;
+            /* operands: everything back to the plain value too */
+            if (first == NO_BACKTRACE)
+                first = off;
+            off = h.last;
+            continue;
+        }
+        springfield_unpin(r, &pin);
+        off = h.last;
+    }
+    *found = first != NO_BACKTRACE ? first : off;
+    return SPRINGFIELD_TRY_HIT;
+}
+
+/* get_i, or SPRINGFIELD_TRY_WOULDBLOCK if it would fault */
+static int springfield_try_get_i(springfield_t *r, springfield_key_t *k,
+        springfield_residency_t *res, uint8_t **val, uint32_t *len) {
+    if (springfield_bloom_rules_out(r, k))
+        return SPRINGFIELD_TRY_MISS;
+
+    int seeks = 0;
+    if (r->pool) {
+        uint64_t found;
+        if (springfield_try_walk_pool(r, k, res, &found, &seeks) ==
+                SPRINGFIELD_TRY_WOULDBLOCK)
+            return SPRINGFIELD_TRY_WOULDBLOCK;
+        *val = springfield_get_found(r, found, seeks, len, NULL);
+        return *val ? SPRINGFIELD_TRY_HIT : SPRINGFIELD_TRY_MISS;
+    }
+
+    uint64_t off = springfield_index_lookup(r, k), first = NO_BACKTRACE;
+    while (off != NO_BACKTRACE) {
+        uint64_t avail = r->eof - off;
+        if (!springfield_resident(res, r->map, off,
+                avail < HEADER_MAX_SIZE ? avail : HEADER_MAX_SIZE))
+            return SPRINGFIELD_TRY_WOULDBLOCK;
+        springfield_rec h;
+        springfield_rec_at(r, off, &h);
+        if (!springfield_resident(res, r->map, off + h.hlen, h.klen))
+            return SPRINGFIELD_TRY_WOULDBLOCK;
+        seeks++;
+        if (h.klen == k->klen && !memcmp(REC_KEY(r, off, h), k->key, k->klen)) {
+            if (h.flags & FLAG_BLOB) {
+                springfield_blob_ptr ptr;
+                memcpy(&ptr, REC_VAL(r, off, h), sizeof(ptr));
+                springfield_blobs_t *b = springfield_blobs_for(r, ptr.gen);
+                if (b && !springfield_resident(res, b->map, ptr.off,
+                        BLOB_HEADER_SIZE + k->klen + ptr.vlen))
+                    return SPRINGFIELD_TRY_WOULDBLOCK;
+            } else if (!springfield_resident(res, r->map, off + h.hlen + h.klen,
+                    h.vlen)) {
+                return SPRINGFIELD_TRY_WOULDBLOCK;
+            }
+            if (!(h.flags & FLAG_OPERAND))
+                break;
+            if (first == NO_BACKTRACE)
+                first = off;
+        }
+        off = h.last;
+    }
+
+    if (first != NO_BACKTRACE)
+        off = first;
+    *val = springfield_get_found(r, off, seeks, len, NULL);
+    return *val ? SPRINGFIELD_TRY_HIT : SPRINGFIELD_TRY_MISS;
+}
+
+int springfield_try_get_k(springfield_t *r, springfield_key_t *k, uint8_t **val,
+        uint32_t *len, int flags) {
+    uint64_t start = springfield_op_start(r);
+    springfield_residency_t res = {sysconf(_SC_PAGESIZE), NULL, NULL, 0, 0};
+    int ret;
+
+    *val = NULL;
+    if (springfield_wbuf_get(r, k, val, len)) {
+        ret = *val ? SPRINGFIELD_TRY_HIT : SPRINGFIELD_TRY_MISS;
+        springfield_get_settle(r, k, *val, *len, 1);
+    } else {
+        int from_cache = 0;
+        springfield_rdlock(r);
+        if (r->cache)
+            from_cache = !!(*val = springfield_cache_get(r->cache, k, len));
+        ret = from_cache ? SPRINGFIELD_TRY_HIT :
+            springfield_try_get_i(r, k, &res, val, len);
+        if (ret != SPRINGFIELD_TRY_WOULDBLOCK)
+            springfield_get_settle(r, k, *val, *len, from_cache);
+        else if ((flags & SPRINGFIELD_TRY_PREFETCH) && res.miss)
+            madvise(res.miss, res.miss_len, MADV_WILLNEED);
+        else if (flags & SPRINGFIELD_TRY_PREFETCH)
+            posix_fadvise(r->mapfd, res.miss_off, res.miss_len,
+                POSIX_FADV_WILLNEED);
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+
+    if (ret == SPRINGFIELD_TRY_WOULDBLOCK) {
+        STAT_BUMP(r, try_wouldblocks, 1);
+        return ret;
+    }
+    springfield_op_end(r, SPRINGFIELD_OP_GET, start);
+    return ret;
+}
+
+int springfield_try_get(springfield_t *r, char *key, uint8_t **val, uint32_t *len,
+        int flags) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_try_get_k(r, &k, val, len, flags);
+}
+
+void springfield_get_multi(springfield_t *r, springfield_key_t *keys, int count,
+        uint8_t **vals, uint32_t *lens) {
+    uint64_t start = springfield_op_start(r);
+    if (r->opts.write_buffer_bytes && __atomic_load_n(&r->wbuf_entries, __ATOMIC_ACQUIRE)) {
+        /* Answer what the write buffer can, then walk the rest */
+        springfield_key_t *miss = malloc(count * sizeof(springfield_key_t));
+        uint8_t **mvals = malloc(count * sizeof(uint8_t *));
+        uint32_t *mlens = malloc(count * sizeof(uint32_t));
+        int *where = malloc(count * sizeof(int));
+        int i, n = 0;
+        for (i = 0; i < count; i++) {
+            if (springfield_wbuf_get(r, &keys[i], &vals[i], &lens[i])) {
+                springfield_get_settle(r, &keys[i], vals[i], lens[i], 1);
+            } else {
+                miss[n] = keys[i];
+                where[n++] = i;
+            }
+        }
+        springfield_rdlock(r);
+        springfield_get_multi_i(r, miss, n, mvals, mlens);
+        pthread_rwlock_unlock(&r->main_lock);
+        for (i = 0; i < n; i++) {
+            vals[where[i]] = mvals[i];
+            lens[where[i]] = mlens[i];
+        }
+        free(miss);
+        free(mvals);
+        free(mlens);
+        free(where);
+        springfield_op_end(r, SPRINGFIELD_OP_GET, start);
+        return;
+    }
+    springfield_rdlock(r);
+    springfield_get_multi_i(r, keys, count, vals, lens);
+    pthread_rwlock_unlock(&r->main_lock);
+    springfield_op_end(r, SPRINGFIELD_OP_GET, start);
+}
+
+/* -- async reads --
+
+   For event loops that can't afford to fault on the map.  A
+   lookup walks its chain with reads of the data file (a window
+   at each record, then the rest of the value if it didn't fit)
+   queued on an io_uring; completions come back through
+   springfield_async_poll(), and an eventfd tells epoll when to
+   call it.  Where io_uring isn't available (old kernel, seccomp)
+   the same reads are done with pread() inside poll.
+
+   Reads go to a dup() of the data file taken when the lookup
+   starts, so one racing a compaction finishes against the old
+   file rather than a recycled fd.  Blob files are pinned the
+   same way, by generation, but blob GC can delete a generation
+   the (old) record we found still points at: then the lookup
+   starts over from the index.  Async gets never fill the value
+   cache: a set could invalidate the key between the read and
+   the fill, and nothing would ever clear the stale copy.
+
+   A key whose newest records are operands (FLAG_MERGE/APPEND) is
+   walked the same way, copying each operand out as it goes, until
+   its base value turns up; then they're folded in memory. */
+
+#define ASYNC_WINDOW 512
+#define ASYNC_RESTARTS 4
+#define AOP_REC 0   /* reading the record at `off` into buf */
+#define AOP_VALUE 1 /* reading the value straight into val */
+
+typedef struct springfield_aoperand_t {
+    uint32_t flags;
+    uint32_t len;
+    uint8_t *val;
+} springfield_aoperand_t;
+
+typedef struct springfield_afile_t {
+    int fd;
+    int refs;
+    uint64_t tag; /* compaction count, or blob gen */
+} springfield_afile_t;
+
+typedef struct springfield_aop_t {
+    struct springfield_aop_t *next;
+    springfield_key_t k;
+    springfield_async_cb cb;
+    void *passthrough;
+    springfield_afile_t *file;
+    int stage;
+    int seeks;
+    int restarts;
+    uint64_t off;   /* record being looked at */
+    uint64_t eof;   /* of the data file when the lookup started */
+    uint8_t *buf;
+    uint32_t buf_alloc;
+    uint64_t roff;  /* of the read in flight */
+    uint32_t want;
+    int res;        /* bytes read, or -errno */
+    struct iovec iov;
+    uint8_t *val;
+    uint32_t vlen;
+    springfield_aoperand_t *operands; /* found so far, newest first */
+    int nops;
+    int ops_alloc;
+} springfield_aop_t;
+
+typedef struct springfield_uring_t {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned queued;
+} springfield_uring_t;
+
+struct springfield_async_t {
+    springfield_t *r;
+    int depth;
+    int inflight;
+    int polling;
+    int efd;
+    springfield_uring_t *ring; /* NULL: pread fallback */
+    springfield_aop_t *ops;
+    springfield_aop_t *free_ops;
+    springfield_aop_t *done;    /* answered, callback not yet run */
+    springfield_aop_t *reads;   /* fallback: reads not yet done */
+    springfield_afile_t *data;
+    springfield_afile_t *blobs[BLOB_GENS];
+};
+
+static springfield_afile_t * springfield_afile_new(int fd, uint64_t tag) {
+    springfield_afile_t *f = malloc(sizeof(springfield_afile_t));
+    f->fd = dup(fd);
+    assert(f->fd > -1);
+    f->refs = 1;
+    f->tag = tag;
+    return f;
+}
+
+static void springfield_afile_release(springfield_afile_t *f) {
+    if (f && !--f->refs) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+#ifdef SPRINGFIELD_HAVE_URING
+static springfield_uring_t * springfield_uring_open(unsigned entries, int efd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return NULL;
+
+    springfield_uring_t *u = calloc(1, sizeof(springfield_uring_t));
+    u->fd = fd;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+    if (single)
+        u->sq_len = u->cq_len = u->sq_len > u->cq_len ? u->sq_len : u->cq_len;
+
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ring = single ? u->sq_ring : mmap(NULL, u->cq_len,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    assert(u->sq_ring != MAP_FAILED && u->cq_ring != MAP_FAILED &&
+        u->sqes != MAP_FAILED);
+
+    uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    int s = syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1);
+    assert(!s);
+    return u;
+}
+
+static void springfield_uring_close(springfield_uring_t *u) {
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+    free(u);
+}
+
+/* Submit what's queued and, with `wait`, block for a completion */
+static void springfield_uring_enter(springfield_uring_t *u, int wait) {
+    while (u->queued || wait) {
+        int n = syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+            continue;
+        }
+        u->queued -= n;
+        wait = 0;
+    }
+}
+
+static void springfield_uring_read(springfield_uring_t *u, springfield_aop_t *op) {
+    unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = op->file->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+    sqe->len = 1;
+    sqe->off = op->roff;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+}
+#endif
+
+static void springfield_async_wake(springfield_async_t *a) {
+    uint64_t one = 1;
+    ssize_t w = write(a->efd, &one, sizeof(one));
+    assert(w == sizeof(one));
+}
+
+/* Queue a read of `len` bytes at `roff` of op->file into `dst` */
+static void springfield_aop_read(springfield_async_t *a, springfield_aop_t *op,
+        uint8_t *dst, uint32_t len, uint64_t roff) {
+    op->iov.iov_base = dst;
+    op->iov.iov_len = len;
+    op->want = len;
+    op->roff = roff;
+#ifdef SPRINGFIELD_HAVE_URING
+    if (a->ring) {
+        springfield_uring_read(a->ring, op);
+        return;
+    }
+#endif
+    op->next = a->reads;
+    a->reads = op;
+    if (!a->polling)
+        springfield_async_wake(a);
+}
+
+static void springfield_aop_drop_operands(springfield_aop_t *op) {
+    while (op->nops)
+        free(op->operands[--op->nops].val);
+}
+
+static void springfield_aop_finish(springfield_async_t *a, springfield_aop_t *op,
+        uint8_t *val, uint32_t vlen) {
+    springfield_aop_drop_operands(op);
+    springfield_afile_release(op->file);
+    op->file = NULL;
+    op->val = val;
+    op->vlen = val ? vlen : 0;
+    op->next = a->done;
+    a->done = op;
+    if (!a->polling)
+        springfield_async_wake(a);
+}
+
+/* Read `len` bytes of the record at `off` (at least its first
+   `need`) into op->buf */
+static void springfield_aop_fetch(springfield_async_t *a, springfield_aop_t *op,
+        uint64_t off, uint32_t len, uint32_t need) {
+    if (off + need > op->eof) {
+        springfield_aop_finish(a, op, NULL, 0);
+        return;
+    }
+    if (off + len > op->eof)
+        len = op->eof - off;
+    if (len > op->buf_alloc) {
+        op->buf = realloc(op->buf, len);
+        op->buf_alloc = len;
+    }
+    op->off = off;
+    op->stage = AOP_REC;
+    springfield_aop_read(a, op, op->buf, len, off);
+}
+
+/* Pin the blob file `ptr` points into; NULL if it's gone */
+static springfield_afile_t * springfield_async_blob(springfield_async_t *a,
+        springfield_blob_ptr *ptr) {
+    springfield_t *r = a->r;
+    springfield_afile_t *f = NULL;
+    springfield_rdlock(r);
+    springfield_blobs_t *b = springfield_blobs_for(r, ptr->gen);
+    if (b && ptr->off + BLOB_HEADER_SIZE <= b->eof) {
+        springfield_afile_t **slot = &a->blobs[ptr->gen % BLOB_GENS];
+        if (!*slot || (*slot)->tag != ptr->gen) {
+            springfield_afile_release(*slot);
+            *slot = springfield_afile_new(b->fd, ptr->gen);
+        }
+        f = *slot;
+        f->refs++;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+    return f;
+}
+
+/* The walk has found the key's value (`val`, malloc'd, or NULL
+   for none): apply the operands found above it and answer */
+static void springfield_aop_done(springfield_async_t *a, springfield_aop_t *op,
+        uint8_t *val, uint32_t vlen) {
+    if (op->nops) {
+        springfield_folding_t f = {val, val ? vlen : 0, val ? vlen : 0, 1};
+        STAT_BUMP(a->r, merge_folds, op->nops);
+        while (op->nops) {
+            springfield_aoperand_t *o = &op->operands[--op->nops];
+            springfield_fold_one(a->r, op->k.key, &f, o->flags, o->val, o->len);
+            free(o->val);
+        }
+        val = f.cur;
+        vlen = f.len;
+    }
+    springfield_aop_finish(a, op, val, vlen);
+}
+
+/* Answer from memory if we can, else read the head of the chain */
+static void springfield_aop_start(springfield_async_t *a, springfield_aop_t *op) {
+    springfield_t *r = a->r;
+    uint8_t *res = NULL;
+    uint32_t len = 0;
+    op->seeks = 0;
+    springfield_aop_drop_operands(op);
+    if (springfield_wbuf_get(r, &op->k, &res, &len)) {
+        springfield_aop_finish(a, op, res, len);
+        return;
+    }
+    springfield_rdlock(r);
+    if (r->cache)
+        res = springfield_cache_get(r->cache, &op->k, &len);
+    if (res || springfield_bloom_rules_out(r, &op->k)) {
+        pthread_rwlock_unlock(&r->main_lock);
+        springfield_aop_finish(a, op, res, len);
+        return;
+    }
+    uint64_t off = springfield_index_lookup(r, &op->k);
+    if (off == NO_BACKTRACE) {
+        pthread_rwlock_unlock(&r->main_lock);
+        springfield_record_seeks(r, 0, 0);
+        springfield_aop_finish(a, op, NULL, 0);
+        return;
+    }
+    if (!a->data || a->data->tag != r->compactions) {
+        springfield_afile_release(a->data);
+        a->data = springfield_afile_new(r->mapfd, r->compactions);
+    }
+    op->file = a->data;
+    op->file->refs++;
+    op->eof = r->eof;
+    pthread_rwlock_unlock(&r->main_lock);
+
+    springfield_aop_fetch(a, op, off, ASYNC_WINDOW, V2_MIN_SIZE);
+}
+
+/* A read has come back: take the walk one step further */
+static void springfield_aop_complete(springfield_async_t *a, springfield_aop_t *op) {
+    springfield_t *r = a->r;
+    if (op->res == -EINTR || op->res == -EAGAIN) {
+        springfield_aop_read(a, op, op->iov.iov_base, op->want, op->roff);
+        return;
+    }
+    if (op->res < 0) {
+        if (op->stage == AOP_VALUE)
+            free(op->val);
+        springfield_aop_finish(a, op, NULL, 0);
+        return;
+    }
+    uint32_t got = op->res;
+
+    if (op->stage == AOP_VALUE) {
+        if (got == op->want) {
+            springfield_aop_done(a, op, op->val, op->vlen);
+        } else {
+            free(op->val);
+            springfield_aop_finish(a, op, NULL, 0);
+        }
+        return;
+    }
+
+    springfield_rec h;
+    if (!springfield_rec_decode(op->buf, op->off, got, &h)) {
+        springfield_aop_finish(a, op, NULL, 0);
+        return;
+    }
+    uint32_t need = h.hlen + h.klen;
+    if (got < need) {
+        springfield_aop_fetch(a, op, op->off, need, need);
+        return;
+    }
+    int match = h.klen == op->k.klen &&
+        !memcmp(op->buf + h.hlen, op->k.key, h.klen);
+    int operand = match && (h.flags & FLAG_OPERAND) && (h.vlen || op->nops);
+    if (operand && got < need + h.vlen) {
+        springfield_aop_fetch(a, op, op->off, need + h.vlen, need + h.vlen);
+        return;
+    }
+    op->seeks++;
+    if (!match) {
+        if (h.last == NO_BACKTRACE) {
+            if (!op->nops)
+                springfield_record_seeks(r, op->seeks, 0);
+            springfield_aop_done(a, op, NULL, 0);
+        } else {
+            springfield_aop_fetch(a, op, h.last, ASYNC_WINDOW, V2_MIN_SIZE);
+        }
+        return;
+    }
+
+    if (!op->nops)
+        springfield_record_seeks(r, op->seeks, 1);
+    if (operand) {
+        if (op->nops == op->ops_alloc) {
+            op->ops_alloc = op->ops_alloc ? op->ops_alloc * 2 : 16;
+            op->operands = realloc(op->operands,
+                op->ops_alloc * sizeof(springfield_aoperand_t));
+        }
+        springfield_aoperand_t *o = &op->operands[op->nops++];
+        o->flags = h.flags;
+        o->len = h.vlen;
+        o->val = malloc(h.vlen ? h.vlen : 1);
+        memcpy(o->val, op->buf + need, h.vlen);
+        if (h.last == NO_BACKTRACE)
+            springfield_aop_done(a, op, NULL, 0);
+        else
+            springfield_aop_fetch(a, op, h.last, ASYNC_WINDOW, V2_MIN_SIZE);
+        return;
+    }
+    if (!h.vlen) {
+        springfield_aop_done(a, op, NULL, 0);
+        return;
+    }
+    uint64_t voff = op->off + need;
+    uint32_t vlen = h.vlen;
+    if (h.flags & FLAG_BLOB) {
+        springfield_blob_ptr ptr;
+        if (got < need + sizeof(ptr)) {
+            springfield_aop_fetch(a, op, op->off, need + sizeof(ptr),
+                need + sizeof(ptr));
+            return;
+        }
+        memcpy(&ptr, op->buf + need, sizeof(ptr));
+        springfield_afile_t *f = springfield_async_blob(a, &ptr);
+        if (!f) {
+            springfield_afile_release(op->file);
+            op->file = NULL;
+            if (op->restarts++ < ASYNC_RESTARTS)
+                springfield_aop_start(a, op);
+            else
+                springfield_aop_finish(a, op, NULL, 0);
+            return;
+        }
+        springfield_afile_release(op->file);
+        op->file = f;
+        voff = ptr.off + BLOB_HEADER_SIZE + op->k.klen;
+        vlen = ptr.vlen;
+    } else if (got >= need + vlen) {
+        uint8_t *val = malloc(vlen);
+        memcpy(val, op->buf + need, vlen);
+        springfield_aop_done(a, op, val, vlen);
+        return;
+    }
+
+    op->stage = AOP_VALUE;
+    op->val = malloc(vlen);
+    op->vlen = vlen;
+    springfield_aop_read(a, op, op->val, vlen, voff);
+}
+
+springfield_async_t * springfield_async_create(springfield_t *r, int depth) {
+    assert(depth > 0);
+    springfield_async_t *a = calloc(1, sizeof(springfield_async_t));
+    a->r = r;
+    a->depth = depth;
+    a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(a->efd > -1);
+#ifdef SPRINGFIELD_HAVE_URING
+    a->ring = springfield_uring_open(depth, a->efd);
+#endif
+
+    a->ops = calloc(depth, sizeof(springfield_aop_t));
+    int i;
+    for (i = 0; i < depth; i++) {
+        a->ops[i].next = a->free_ops;
+        a->free_ops = &a->ops[i];
+    }
+    return a;
+}
+
+int springfield_async_fd(springfield_async_t *a) {
+    return a->efd;
+}
+
+int springfield_async_pending(springfield_async_t *a) {
+    return a->inflight;
+}
+
+int springfield_async_get_k(springfield_async_t *a, springfield_key_t *k,
+        springfield_async_cb cb, void *passthrough) {
+    springfield_aop_t *op = a->free_ops;
+    if (!op)
+        return -1;
+    a->free_ops = op->next;
+    a->inflight++;
+
+    op->k = *k;
+    op->k.key = malloc(k->klen);
+    memcpy(op->k.key, k->key, k->klen);
+    op->cb = cb;
+    op->passthrough = passthrough;
+    op->file = NULL;
+    op->restarts = 0;
+
+    springfield_aop_start(a, op);
+#ifdef SPRINGFIELD_HAVE_URING
+    if (a->ring)
+        springfield_uring_enter(a->ring, 0);
+#endif
+    return 0;
+}
+
+int springfield_async_get(springfield_async_t *a, char *key,
+        springfield_async_cb cb, void *passthrough) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_async_get_k(a, &k, cb, passthrough);
+}
+
+/* Feed finished reads to aop_complete */
+static void springfield_async_reap(springfield_async_t *a) {
+#ifdef SPRINGFIELD_HAVE_URING
+    if (a->ring) {
+        springfield_uring_t *u = a->ring;
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            springfield_aop_t *op = (springfield_aop_t *)(uintptr_t)cqe->user_data;
+            op->res = cqe->res;
+            springfield_aop_complete(a, op);
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        return;
+    }
+#endif
+    while (a->reads) {
+        springfield_aop_t *op = a->reads;
+        a->reads = op->next;
+        ssize_t n;
+        do {
+            n = pread(op->file->fd, op->iov.iov_base, op->want, op->roff);
+        } while (n < 0 && errno == EINTR);
+        op->res = n < 0 ? -errno : (int)n;
+        springfield_aop_complete(a, op);
+    }
+}
+
+int springfield_async_poll(springfield_async_t *a, int wait) {
+    springfield_t *r = a->r;
+    int ran = 0;
+    uint64_t drain;
+    if (read(a->efd, &drain, sizeof(drain)) < 0)
+        assert(errno == EAGAIN);
+
+    a->polling = 1;
+    while (1) {
+        springfield_async_reap(a);
+#ifdef SPRINGFIELD_HAVE_URING
+        if (a->ring)
+            springfield_uring_enter(a->ring, 0);
+#endif
+
+        springfield_aop_t *op = a->done;
+        a->done = NULL;
+        while (op) {
+            springfield_aop_t *next = op->next;
+            springfield_get_settle(r, &op->k, op->val, op->vlen, 1);
+            op->cb(r, op->k.key, op->val, op->vlen, op->passthrough);
+            free(op->k.key);
+            op->next = a->free_ops;
+            a->free_ops = op;
+            a->inflight--;
+            ran++;
+            op = next;
+        }
+
+        if (ran || !wait || !a->inflight)
+            break;
+#ifdef SPRINGFIELD_HAVE_URING
+        if (a->ring)
+            springfield_uring_enter(a->ring, 1);
+#endif
+    }
+    a->polling = 0;
+    if (a->done || a->reads)
+        springfield_async_wake(a);
+    return ran;
+}
+
+void springfield_async_destroy(springfield_async_t *a) {
+    while (a->inflight)
+        springfield_async_poll(a, 1);
+#ifdef SPRINGFIELD_HAVE_URING
+    if (a->ring)
+        springfield_uring_close(a->ring);
+#endif
+    int i;
+    for (i = 0; i < BLOB_GENS; i++)
+        springfield_afile_release(a->blobs[i]);
+    springfield_afile_release(a->data);
+    for (i = 0; i < a->depth; i++) {
+        free(a->ops[i].buf);
+        free(a->ops[i].operands);
+    }
+    free(a->ops);
+    close(a->efd);
+    free(a);
+}
+
+double springfield_seek_average(springfield_t *r) {
+    double tot = 0;
+    int i, j, n = 0;
+    for (i = 0; i < STAT_STRIPES; i++) {
+        for (j = 0; j < STAT_SEEKS; j++) {
+            if (r->stats[i].seeks[j]) {
+                tot += r->stats[i].seeks[j];
+                n++;
+            }
+        }
+    }
+    return n ? tot / n : 0;
+}
+
+void springfield_histogram_merge(springfield_histogram_t *into,
+        springfield_histogram_t *from) {
+    springfield_hist_merge(into, from);
+}
+
+void springfield_stats(springfield_t *r, springfield_stats_t *out) {
+    int i, j;
+    memset(out, 0, sizeof(springfield_stats_t));
+    for (i = 0; i < STAT_STRIPES; i++) {
+        springfield_stripe_t *st = &r->stats[i];
+        out->gets += st->gets;
+        out->get_hits += st->get_hits;
+        out->sets += st->sets;
+        out->dels += st->dels;
+        out->dels_skipped += st->dels_skipped;
+        out->bloom_negatives += st->bloom_negatives;
+        out->try_wouldblocks += st->try_wouldblocks;
+        out->rmws += st->rmws;
+        out->merge_folds += st->merge_folds;
+        out->grows += st->grows;
+        out->bytes_appended += st->bytes_appended;
+        out->crc_errors += st->crc_errors;
+        out->scrub_bytes += st->scrub_bytes;
+        out->scrub_passes += st->scrub_passes;
+        for (j = 0; j < SPRINGFIELD_CHAIN_BUCKETS; j++)
+            out->chain_lengths[j] += st->chain_lengths[j];
+        for (j = 0; j < SPRINGFIELD_OP_COUNT; j++)
+            springfield_hist_merge(&out->ops[j], &st->ops[j]);
+        for (j = 0; j < SPRINGFIELD_LOCK_COUNT; j++)
+            springfield_hist_merge(&out->lock_waits[j], &st->lock_waits[j]);
+    }
+    if (r->cache) {
+        for (i = 0; i < CACHE_SHARDS; i++) {
+            springfield_cshard_t *s = &r->cache->shards[i];
+            pthread_mutex_lock(&s->lock);
+            out->cache_hits += s->hits;
+            out->cache_misses += s->misses;
+            out->cache_bytes += s->bytes;
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    pthread_rwlock_rdlock(&r->main_lock);
+    out->num_buckets = r->num_buckets;
+    out->eof = r->eof;
+    out->mmap_alloc = r->mmap_alloc;
+    out->compactions = r->compactions;
+    out->compact_running = r->compact_running;
+    out->compact_buckets_done = r->compact_buckets_done;
+    out->compact_buckets_total = r->compact_buckets_total;
+    for (i = 0; i < BLOB_GENS; i++) {
+        if (r->blobs[i])
+            out->blob_bytes += r->blobs[i]->eof;
+    }
+    out->blob_gcs = r->blob_gcs;
+    out->checkpoints = r->checkpoints;
+    pthread_rwlock_unlock(&r->main_lock);
+
+    springfield_wbuf_stats(r, out);
+}
+
+/* Fault in [0, eof) a chunk at a time, each under the read lock
+   so compaction and growth can proceed in between.  Returns
+   early if the db is closing.  The pool is only filled as far
+   as it goes. */
+static void springfield_warmup_i(springfield_t *r) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t off = 0;
+    volatile uint8_t sink = 0;
+
+    if (r->pool) {
+        uint64_t used, cap, block;
+        springfield_pool_usage(r->pool, &used, &cap);
+        for (block = 0; block < cap && !r->closing; block++) {
+            pthread_rwlock_rdlock(&r->main_lock);
+            if (block * POOL_BLOCK >= r->eof) {
+                pthread_rwlock_unlock(&r->main_lock);
+                break;
+            }
+            springfield_pool_put(r->pool,
+                springfield_pool_get(r->pool, block, 0));
+            pthread_rwlock_unlock(&r->main_lock);
+        }
+        return;
+    }
+
+    while (!r->closing) {
+        pthread_rwlock_rdlock(&r->main_lock);
+        if (off >= r->eof) {
+            pthread_rwlock_unlock(&r->main_lock);
+            break;
+        }
+        uint64_t end = off + WARMUP_CHUNK;
+        if (end > r->eof)
+            end = r->eof;
+        madvise(r->map + off, end - off, MADV_WILLNEED);
+        for (; off < end; off += page)
+            sink += r->map[off];
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    (void)sink;
+}
+
+static void * springfield_warmup_thread(void *arg) {
+    springfield_warmup_i((springfield_t *)arg);
+    return NULL;
+}
+
+void springfield_warmup(springfield_t *r) {
+    springfield_warmup_i(r);
+}
+
+/* The scrubber reads the file with pread() on a dup() of its fd
+   (so neither the pool nor the map is disturbed, and a
+   compaction swapping the file out doesn't pull it from under
+   a read), a record at a time as load does, and starts over on
+   the new file after a compaction.  A record that fails its CRC
+   is counted and skipped; one whose header won't decode ends the
+   pass, as there's no telling where the next record starts.  Each
+   pass ends with the blob files, up to their eofs at the time,
+   checked the same way. */
+
+#define SCRUB_CHUNK (1024 * 1024)
+#define SCRUB_NAP_NS 100000000ULL
+#define SCRUB_PASS_MIN_NS 1000000000ULL
+
+/* Sleep until `until`, in naps, unless the db starts closing */
+static void springfield_sleep_until(springfield_t *r, uint64_t until) {
+    uint64_t now;
+    while (!r->closing && (now = springfield_now_ns()) < until) {
+        uint64_t nap = until - now < SCRUB_NAP_NS ? until - now : SCRUB_NAP_NS;
+        struct timespec ts = {nap / 1000000000ULL, nap % 1000000000ULL};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Check the entries of blob slot `g`, counting into `done` for
+   the rate limit */
+static void springfield_scrub_blobs(springfield_t *r, int g, uint64_t start,
+        uint64_t *done) {
+    springfield_loader_t l = {NULL, -1, NULL, 0, 0, 0};
+    uint64_t off = BLOB_FILE_HEADER, eof = 0;
+    uint64_t rate = r->opts.scrub_bytes_per_sec;
+
+    pthread_rwlock_rdlock(&r->main_lock);
+    if (r->blobs[g]) {
+        l.fd = dup(r->blobs[g]->fd);
+        assert(l.fd > -1);
+        eof = r->blobs[g]->eof;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+
+    while (off < eof && !r->closing) {
+        uint64_t end = off + SCRUB_CHUNK, from = off;
+        while (off < eof && off < end) {
+            springfield_blob_header bh;
+            if (eof - off < BLOB_HEADER_SIZE) {
+                STAT_BUMP(r, crc_errors, 1);
+                off = eof;
+                break;
+            }
+            memcpy(&bh, springfield_loader_at(&l, off, BLOB_HEADER_SIZE, eof),
+                BLOB_HEADER_SIZE);
+            uint64_t step = BLOB_HEADER_SIZE + bh.klen + (uint64_t)bh.vlen;
+            if (!bh.klen || step > eof - off) {
+                STAT_BUMP(r, crc_errors, 1);
+                off = eof;
+                break;
+            }
+            uint8_t *p = springfield_loader_at(&l, off, step, eof);
+            if (crc32(0, p + 4, step - 4) != bh.crc)
+                STAT_BUMP(r, crc_errors, 1);
+            off += step;
+        }
+        STAT_BUMP(r, scrub_bytes, off - from);
+        *done += off - from;
+        springfield_sleep_until(r, start + (uint64_t)((double)*done * 1e9 / rate));
+    }
+    if (l.fd > -1)
+        close(l.fd);
+    free(l.buf);
+}
+
+static void * springfield_scrub_thread(void *arg) {
+    springfield_t *r = (springfield_t *)arg;
+    springfield_loader_t l = {NULL, -1, NULL, 0, 0, 0};
+    uint64_t off = 4, compactions = 0, eof, done = 0;
+    uint64_t rate = r->opts.scrub_bytes_per_sec;
+    uint64_t start = springfield_now_ns();
+
+    while (!r->closing) {
+        pthread_rwlock_rdlock(&r->main_lock);
+        if (l.fd < 0 || compactions != r->compactions) {
+            if (l.fd > -1)
+                close(l.fd);
+            l.fd = dup(r->mapfd);
+            assert(l.fd > -1);
+            l.len = 0;
+            compactions = r->compactions;
+            off = 4;
+        }
+        eof = r->eof;
+        pthread_rwlock_unlock(&r->main_lock);
+
+        uint64_t end = off + SCRUB_CHUNK, from = off;
+        while (off < eof && off < end) {
+            springfield_rec h;
+            uint8_t *p = springfield_loader_at(&l, off, HEADER_MAX_SIZE, eof);
+            uint64_t jump = 0;
+            if (springfield_rec_decode(p, off, eof - off, &h))
+                jump = (uint64_t)h.hlen + h.klen + h.vlen;
+            if (!jump || jump > eof - off) {
+                STAT_BUMP(r, crc_errors, 1);
+                off = eof;
+                break;
+            }
+            p = springfield_loader_at(&l, off, jump, eof);
+            if (crc32(0, p + 4, jump - 4) != *(uint32_t *)p)
+                STAT_BUMP(r, crc_errors, 1);
+            off += jump;
+        }
+        STAT_BUMP(r, scrub_bytes, off - from);
+        done += off - from;
+
+        if (off >= eof) {
+            int g;
+            for (g = 0; g < BLOB_GENS; g++)
+                springfield_scrub_blobs(r, g, start, &done);
+            STAT_BUMP(r, scrub_passes, 1);
+            springfield_sleep_until(r, start + SCRUB_PASS_MIN_NS);
+            off = 4;
+            done = 0;
+            l.len = 0; /* read it all afresh */
+            start = springfield_now_ns();
+        } else {
+            springfield_sleep_until(r,
+                start + (uint64_t)((double)done * 1e9 / rate));
+        }
+    }
+    if (l.fd > -1)
+        close(l.fd);
+    free(l.buf);
+    return NULL;
+}
+
+double springfield_residency(springfield_t *r) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t chunk_pages = WARMUP_CHUNK / page;
+    unsigned char *vec = malloc(chunk_pages);
+    uint64_t off = 0, resident = 0, total = 0;
+
+    if (r->pool) {
+        uint64_t cap;
+        free(vec);
+        pthread_rwlock_rdlock(&r->main_lock);
+        total = (r->eof + POOL_BLOCK - 1) / POOL_BLOCK;
+        springfield_pool_usage(r->pool, &resident, &cap);
+        pthread_rwlock_unlock(&r->main_lock);
+        return total > resident ? (double)resident / (double)total : 1.0;
+    }
+
+    while (1) {
+        pthread_rwlock_rdlock(&r->main_lock);
+        if (off >= r->eof) {
+            pthread_rwlock_unlock(&r->main_lock);
+            break;
+        }
+        uint64_t end = off + WARMUP_CHUNK;
+        if (end > r->eof)
+            end = r->eof;
+        uint64_t i, n = (end - off + page - 1) / page;
+        int s = mincore(r->map + off, end - off, vec);
+        pthread_rwlock_unlock(&r->main_lock);
+        assert(!s);
+        for (i = 0; i < n; i++)
+            resident += vec[i] & 1;
+        total += n;
+        off = end;
+    }
+    free(vec);
+
+    return total ? (double)resident / (double)total : 1.0;
+}
+
+/* Flush the blob files and the data file to disk; nonzero if
+   any of it failed */
+static int springfield_sync_i(springfield_t *r) {
+    int i, s = 0;
+    /* blobs first, so no durable pointer outruns its blob */
+    for (i = 0; i < BLOB_GENS; i++) {
+        if (r->blobs[i])
+            s |= msync(r->blobs[i]->map, r->blobs[i]->alloc, MS_SYNC);
+    }
+    s |= r->pool ? fdatasync(r->mapfd) : msync(r->map, r->mmap_alloc, MS_SYNC);
+    return s;
+}
+
+void springfield_sync(springfield_t *r) {
+    uint64_t start = springfield_op_start(r);
+    springfield_wbuf_flush(r);
+    springfield_rdlock(r);
+    int s = springfield_sync_i(r);
+    if (r->pool && r->pool->direct)
+        posix_fadvise(r->mapfd, 0, 0, POSIX_FADV_DONTNEED);
+    pthread_rwlock_unlock(&r->main_lock);
+    assert(!s);
+    springfield_op_end(r, SPRINGFIELD_OP_SYNC, start);
+}
+
+/* Extend the file and the map so `step` more bytes fit past eof.
+   Caller holds main_lock for write. */
+static void springfield_grow(springfield_t *r, uint64_t step) {
+    STAT_BUMP(r, grows, 1);
+    msync(r->map, r->mmap_alloc, MS_SYNC);
+    int s = munmap(r->map, r->mmap_alloc);
+    assert(!s);
+    uint64_t new_size = r->mmap_alloc + ((r->eof + step) * 2);
+    r->mmap_alloc = new_size;
+    s = ftruncate(r->mapfd, (off_t)r->mmap_alloc);
+    assert(!s);
+    r->map = (uint8_t *)mmap(
+        NULL, r->mmap_alloc, PROT_READ | PROT_WRITE, MAP_SHARED, r->mapfd, 0);
+    /* TODO mremap() on linux */
+    s = madvise(r->map, r->mmap_alloc, springfield_map_advice(&r->opts));
+    assert(!s);
+}
+
+/* -- staging --
+
+   A record's CRC covers its header, which holds the bucket's
+   previous head and so can only be built under the write lock.
+   But the key and value are known up front: a set checksums
+   them before taking the lock, and the append folds the header
+   in with crc32_combine().  That costs a few hundred ns however
+   big the record, so records under STAGE_MIN bytes are cheaper
+   to checksum inline.  Blob entries have no such dependency and
+   are checksummed whole. */
+
+#define STAGE_MIN 256
+
+typedef struct springfield_staged_t {
+    int ready;
+    uint32_t crc; /* of key and value, or of the whole blob entry */
+} springfield_staged_t;
+
+static inline int springfield_is_blob(springfield_t *r, uint32_t vlen) {
+    return vlen && r->opts.blob_threshold && vlen >= r->opts.blob_threshold;
+}
+
+static uint32_t springfield_blob_crc(springfield_key_t *k, uint8_t *val, uint32_t vlen) {
+    springfield_blob_header h = {0, vlen, k->klen, 0};
+    uint32_t crc = crc32(0, (uint8_t *)&h + 4, BLOB_HEADER_SIZE - 4);
+    crc = crc32(crc, (uint8_t *)k->key, k->klen);
+    return crc32(crc, val, vlen);
+}
+
+/* Outside any lock: do the CRC work for setting `k` to `val` */
+static void springfield_stage(springfield_t *r, springfield_key_t *k,
+        uint8_t *val, uint32_t vlen, springfield_staged_t *st) {
+    st->ready = 0;
+    st->crc = 0;
+    if (springfield_is_blob(r, vlen)) {
+        st->crc = springfield_blob_crc(k, val, vlen);
+        st->ready = 1;
+    } else if (k->klen + vlen >= STAGE_MIN) {
+        st->crc = crc32(0, (uint8_t *)k->key, k->klen);
+        if (vlen)
+            st->crc = crc32(st->crc, val, vlen);
+        st->ready = 1;
+    }
+}
+
+/* Append a record with exactly these flags and stored value;
+   `kvcrc`, if given, is the CRC of key and value */
+static void springfield_append_crc(springfield_t *r, springfield_key_t *k,
+        uint32_t flags, uint8_t *val, uint32_t vlen, uint32_t *kvcrc) {
+    int klen = k->klen;
+    assert(klen < MAX_KLEN);
+    assert(vlen < MAX_VLEN);
+
+    if (r->cache)
+        springfield_cache_invalidate(r->cache, k);
+
+    if (r->in_rewrite) {
+        springfield_keyent_t *kobj = NULL;
+        HASH_FIND(hh, r->rewrite_keys, k->key, klen, kobj);
+        if (!kobj) {
+            kobj = calloc(1, sizeof(springfield_keyent_t));
+            kobj->key = strdup(k->key);
+            kobj->hash = k->hash;
+            HASH_ADD_KEYPTR(hh, r->rewrite_keys, kobj->key, klen, kobj);
+        }
+    }
+
+    uint32_t hlen = springfield_rec_hlen(klen, vlen);
+    uint32_t step = hlen + klen + vlen;
+    assert(r->eof + step < V2_LAST_MASK);
+    uint8_t *p = springfield_append_begin(r, step);
+
+    uint64_t last = springfield_index_keyval(r, k, r->eof);
+    if (r->bloom && vlen) {
+        springfield_bloom_add(r->bloom, k->hash);
+        if (r->bloom_next)
+            springfield_bloom_add(r->bloom_next, k->hash);
+        if (r->bloom->count > r->bloom->capacity)
+            r->bloom_full = 1;
+    }
+
+    springfield_rec_encode(p, flags, klen, vlen, last);
+    memmove(p + hlen, k->key, klen);
+    if (vlen)
+        memmove(p + hlen + klen, val, vlen);
+
+    if (kvcrc)
+        *(uint32_t *)p = crc32_combine(crc32(0, p + 4, hlen - 4), *kvcrc,
+            klen + vlen);
+    else
+        *(uint32_t *)p = crc32(0, p + 4, step - 4);
+
+    springfield_append_end(r, p, step);
+    r->eof += step;
+    STAT_BUMP(r, bytes_appended, step);
+    if (r->tails)
+        springfield_tail_notify(r);
+}
+
+static void springfield_append_i(springfield_t *r, springfield_key_t *k,
+        uint32_t flags, uint8_t *val, uint32_t vlen) {
+    springfield_append_crc(r, k, flags, val, vlen, NULL);
+}
+
+/* `st` is from springfield_stage(), or NULL */
+static void springfield_set_i(springfield_t *r, springfield_key_t *k, uint8_t *val,
+        uint32_t vlen, springfield_staged_t *st) {
+    if (springfield_is_blob(r, vlen)) {
+        springfield_blobs_t *b = springfield_blobs_for(r, r->blob_gen);
+        if (!b) {
+            b = springfield_blobs_open(r, r->blob_gen, 0, 1);
+            r->blobs[r->blob_gen % BLOB_GENS] = b;
+        }
+        springfield_blob_ptr ptr = springfield_blobs_append(b, k, val, vlen,
+            st && st->ready ? st->crc : springfield_blob_crc(k, val, vlen));
+        STAT_BUMP(r, bytes_appended, BLOB_HEADER_SIZE + k->klen + vlen);
+        springfield_append_i(r, k, FLAG_BLOB, (uint8_t *)&ptr, sizeof(ptr));
+        return;
+    }
+    springfield_append_crc(r, k, 0, val, vlen, st && st->ready ? &st->crc : NULL);
+}
+/* -- write buffer --
+
+   With options.write_buffer_bytes set, sets and deletes land in
+   an in-memory table under wbuf_lock alone, and gets look there
+   before the db.  A flusher thread swaps the table out for an
+   empty one, pre-faults the pages the batch will be appended to
+   while holding only the read lock, then appends it under the
+   write lock in WBUF_CHUNK sized runs.  So a writer no longer
+   takes main_lock or page faults, and readers aren't blocked
+   while the file is extended.
+
+   The flusher runs once the table is half full or every
+   WBUF_FLUSH_MS.  A writer stalls only if the table fills while
+   the previous one is still flushing. */
+
+#define WBUF_FLUSH_MS 10
+#define WBUF_CHUNK (1024 * 1024)
+
+typedef struct springfield_wentry_t {
+    struct springfield_wentry_t *next; /* arrival order */
+    uint32_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+    int dead; /* superseded in the same table */
+    springfield_staged_t staged;
+    UT_hash_handle hh;
+} springfield_wentry_t;
+
+#define WENTRY_KEY(e) ((char *)((e) + 1))
+#define WENTRY_VAL(e) ((uint8_t *)((e) + 1) + (e)->klen)
+
+struct springfield_wtable_t {
+    springfield_wentry_t *index;
+    springfield_wentry_t *head;
+    springfield_wentry_t *tail;
+    uint64_t bytes;
+    uint64_t count;
+};
+
+static void springfield_wtable_free(springfield_wtable_t *t) {
+    springfield_wentry_t *e = t->head, *next;
+    HASH_CLEAR(hh, t->index);
+    while (e) {
+        next = e->next;
+        free(e);
+        e = next;
+    }
+    free(t);
+}
+
+static springfield_wentry_t * springfield_wtable_find(springfield_wtable_t *t,
+        springfield_key_t *k) {
+    springfield_wentry_t *e = NULL;
+    if (t)
+        HASH_FIND(hh, t->index, k->key, k->klen, e);
+    return e;
+}
+
+static springfield_wentry_t * springfield_wentry_new(springfield_t *r,
+        springfield_key_t *k, uint8_t *val, uint32_t vlen) {
+    assert(k->klen < MAX_KLEN);
+    assert(vlen < MAX_VLEN);
+    springfield_wentry_t *e = malloc(sizeof(springfield_wentry_t) + k->klen + vlen);
+    e->next = NULL;
+    e->hash = k->hash;
+    e->klen = k->klen;
+    e->vlen = vlen;
+    e->dead = 0;
+    memcpy(WENTRY_KEY(e), k->key, k->klen);
+    if (vlen)
+        memcpy(WENTRY_VAL(e), val, vlen);
+    springfield_stage(r, k, val, vlen, &e->staged);
+    return e;
+}
+
+/* Wait out a full table; caller holds wbuf_lock */
+static void springfield_wbuf_wait_room(springfield_t *r) {
+    while (r->wbuf->bytes >= r->opts.write_buffer_bytes && r->wbuf_flushing) {
+        r->wbuf_stalls++;
+        pthread_cond_wait(&r->wbuf_flushed, &r->wbuf_lock);
+    }
+}
+
+/* Add `e`, superseding any entry for its key; caller holds
+   wbuf_lock */
+static void springfield_wbuf_insert(springfield_t *r, springfield_key_t *k,
+        springfield_wentry_t *e) {
+    springfield_wtable_t *t = r->wbuf;
+    springfield_wentry_t *old = springfield_wtable_find(t, k);
+    if (old) {
+        HASH_DEL(t->index, old);
+        old->dead = 1;
+    }
+    HASH_ADD_KEYPTR(hh, t->index, WENTRY_KEY(e), e->klen, e);
+    if (t->tail)
+        t->tail->next = e;
+    else
+        t->head = e;
+    t->tail = e;
+    t->bytes += sizeof(springfield_wentry_t) + e->klen + e->vlen;
+    t->count++;
+    __atomic_add_fetch(&r->wbuf_entries, 1, __ATOMIC_RELEASE);
+    if (t->bytes >= r->opts.write_buffer_bytes / 2)
+        pthread_cond_signal(&r->wbuf_wake);
+}
+
+static void springfield_wbuf_put(springfield_t *r, springfield_key_t *k,
+        uint8_t *val, uint32_t vlen) {
+    springfield_wentry_t *e = springfield_wentry_new(r, k, val, vlen);
+    pthread_mutex_lock(&r->wbuf_lock);
+    springfield_wbuf_wait_room(r);
+    springfield_wbuf_insert(r, k, e);
+    pthread_mutex_unlock(&r->wbuf_lock);
+}
+
+/* 1 if the write buffer holds `k`, with `*res` a malloc'd copy of
+   its value (NULL for a buffered delete) */
+static int springfield_wbuf_get(springfield_t *r, springfield_key_t *k,
+        uint8_t **res, uint32_t *len) {
+    if (!r->opts.write_buffer_bytes || !__atomic_load_n(&r->wbuf_entries, __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_mutex_lock(&r->wbuf_lock);
+    springfield_wentry_t *e = springfield_wtable_find(r->wbuf, k);
+    if (!e)
+        e = springfield_wtable_find(r->wbuf_flushing, k);
+    if (e) {
+        *res = NULL;
+        if (e->vlen) {
+            *res = malloc(e->vlen);
+            memcpy(*res, WENTRY_VAL(e), e->vlen);
+            *len = e->vlen;
+        }
+    }
+    pthread_mutex_unlock(&r->wbuf_lock);
+    return e != NULL;
+}
+
+/* Fault in the `need` bytes past eof ahead of an append.  Only
+   appends move eof, and they're shut out by the read lock, so
+   nothing else touches these pages meanwhile. */
+static void springfield_prefault(springfield_t *r, uint64_t need) {
+    if (r->pool)
+        return;
+    if (r->eof + need > r->mmap_alloc) {
+        springfield_wrlock(r);
+        if (r->eof + need > r->mmap_alloc)
+            springfield_grow(r, need);
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+
+    springfield_rdlock(r);
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t from = r->eof & ~(page - 1);
+    uint64_t to = r->eof + need < r->mmap_alloc ? r->eof + need : r->mmap_alloc;
+    int done = 0;
+#ifdef MADV_POPULATE_WRITE
+    done = !madvise(r->map + from, to - from, MADV_POPULATE_WRITE);
+#endif
+    if (!done) {
+        /* bytes past eof are free to scribble on */
+        for (from += page; from < to; from += page)
+            r->map[from] = 0;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+}
+
+static void springfield_wbuf_flush(springfield_t *r) {
+    if (!r->opts.write_buffer_bytes)
+        return;
+
+    pthread_mutex_lock(&r->wbuf_lock);
+    while (r->wbuf_flushing)
+        pthread_cond_wait(&r->wbuf_flushed, &r->wbuf_lock);
+    springfield_wtable_t *t = r->wbuf;
+    if (!t->count) {
+        pthread_mutex_unlock(&r->wbuf_lock);
+        return;
+    }
+    r->wbuf_flushing = t;
+    r->wbuf = calloc(1, sizeof(springfield_wtable_t));
+    pthread_mutex_unlock(&r->wbuf_lock);
+
+    springfield_wentry_t *e;
+    uint64_t need = 0;
+    for (e = t->head; e; e = e->next) {
+        if (e->dead)
+            continue;
+        need += HEADER_MAX_SIZE + e->klen;
+        if (r->opts.blob_threshold && e->vlen >= r->opts.blob_threshold)
+            need += sizeof(springfield_blob_ptr);
+        else
+            need += e->vlen;
+    }
+    springfield_prefault(r, need);
+
+    e = t->head;
+    while (e) {
+        uint64_t chunk = 0;
+        springfield_wrlock(r);
+        for (; e && chunk < WBUF_CHUNK; e = e->next) {
+            if (e->dead)
+                continue;
+            springfield_key_t k = {WENTRY_KEY(e), e->klen, e->hash};
+            springfield_set_i(r, &k, e->vlen ? WENTRY_VAL(e) : NULL, e->vlen,
+                &e->staged);
+            chunk += e->klen + e->vlen;
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    springfield_bloom_maintain(r);
+
+    pthread_mutex_lock(&r->wbuf_lock);
+    r->wbuf_flushing = NULL;
+    __atomic_sub_fetch(&r->wbuf_entries, t->count, __ATOMIC_RELEASE);
+    r->wbuf_flushes++;
+    pthread_cond_broadcast(&r->wbuf_flushed);
+    pthread_mutex_unlock(&r->wbuf_lock);
+    springfield_wtable_free(t);
+}
+
+static void * springfield_wbuf_thread(void *arg) {
+    springfield_t *r = (springfield_t *)arg;
+    pthread_mutex_lock(&r->wbuf_lock);
+    while (!r->wbuf_stop) {
+        if (r->wbuf->bytes < r->opts.write_buffer_bytes / 2) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += WBUF_FLUSH_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&r->wbuf_wake, &r->wbuf_lock, &ts);
+        }
+        if (r->wbuf_stop || !r->wbuf->count)
+            continue;
+        pthread_mutex_unlock(&r->wbuf_lock);
+        springfield_wbuf_flush(r);
+        pthread_mutex_lock(&r->wbuf_lock);
+    }
+    pthread_mutex_unlock(&r->wbuf_lock);
+    return NULL;
+}
+
+static void springfield_wbuf_start(springfield_t *r) {
+    pthread_mutex_init(&r->wbuf_lock, NULL);
+    pthread_cond_init(&r->wbuf_wake, NULL);
+    pthread_cond_init(&r->wbuf_flushed, NULL);
+    r->wbuf = calloc(1, sizeof(springfield_wtable_t));
+    int res = pthread_create(&r->wbuf_thread, NULL, springfield_wbuf_thread, r);
+    assert(!res);
+    (void)res;
+}
+
+static void springfield_wbuf_stats(springfield_t *r, springfield_stats_t *out) {
+    if (!r->opts.write_buffer_bytes)
+        return;
+    pthread_mutex_lock(&r->wbuf_lock);
+    out->wbuf_bytes = r->wbuf->bytes +
+        (r->wbuf_flushing ? r->wbuf_flushing->bytes : 0);
+    out->wbuf_flushes = r->wbuf_flushes;
+    out->wbuf_stalls = r->wbuf_stalls;
+    pthread_mutex_unlock(&r->wbuf_lock);
+}
+
+static void springfield_wbuf_stop(springfield_t *r) {
+    if (!r->opts.write_buffer_bytes)
+        return;
+    pthread_mutex_lock(&r->wbuf_lock);
+    r->wbuf_stop = 1;
+    pthread_cond_signal(&r->wbuf_wake);
+    pthread_mutex_unlock(&r->wbuf_lock);
+    pthread_join(r->wbuf_thread, NULL);
+
+    springfield_wbuf_flush(r);
+    springfield_wtable_free(r->wbuf);
+    r->wbuf = NULL;
+    pthread_mutex_destroy(&r->wbuf_lock);
+    pthread_cond_destroy(&r->wbuf_wake);
+    pthread_cond_destroy(&r->wbuf_flushed);
+}
+
+/* Write `k`'s folded value over its operands, unless something
+   newer than `off` has been written to it since the fold */
+static void springfield_fold_rewrite(springfield_t *r, springfield_key_t *k,
+        uint64_t off) {
+    springfield_pin_t pin = PIN_INIT;
+    uint32_t len = 0;
+    int seeks;
+    springfield_wrlock(r);
+    if (springfield_find_i(r, k, &seeks) == off) {
+        uint8_t *val = springfield_value_at(r, off, &len, &pin, NULL);
+        springfield_set_i(r, k, val, val ? len : 0, NULL);
+        springfield_unpin(r, &pin);
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+}
+
+void springfield_set_k(springfield_t *r, springfield_key_t *k, uint8_t *val, uint32_t vlen) {
+    uint64_t start = springfield_op_start(r);
+    if (r->opts.write_buffer_bytes) {
+        springfield_wbuf_put(r, k, val, vlen);
+    } else {
+        springfield_staged_t staged;
+        springfield_stage(r, k, val, vlen, &staged);
+        springfield_wrlock(r);
+        springfield_set_i(r, k, val, vlen, &staged);
+        pthread_rwlock_unlock(&r->main_lock);
+        springfield_bloom_maintain(r);
+    }
+
+    if (vlen) {
+        STAT_BUMP(r, sets, 1);
+        springfield_op_end(r, SPRINGFIELD_OP_SET, start);
+    } else {
+        STAT_BUMP(r, dels, 1);
+        springfield_op_end(r, SPRINGFIELD_OP_DEL, start);
+    }
+}
+
+void springfield_set(springfield_t *r, char *key, uint8_t *val, uint32_t vlen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_set_k(r, &k, val, vlen);
+}
+
+/* -- read-modify-write --
+
+   cas, incr and merge read the current value and write the new
+   one without letting another writer in between: under the write
+   lock, or with the write buffer on, under wbuf_lock (reading the
+   db proper under the read lock when the key isn't buffered, and
+   buffering the result).
+
+   options.merge_lazy skips the read: the operand is appended as
+   a FLAG_MERGE record, and reads fold the operands back into the
+   key's last plain value (springfield_fold()).  Compaction writes
+   out the folded value.  springfield_append() works the same way
+   with FLAG_APPEND fragments, whatever the options.  A key that
+   is sitting in the write buffer has its operand applied to the
+   buffered value instead. */
+
+/* Decide `k`'s new value from `cur` (NULL if none); 1 to write
+   `*out` (NULL for none), 0 to leave the key alone */
+typedef int (*springfield_rmw_fn) (springfield_key_t *k, uint8_t *cur,
+        uint32_t cur_len, void *arg, uint8_t **out, uint32_t *out_len);
+
+/* The current value of `k` in the db proper, merge operands
+   folded in; caller holds main_lock.  Good until `pin` is
+   released. */
+static uint8_t * springfield_value_of(springfield_t *r, springfield_key_t *k,
+        uint32_t *len, springfield_pin_t *pin) {
+    if (r->bloom && !springfield_bloom_maybe(r->bloom, k->hash))
+        return NULL;
+    int seeks;
+    uint64_t off = springfield_find_i(r, k, &seeks);
+    return off == NO_BACKTRACE ? NULL : springfield_value_at(r, off, len, pin, NULL);
+}
+
+static void springfield_rmw(springfield_t *r, springfield_key_t *k,
+        springfield_rmw_fn fn, void *arg) {
+    uint64_t start = springfield_op_start(r);
+    springfield_pin_t pin = PIN_INIT;
+    uint8_t *cur, *out = NULL;
+    uint32_t cur_len = 0, out_len = 0;
+
+    if (r->opts.write_buffer_bytes) {
+        pthread_mutex_lock(&r->wbuf_lock);
+        springfield_wbuf_wait_room(r);
+        springfield_wentry_t *e = springfield_wtable_find(r->wbuf, k);
+        if (!e)
+            e = springfield_wtable_find(r->wbuf_flushing, k);
+        int write;
+        if (e) {
+            cur = e->vlen ? WENTRY_VAL(e) : NULL;
+            write = fn(k, cur, e->vlen, arg, &out, &out_len);
+        } else {
+            springfield_rdlock(r);
+            cur = springfield_value_of(r, k, &cur_len, &pin);
+            write = fn(k, cur, cur_len, arg, &out, &out_len);
+            springfield_unpin(r, &pin);
+            pthread_rwlock_unlock(&r->main_lock);
+        }
+        if (write)
+            springfield_wbuf_insert(r, k,
+                springfield_wentry_new(r, k, out, out ? out_len : 0));
+        pthread_mutex_unlock(&r->wbuf_lock);
+    } else {
+        springfield_wrlock(r);
+        cur = springfield_value_of(r, k, &cur_len, &pin);
+        int write = fn(k, cur, cur_len, arg, &out, &out_len);
+        springfield_unpin(r, &pin);
+        if (write)
+            springfield_set_i(r, k, out, out ? out_len : 0, NULL);
+        pthread_rwlock_unlock(&r->main_lock);
+        springfield_bloom_maintain(r);
+    }
+
+    STAT_BUMP(r, rmws, 1);
+    springfield_op_end(r, SPRINGFIELD_OP_SET, start);
+}
+
+typedef struct springfield_cas_t {
+    uint8_t *expect;
+    uint32_t elen;
+    uint8_t *val;
+    uint32_t vlen;
+    int swapped;
+} springfield_cas_t;
+
+static int springfield_cas_fn(springfield_key_t *k, uint8_t *cur,
+        uint32_t cur_len, void *arg, uint8_t **out, uint32_t *out_len) {
+    springfield_cas_t *c = (springfield_cas_t *)arg;
+    if (c->expect ? !cur || cur_len != c->elen || memcmp(cur, c->expect, c->elen) :
+            cur != NULL)
+        return 0;
+    c->swapped = 1;
+    *out = c->vlen ? c->val : NULL;
+    *out_len = c->vlen;
+    return cur || c->vlen;
+}
+
+int springfield_cas_k(springfield_t *r, springfield_key_t *k, uint8_t *expect,
+        uint32_t elen, uint8_t *val, uint32_t vlen) {
+    springfield_cas_t c = {expect, elen, val, vlen, 0};
+    springfield_rmw(r, k, springfield_cas_fn, &c);
+    return c.swapped;
+}
+
+int springfield_cas(springfield_t *r, char *key, uint8_t *expect, uint32_t elen,
+        uint8_t *val, uint32_t vlen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_cas_k(r, &k, expect, elen, val, vlen);
+}
+
+/* `arg` is the delta going in and the sum coming out */
+typedef struct springfield_incr_t {
+    int64_t v;
+    int bad;
+} springfield_incr_t;
+
+static int springfield_incr_fn(springfield_key_t *k, uint8_t *cur,
+        uint32_t cur_len, void *arg, uint8_t **out, uint32_t *out_len) {
+    springfield_incr_t *in = (springfield_incr_t *)arg;
+    int64_t was = 0;
+    if (cur) {
+        if (cur_len != sizeof(int64_t)) {
+            in->bad = 1;
+            return 0;
+        }
+        memcpy(&was, cur, sizeof(int64_t));
+    }
+    in->v += was;
+    *out = (uint8_t *)&in->v;
+    *out_len = sizeof(int64_t);
+    return 1;
+}
+
+int springfield_incr_k(springfield_t *r, springfield_key_t *k, int64_t delta,
+        int64_t *result) {
+    springfield_incr_t in = {delta, 0};
+    springfield_rmw(r, k, springfield_incr_fn, &in);
+    if (in.bad) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (result)
+        *result = in.v;
+    return 0;
+}
+
+int springfield_incr(springfield_t *r, char *key, int64_t delta, int64_t *result) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_incr_k(r, &k, delta, result);
+}
+
+typedef struct springfield_merge_t {
+    springfield_t *r;
+    uint8_t *operand;
+    uint32_t olen;
+    uint8_t *res;   /* from the operator, for the caller to free */
+} springfield_merge_t;
+
+static int springfield_merge_fn_i(springfield_key_t *k, uint8_t *cur,
+        uint32_t cur_len, void *arg, uint8_t **out, uint32_t *out_len) {
+    springfield_merge_t *m = (springfield_merge_t *)arg;
+    springfield_options_t *o = &m->r->opts;
+    *out = m->res = o->merge(k->key, cur, cur ? cur_len : 0, m->operand,
+        m->olen, out_len, o->merge_passthrough);
+    return m->res || cur;
+}
+
+/* Append `operand` for `k` as a `flag` record, or if `k` is in the
+   write buffer, apply it there with `fn` */
+static void springfield_push_operand(springfield_t *r, springfield_key_t *k,
+        uint32_t flag, uint8_t *operand, uint32_t olen,
+        springfield_rmw_fn fn, void *arg) {
+    uint32_t crc = 0;
+    int staged = k->klen + olen >= STAGE_MIN;
+    if (staged)
+        crc = crc32(crc32(0, (uint8_t *)k->key, k->klen), operand, olen);
+
+    if (r->opts.write_buffer_bytes) {
+        pthread_mutex_lock(&r->wbuf_lock);
+        springfield_wbuf_wait_room(r);
+        springfield_wentry_t *e = springfield_wtable_find(r->wbuf, k);
+        if (!e)
+            e = springfield_wtable_find(r->wbuf_flushing, k);
+        if (e) {
+            uint8_t *out = NULL;
+            uint32_t out_len = 0;
+            if (fn(k, e->vlen ? WENTRY_VAL(e) : NULL, e->vlen, arg, &out, &out_len))
+                springfield_wbuf_insert(r, k,
+                    springfield_wentry_new(r, k, out, out ? out_len : 0));
+            pthread_mutex_unlock(&r->wbuf_lock);
+            return;
+        }
+        /* holding wbuf_lock keeps a buffered write from landing
+           on top of this one */
+    }
+    springfield_wrlock(r);
+    springfield_append_crc(r, k, flag, operand, olen, staged ? &crc : NULL);
+    pthread_rwlock_unlock(&r->main_lock);
+    if (r->opts.write_buffer_bytes)
+        pthread_mutex_unlock(&r->wbuf_lock);
+    springfield_bloom_maintain(r);
+}
+
+void springfield_merge_k(springfield_t *r, springfield_key_t *k, uint8_t *operand,
+        uint32_t olen) {
+    assert(r->opts.merge);
+    assert(olen > 0);
+    springfield_merge_t m = {r, operand, olen, NULL};
+    if (!r->opts.merge_lazy) {
+        springfield_rmw(r, k, springfield_merge_fn_i, &m);
+        free(m.res);
+        return;
+    }
+
+    uint64_t start = springfield_op_start(r);
+    springfield_push_operand(r, k, FLAG_MERGE, operand, olen,
+        springfield_merge_fn_i, &m);
+    free(m.res);
+    STAT_BUMP(r, rmws, 1);
+    springfield_op_end(r, SPRINGFIELD_OP_SET, start);
+}
+
+void springfield_merge(springfield_t *r, char *key, uint8_t *operand, uint32_t olen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_merge_k(r, &k, operand, olen);
+}
+
+typedef struct springfield_append_t {
+    uint8_t *frag;
+    uint32_t len;
+    uint8_t *res;
+} springfield_append_t;
+
+static int springfield_append_fn(springfield_key_t *k, uint8_t *cur,
+        uint32_t cur_len, void *arg, uint8_t **out, uint32_t *out_len) {
+    springfield_append_t *a = (springfield_append_t *)arg;
+    if (!cur)
+        cur_len = 0;
+    assert((uint64_t)cur_len + a->len < MAX_VLEN);
+    a->res = malloc(cur_len + a->len);
+    if (cur_len)
+        memcpy(a->res, cur, cur_len);
+    memcpy(a->res + cur_len, a->frag, a->len);
+    *out = a->res;
+    *out_len = cur_len + a->len;
+    return 1;
+}
+
+void springfield_append_k(springfield_t *r, springfield_key_t *k, uint8_t *frag,
+        uint32_t len) {
+    assert(len > 0);
+    uint64_t start = springfield_op_start(r);
+    springfield_append_t a = {frag, len, NULL};
+    springfield_push_operand(r, k, FLAG_APPEND, frag, len,
+        springfield_append_fn, &a);
+    free(a.res);
+    STAT_BUMP(r, sets, 1);
+    springfield_op_end(r, SPRINGFIELD_OP_SET, start);
+}
+
+void springfield_append(springfield_t *r, char *key, uint8_t *frag, uint32_t len) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_append_k(r, &k, frag, len);
+}
+
+/* -- live scans -- */
+
+typedef struct springfield_live_t {
+    uint64_t off;
+    uint32_t dest;
+} springfield_live_t;
+
+/* Called with each live key's newest record; under the read lock */
+typedef void(*springfield_live_cb) (springfield_t *r, uint64_t off,
+        char *key, uint32_t klen, void *arg);
+
+/* Walk bucket `i`'s chain under the read lock, passing the newest
+   record of each key to `cb` if it has a value.  Returns the
+   number of records stepped over. */
+static uint64_t springfield_walk_live(springfield_t *r, uint32_t i,
+        springfield_live_cb cb, void *arg) {
+    springfield_keyent_t *seen = NULL, *key, *ktmp;
+    uint64_t walked = 0;
+
+    springfield_rdlock(r);
+    uint64_t off = r->offsets[i];
+    while (off != NO_BACKTRACE) {
+        springfield_pin_t pin = PIN_INIT;
+        springfield_rec h;
+        uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+        char *keyptr = (char *)p + h.hlen;
+        HASH_FIND(hh, seen, keyptr, h.klen - 1, key);
+        if (!key) {
+            /* the map stays put while we hold the lock; pool
+               frames don't */
+            key = calloc(1, sizeof(springfield_keyent_t));
+            key->key = r->pool ? strdup(keyptr) : keyptr;
+            HASH_ADD_KEYPTR(hh, seen, key->key, h.klen - 1, key);
+            if (h.vlen)
+                cb(r, off, keyptr, h.klen, arg);
+        }
+        springfield_unpin(r, &pin);
+        off = h.last;
+        walked++;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+    HASH_ITER(hh, seen, key, ktmp) {
+        HASH_DEL(seen, key);
+        if (r->pool)
+            free(key->key);
+        free(key);
+    }
+    return walked;
+}
+
+typedef struct springfield_scan_t {
+    char *prefix;
+    size_t plen;
+    uint32_t dest_buckets;
+    springfield_live_t *live;
+    uint64_t n;
+    uint64_t alloc;
+} springfield_scan_t;
+
+static void springfield_scan_one(springfield_t *r, uint64_t off,
+        char *key, uint32_t klen, void *arg) {
+    springfield_scan_t *sc = (springfield_scan_t *)arg;
+    if (sc->plen && strncmp(key, sc->prefix, sc->plen))
+        return;
+    if (sc->n == sc->alloc) {
+        sc->alloc = sc->alloc ? sc->alloc * 2 : 4096;
+        sc->live = realloc(sc->live, sc->alloc * sizeof(springfield_live_t));
+    }
+    sc->live[sc->n].off = off;
+    sc->live[sc->n].dest = sc->dest_buckets ?
+        hash(key, klen - 1) % sc->dest_buckets : 0;
+    sc->n++;
+}
+
+/* Scan r's chains for the newest live record of every key
+   (starting with `prefix`, if given), noting which of
+   `dest_buckets` buckets it would belong in */
+static springfield_live_t * springfield_scan_live(springfield_t *r,
+        char *prefix, uint32_t dest_buckets, uint64_t *count) {
+    springfield_scan_t sc = {prefix, prefix ? strlen(prefix) : 0,
+        dest_buckets, NULL, 0, 0};
+    uint32_t i;
+
+    for (i = 0; i < r->num_buckets; i++) {
+        springfield_walk_live(r, i, springfield_scan_one, &sc);
+        if (r->in_rewrite)
+            r->compact_buckets_done = i;
+    }
+
+    *count = sc.n;
+    return sc.live;
+}
+
+static void springfield_bloom_one(springfield_t *r, uint64_t off,
+        char *key, uint32_t klen, void *arg) {
+    springfield_bloom_add((springfield_bloom_t *)arg, hash(key, klen - 1));
+}
+
+/* Rebuild the Bloom filter at twice its key count.  Each write
+   that finds it full walks whole buckets into the new filter
+   until it has stepped over BLOOM_REBUILD_SLICE records, so no
+   one write pays for the whole db; set_i feeds the new filter
+   too meanwhile.  Compaction and blob GC (which hold iter_lock)
+   win over a slice, and a compaction drops a half-built filter
+   for the one it made. */
+static void springfield_bloom_maintain(springfield_t *r) {
+    uint64_t walked = 0;
+
+    if (!r->bloom_full || pthread_mutex_trylock(&r->iter_lock))
+        return;
+    if (!r->bloom_next) {
+        springfield_wrlock(r);
+        if (!r->bloom || r->bloom->count <= r->bloom->capacity) {
+            r->bloom_full = 0;
+            pthread_rwlock_unlock(&r->main_lock);
+            pthread_mutex_unlock(&r->iter_lock);
+            return;
+        }
+        r->bloom_next = springfield_bloom_create(&r->opts,
+            r->bloom->count * 2, r->opts.bloom_bits_per_key);
+        r->bloom_rebuilt = 0;
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+
+    while (r->bloom_rebuilt < r->num_buckets && walked < BLOOM_REBUILD_SLICE)
+        walked += springfield_walk_live(r, r->bloom_rebuilt++,
+            springfield_bloom_one, r->bloom_next);
+
+    if (r->bloom_rebuilt == r->num_buckets) {
+        springfield_wrlock(r);
+        springfield_bloom_destroy(&r->opts, r->bloom);
+        r->bloom = r->bloom_next;
+        r->bloom_next = NULL;
+        r->bloom_full = 0;
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    pthread_mutex_unlock(&r->iter_lock);
+}
+
+/* -- deletes --
+
+   A tombstone costs a header and the key, and every later walk of
+   its chain steps over it, so del only writes one when the key
+   has a value to hide.  Compaction then drops them all: nothing
+   needs a tombstone once the values under it are gone. */
+
+/* 1 if `k` has a value in the db proper; caller holds main_lock */
+static int springfield_exists_i(springfield_t *r, springfield_key_t *k) {
+    if (r->bloom && !springfield_bloom_maybe(r->bloom, k->hash))
+        return 0;
+    int seeks;
+    uint64_t off = springfield_find_i(r, k, &seeks);
+    if (off == NO_BACKTRACE)
+        return 0;
+    springfield_pin_t pin = PIN_INIT;
+    springfield_rec h;
+    springfield_rec_pin(r, off, &h, 0, &pin);
+    springfield_unpin(r, &pin);
+    return h.vlen > 0;
+}
+
+/* As exists_i, but taking the write buffer into account and
+   main_lock as needed */
+static int springfield_exists(springfield_t *r, springfield_key_t *k) {
+    if (r->opts.write_buffer_bytes &&
+            __atomic_load_n(&r->wbuf_entries, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&r->wbuf_lock);
+        springfield_wentry_t *e = springfield_wtable_find(r->wbuf, k);
+        if (!e)
+            e = springfield_wtable_find(r->wbuf_flushing, k);
+        int live = e ? e->vlen > 0 : -1;
+        pthread_mutex_unlock(&r->wbuf_lock);
+        if (live >= 0)
+            return live;
+    }
+    springfield_rdlock(r);
+    int live = springfield_exists_i(r, k);
+    pthread_rwlock_unlock(&r->main_lock);
+    return live;
+}
+
+/* Delete each of `keys` that exists; returns how many did */
+static uint64_t springfield_del_batch(springfield_t *r, springfield_key_t *keys,
+        uint64_t count) {
+    uint64_t i, deleted = 0;
+    if (r->opts.write_buffer_bytes) {
+        for (i = 0; i < count; i++) {
+            if (springfield_exists(r, &keys[i])) {
+                springfield_wbuf_put(r, &keys[i], NULL, 0);
+                deleted++;
+            }
+        }
+    } else {
+        springfield_wrlock(r);
+        for (i = 0; i < count; i++) {
+            if (springfield_exists_i(r, &keys[i])) {
+                springfield_set_i(r, &keys[i], NULL, 0, NULL);
+                deleted++;
+            }
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+
+    STAT_BUMP(r, dels, deleted);
+    STAT_BUMP(r, dels_skipped, count - deleted);
+    return deleted;
+}
+
+void springfield_del_k(springfield_t *r, springfield_key_t *k) {
+    uint64_t start = springfield_op_start(r);
+    springfield_del_batch(r, k, 1);
+    springfield_op_end(r, SPRINGFIELD_OP_DEL, start);
+}
+
+void springfield_del(springfield_t *r, char *key) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_del_k(r, &k);
+}
+
+uint64_t springfield_del_many(springfield_t *r, springfield_key_t *keys, int count) {
+    uint64_t start = springfield_op_start(r);
+    uint64_t deleted = springfield_del_batch(r, keys, count);
+    springfield_op_end(r, SPRINGFIELD_OP_DEL, start);
+    return deleted;
+}
+
+#define DEL_PREFIX_BATCH 1024
+
+uint64_t springfield_del_prefix(springfield_t *r, char *prefix) {
+    uint64_t start = springfield_op_start(r);
+    uint64_t n, i, j, deleted = 0;
+    size_t plen = strlen(prefix);
+
+    springfield_wbuf_flush(r);
+    springfield_iter_lock(r);
+    springfield_live_t *live = springfield_scan_live(r, prefix, 0, &n);
+
+    springfield_key_t *keys = malloc(DEL_PREFIX_BATCH * sizeof(springfield_key_t));
+    for (i = 0; i < n; i += DEL_PREFIX_BATCH) {
+        uint64_t batch = n - i < DEL_PREFIX_BATCH ? n - i : DEL_PREFIX_BATCH;
+        /* copy the keys out: deleting appends, which can move the map */
+        springfield_rdlock(r);
+        for (j = 0; j < batch; j++) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            uint8_t *p = springfield_rec_pin(r, live[i + j].off, &h, 0, &pin);
+            char *key = strdup((char *)p + h.hlen);
+            springfield_unpin(r, &pin);
+            assert(!strncmp(key, prefix, plen));
+            springfield_key_init(&keys[j], key);
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+
+        deleted += springfield_del_batch(r, keys, batch);
+        for (j = 0; j < batch; j++)
+            free(keys[j].key);
+    }
+    free(keys);
+    free(live);
+
+    pthread_mutex_unlock(&r->iter_lock);
+    springfield_op_end(r, SPRINGFIELD_OP_DEL, start);
+    return deleted;
+}
+
+static void springfield_iter_i(springfield_t *r, springfield_iter_cb cb,
+        springfield_readonly_iter_cb rocb, void *passthrough) {
+    /* Copy into temporary buffer */
+    if (cb) {
+        assert(!rocb);
+    } else {
+        assert(rocb);
+    }
+    int i;
+    for (i = 0; i < r->num_buckets; i++) {
+        uint64_t off = r->offsets[i];
+        springfield_keyent_t *key = NULL, *tmp = NULL;
+        springfield_keyent_t *keys = NULL;
+        springfield_rdlock(r);
+        while (off != NO_BACKTRACE) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+            int klen = h.klen - 1;
+            char *keyptr = (char *)p + h.hlen;
+            HASH_FIND(hh, keys, keyptr, klen, key);
+            uint64_t last = h.last;
+            if (!key) {
+                /* not found */
+                key = calloc(1, sizeof(springfield_keyent_t));
+                key->key = strdup(keyptr);
+                springfield_unpin(r, &pin);
+                int do_callback = h.vlen > 0;
+                if (do_callback) {
+                    if (cb) {
+                        pthread_rwlock_unlock(&r->main_lock);
+                        cb(r, key->key, passthrough);
+                        springfield_rdlock(r);
+                    } else {
+                        /* the pin outlives the lock; iter_lock
+                           keeps compaction away meanwhile */
+                        uint32_t vlen;
+                        uint8_t *val = springfield_value_at(r, off, &vlen, &pin, NULL);
+                        pthread_rwlock_unlock(&r->main_lock);
+                        if (val)
+                            rocb(r, key->key, val, vlen, passthrough);
+                        springfield_rdlock(r);
+                        springfield_unpin(r, &pin);
+                    }
+                }
+                /* set in hash */
+                HASH_ADD_KEYPTR(hh, keys, key->key, klen, key);
+            } else {
+                springfield_unpin(r, &pin);
+            }
+
+            off = last;
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+        /* cleanup keys XXX */
+        HASH_ITER(hh, keys, key, tmp) {
+            HASH_DEL(keys, key);
+            free(key->key);
+            free(key);
+        }
+    }
+}
+
+void springfield_iter(springfield_t *r, springfield_iter_cb cb, void *passthrough) {
+    springfield_wbuf_flush(r);
+    springfield_iter_lock(r);
+    springfield_iter_i(r, cb, NULL, passthrough);
+    pthread_mutex_unlock(&r->iter_lock);
+}
+
+void springfield_readonly_iter(springfield_t *r, springfield_readonly_iter_cb cb, void *passthrough) {
+    springfield_wbuf_flush(r);
+    springfield_iter_lock(r);
+    springfield_iter_i(r, NULL, cb, passthrough);
+    pthread_mutex_unlock(&r->iter_lock);
+}
+
+/* -- clustered rewrite --
+
+   Compaction writes each destination bucket's live records back
+   to back, oldest first: the bucket head is then the newest
+   record and each `last` points at the record right before it,
+   so a chain walk reads one short contiguous run.  A run that
+   fits in a page but would straddle a page boundary starts on
+   the next page instead, behind a FLAG_PAD record. */
+
+#define CLUSTER_PAGE 4096
+
+static int springfield_off_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Fill `len` bytes (at least V2_MIN_SIZE) with a FLAG_PAD record.
+   Where the vlen varint grows a byte, no 1 byte key fits exactly,
+   so the key takes up the slack. */
+static void springfield_pad_i(springfield_t *r, uint32_t len) {
+    uint32_t klen, vlen = 0, hlen = 0;
+    for (klen = 1; klen <= 2; klen++) {
+        vlen = len - springfield_rec_hlen(klen, 0) - klen;
+        if (springfield_rec_hlen(klen, vlen) + klen + vlen != len)
+            vlen--;
+        hlen = springfield_rec_hlen(klen, vlen);
+        if (hlen + klen + vlen == len)
+            break;
+    }
+    assert(hlen + klen + vlen == len);
+
+    uint8_t *p = springfield_append_begin(r, len);
+    springfield_rec_encode(p, FLAG_PAD, klen, vlen, NO_BACKTRACE);
+    memset(p + hlen, 0, klen + vlen);
+    *(uint32_t *)p = crc32(0, p + 4, len - 4);
+    springfield_append_end(r, p, len);
+    r->eof += len;
+}
+
+/* Copy the live record `h` at `off` (`p`) of r into tmp, folding
+   merge operands into a plain value; 0 if they fold to nothing */
+static int springfield_copy_live(springfield_t *r, springfield_t *tmp,
+        springfield_key_t *k, uint64_t off, springfield_rec *h, uint8_t *p) {
+    if (!(h->flags & FLAG_OPERAND)) {
+        springfield_append_i(tmp, k, h->flags, p + h->hlen + h->klen, h->vlen);
+        return 1;
+    }
+    uint32_t len;
+    uint8_t *val = springfield_fold(r, off, &len, NULL);
+    if (val)
+        springfield_append_i(tmp, k, 0, val, len);
+    free(val);
+    return val != NULL;
+}
+
+/* With `rate`, the copy sleeps between buckets to write at most
+   that many bytes a second (unless the db starts closing) */
+static void springfield_rewrite_clustered(springfield_t *r, springfield_t *tmp,
+        uint64_t rate) {
+    uint64_t n, i, j;
+    uint32_t d;
+    springfield_live_t *live = springfield_scan_live(r, NULL, tmp->num_buckets, &n);
+
+    /* Counting sort by destination bucket */
+    uint64_t *starts = calloc(tmp->num_buckets + 1, sizeof(uint64_t));
+    uint64_t *offs = malloc((n ? n : 1) * sizeof(uint64_t));
+    for (i = 0; i < n; i++)
+        starts[live[i].dest + 1]++;
+    for (d = 0; d < tmp->num_buckets; d++)
+        starts[d + 1] += starts[d];
+    for (i = 0; i < n; i++)
+        offs[starts[live[i].dest]++] = live[i].off;
+    for (d = tmp->num_buckets; d > 0; d--)
+        starts[d] = starts[d - 1];
+    starts[0] = 0;
+    free(live);
+
+    uint64_t start = springfield_now_ns(), from = tmp->eof;
+    for (d = 0; d < tmp->num_buckets; d++) {
+        uint64_t lo = starts[d], hi = starts[d + 1], size = 0;
+        if (lo == hi)
+            continue;
+        qsort(offs + lo, hi - lo, sizeof(uint64_t), springfield_off_cmp);
+
+        springfield_rdlock(r);
+        for (j = lo; j < hi; j++) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            springfield_rec_pin(r, offs[j], &h, 0, &pin);
+            springfield_unpin(r, &pin);
+            size += springfield_rec_hlen(h.klen, h.vlen) + h.klen + h.vlen;
+        }
+        uint64_t gap = CLUSTER_PAGE - tmp->eof % CLUSTER_PAGE;
+        if (size <= CLUSTER_PAGE && size > gap && gap >= V2_MIN_SIZE)
+            springfield_pad_i(tmp, gap);
+        for (j = lo; j < hi; j++) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            springfield_key_t k;
+            uint8_t *p = springfield_rec_pin(r, offs[j], &h, 1, &pin);
+            springfield_key_init(&k, (char *)p + h.hlen);
+            springfield_copy_live(r, tmp, &k, offs[j], &h, p);
+            springfield_unpin(r, &pin);
+        }
+        r->compact_buckets_done = r->num_buckets + d;
+        pthread_rwlock_unlock(&r->main_lock);
+        if (rate)
+            springfield_sleep_until(r,
+                start + (uint64_t)((double)(tmp->eof - from) * 1e9 / rate));
+    }
+
+    free(starts);
+    free(offs);
+}
+
+static void springfield_compact_i(springfield_t *r, uint32_t num_buckets,
+        uint64_t rate) {
+    char path[1200] = {0};
+    uint64_t start = springfield_op_start(r);
+    springfield_wbuf_flush(r);
+    springfield_iter_lock(r);
+
+    assert(strlen(r->path) < 1100);
+
+    strcat(path, r->path);
+    strcat(path, ".springfield_rewrite");
+
+    /* The cache is keyed by key, not offset, and the rewrite
+       doesn't change any value, so r's cache stays valid across
+       the swap; tmp doesn't need one of its own */
+    springfield_options_t topts = r->opts;
+    topts.cache_bytes = 0;
+    topts.warmup = SPRINGFIELD_WARMUP_NONE;
+    topts.blob_threshold = 0;
+    topts.write_buffer_bytes = 0;
+    topts.pool_bytes = POOL_MIN_BYTES;
+    springfield_t *tmp = springfield_create_i(path, num_buckets ?
+       num_buckets : r->num_buckets, &topts,
+       r->bloom ? r->bloom->count : 0, 1);
+    springfield_tail_reserve(tmp);
+
+    /* set up "rewrite" mode */
+    springfield_wrlock(r);
+    r->in_rewrite = 1;
+    r->rewrite_keys = NULL;
+    r->compact_running = 1;
+    r->compact_buckets_done = 0;
+    r->compact_buckets_total = r->num_buckets + tmp->num_buckets;
+    pthread_rwlock_unlock(&r->main_lock);
+
+    springfield_rewrite_clustered(r, tmp, rate);
+
+    /* tear down "rewrite" mode */
+    springfield_wrlock(r);
+
+    r->in_rewrite = 0;
+    r->compact_running = 0;
+    r->compact_buckets_done = r->compact_buckets_total;
+    r->compactions++;
+    springfield_keyent_t *key, *ktmp;
+    HASH_ITER(hh, r->rewrite_keys, key, ktmp) {
+
+        int seeks;
+        springfield_key_t k;
+        springfield_key_init_hashed(&k, key->key, key->hash);
+        uint64_t off = springfield_find_i(r, &k, &seeks);
+        springfield_pin_t pin = PIN_INIT;
+        springfield_rec h;
+        uint8_t *p = NULL;
+        if (off != NO_BACKTRACE)
+            p = springfield_rec_pin(r, off, &h, 1, &pin);
+        int live = p && h.vlen && springfield_copy_live(r, tmp, &k, off, &h, p);
+        if (!live && springfield_exists_i(tmp, &k)) {
+            /* deleted since the scan copied it */
+            springfield_append_i(tmp, &k, 0, NULL, 0);
+        }
+        springfield_unpin(r, &pin);
+        HASH_DEL(r->rewrite_keys, key);
+        free(key->key);
+        free(key);
+    }
+    r->rewrite_keys = NULL;
+    springfield_tail_swap(r, tmp);
+    springfield_index_free(&r->opts, r->offsets,
+        r->num_buckets * sizeof(uint64_t));
+    r->offsets = tmp->offsets;
+    r->num_buckets = tmp->num_buckets;
+    if (r->map)
+        munmap(r->map, r->mmap_alloc);
+    close(r->mapfd);
+    r->mapfd = tmp->mapfd;
+    r->map = tmp->map;
+    r->mmap_alloc = tmp->mmap_alloc;
+    r->eof = tmp->eof;
+    if (r->pool) {
+        /* keep r's (bigger) pool, reading from tmp's file */
+        springfield_pool_reset(r->pool);
+        close(r->pool->fd);
+        r->pool->fd = tmp->pool->fd;
+        tmp->pool->fd = -1;
+    }
+
+    if (r->bloom)
+        springfield_bloom_destroy(&r->opts, r->bloom);
+    if (r->bloom_next)
+        springfield_bloom_destroy(&r->opts, r->bloom_next);
+    r->bloom = tmp->bloom;
+    r->bloom_next = NULL;
+    r->bloom_full = r->bloom && r->bloom->count > r->bloom->capacity;
+
+    tmp->map = NULL;
+    tmp->mapfd = -1;
+    tmp->offsets = NULL;
+    tmp->bloom = NULL;
+
+    rename(path, r->path);
+    springfield_index_path(r->path, path, sizeof(path));
+    unlink(path);
+    if (r->tails)
+        springfield_tail_notify(r);
+
+    pthread_rwlock_unlock(&r->main_lock);
+
+    springfield_close(tmp);
+
+    pthread_mutex_unlock(&r->iter_lock);
+    springfield_op_end(r, SPRINGFIELD_OP_COMPACT, start);
+}
+
+void springfield_compact(springfield_t *r, uint32_t num_buckets) {
+    springfield_compact_i(r, num_buckets, 0);
+}
+
+typedef struct springfield_blob_move {
+    springfield_keyent_t *key;
+    uint32_t old_gen;
+    uint64_t old_off;
+    springfield_blob_ptr to;
+} springfield_blob_move;
+
+/* Copy live entries of `from` in [*off, end) into `to`, noting the
+   moves; stops after BLOB_GC_BATCH entries.  Caller holds main_lock. */
+static void springfield_blob_gc_scan(springfield_t *r, springfield_blobs_t *from,
+        uint64_t *off, uint64_t end, springfield_blobs_t *to,
+        springfield_blob_move **moves, uint64_t *num_moves, uint64_t *alloc_moves) {
+    int n;
+    for (n = 0; n < BLOB_GC_BATCH && *off < end; n++) {
+        springfield_blob_header *bh = (springfield_blob_header *)(from->map + *off);
+        uint64_t entry = *off;
+        springfield_key_t k;
+        springfield_key_init(&k, (char *)(from->map + entry + BLOB_HEADER_SIZE));
+        *off += BLOB_HEADER_SIZE + bh->klen + bh->vlen;
+
+        int seeks;
+        uint64_t roff = springfield_find_i(r, &k, &seeks);
+        if (roff == NO_BACKTRACE)
+            continue;
+        springfield_pin_t pin = PIN_INIT;
+        springfield_rec h;
+        uint8_t *p = springfield_rec_pin(r, roff, &h, 0, &pin);
+        springfield_unpin(r, &pin);
+        if (h.flags & FLAG_OPERAND) {
+            /* the blob may be the base operands apply to */
+            uint64_t nops;
+            free(springfield_operands(r, roff, &nops, &roff));
+            if (roff == NO_BACKTRACE)
+                continue;
+        }
+        p = springfield_rec_pin(r, roff, &h, 1, &pin);
+        springfield_blob_ptr ptr;
+        if (h.flags & FLAG_BLOB)
+            memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+        springfield_unpin(r, &pin);
+        if (!(h.flags & FLAG_BLOB))
+            continue;
+        if (ptr.gen != from->gen || ptr.off != entry)
+            continue;
+
+        if (*num_moves == *alloc_moves) {
+            *alloc_moves = *alloc_moves ? *alloc_moves * 2 : 1024;
+            *moves = realloc(*moves, *alloc_moves * sizeof(springfield_blob_move));
+        }
+        springfield_blob_move *m = &(*moves)[(*num_moves)++];
+        m->key = calloc(1, sizeof(springfield_keyent_t));
+        m->key->key = strdup(k.key);
+        m->key->hash = k.hash;
+        m->old_gen = from->gen;
+        m->old_off = entry;
+        m->to = springfield_blobs_append(to, &k,
+            from->map + entry + BLOB_HEADER_SIZE + bh->klen, bh->vlen, bh->crc);
+    }
+}
+
+void springfield_blob_gc(springfield_t *r) {
+    springfield_blob_move *moves = NULL;
+    uint64_t num_moves = 0, alloc_moves = 0, ends[BLOB_GENS], i;
+    uint32_t new_gen = 0;
+    int g;
+
+    springfield_iter_lock(r);
+
+    springfield_rdlock(r);
+    for (g = 0; g < BLOB_GENS; g++) {
+        ends[g] = r->blobs[g] ? r->blobs[g]->eof : 0;
+        if (r->blobs[g] && r->blobs[g]->gen >= new_gen)
+            new_gen = r->blobs[g]->gen + 1;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+    if (!new_gen) {
+        pthread_mutex_unlock(&r->iter_lock);
+        return;
+    }
+
+    /* Only this thread touches `to` until it's installed */
+    springfield_blobs_t *to = springfield_blobs_open(r, new_gen, 0, 1);
+
+    /* Bulk of the copying in batches under the read lock... */
+    for (g = 0; g < BLOB_GENS; g++) {
+        uint64_t off = BLOB_FILE_HEADER;
+        while (ends[g] && off < ends[g]) {
+            springfield_rdlock(r);
+            springfield_blob_gc_scan(r, r->blobs[g], &off, ends[g], to,
+                &moves, &num_moves, &alloc_moves);
+            pthread_rwlock_unlock(&r->main_lock);
+        }
+    }
+
+    /* ...then what writers appended meanwhile, and the switch
+       over, under the write lock */
+    springfield_wrlock(r);
+    for (g = 0; g < BLOB_GENS; g++) {
+        uint64_t off = ends[g] ? ends[g] : BLOB_FILE_HEADER;
+        while (r->blobs[g] && off < r->blobs[g]->eof)
+            springfield_blob_gc_scan(r, r->blobs[g], &off, r->blobs[g]->eof,
+                to, &moves, &num_moves, &alloc_moves);
+    }
+    for (i = 0; i < num_moves; i++) {
+        springfield_blob_move *m = &moves[i];
+        springfield_key_t k;
+        int seeks;
+        springfield_key_init_hashed(&k, m->key->key, m->key->hash);
+        uint64_t roff = springfield_find_i(r, &k, &seeks), nops = 0;
+        uint64_t *ops = NULL;
+        springfield_pin_t pin = PIN_INIT;
+        springfield_rec h;
+        uint8_t *p = springfield_rec_pin(r, roff, &h, 0, &pin);
+        springfield_unpin(r, &pin);
+        if (h.flags & FLAG_OPERAND)
+            ops = springfield_operands(r, roff, &nops, &roff);
+        springfield_blob_ptr ptr = {0, 0, 0};
+        if (roff != NO_BACKTRACE) {
+            p = springfield_rec_pin(r, roff, &h, 1, &pin);
+            if (h.flags & FLAG_BLOB)
+                memcpy(&ptr, p + h.hlen + h.klen, sizeof(ptr));
+            springfield_unpin(r, &pin);
+        }
+        /* writers may have superseded it since it was copied */
+        if (ptr.gen == m->old_gen && ptr.off == m->old_off) {
+            springfield_append_i(r, &k, FLAG_BLOB, (uint8_t *)&m->to,
+                sizeof(m->to));
+            /* and the operands on top of it again, oldest first */
+            while (nops--) {
+                p = springfield_rec_pin(r, ops[nops], &h, 1, &pin);
+                uint8_t *operand = malloc(h.vlen ? h.vlen : 1);
+                memcpy(operand, p + h.hlen + h.klen, h.vlen);
+                springfield_unpin(r, &pin);
+                springfield_append_i(r, &k, h.flags, operand, h.vlen);
+                free(operand);
+            }
+        }
+        free(ops);
+        free(m->key->key);
+        free(m->key);
+    }
+    free(moves);
+
+    /* New pointers durable before the old files go */
+    msync(to->map, to->alloc, MS_SYNC);
+    if (r->pool)
+        fdatasync(r->mapfd);
+    else
+        msync(r->map, r->mmap_alloc, MS_SYNC);
+    for (g = 0; g < BLOB_GENS; g++) {
+        if (r->blobs[g]) {
+            char path[1200];
+            springfield_blob_path(r, r->blobs[g]->gen, path, sizeof(path));
+            springfield_blobs_close(r->blobs[g]);
+            r->blobs[g] = NULL;
+            unlink(path);
+        }
+    }
+    r->blobs[new_gen % BLOB_GENS] = to;
+    r->blob_gen = new_gen;
+    r->blob_gcs++;
+
+    pthread_rwlock_unlock(&r->main_lock);
+    pthread_mutex_unlock(&r->iter_lock);
+}
+
+/* -- autopilot --
+
+   With options.autopilot, a thread looks at the db every
+   autopilot_interval seconds.  It walks a sample of buckets (the
+   next AUTOPILOT_SAMPLE after where the last look stopped) to
+   estimate the live keys per bucket and the bytes they take up,
+   and compacts when:
+
+   - live keys per bucket pass autopilot_chain_length, or fall
+     under an eighth of it; the new bucket count puts them at
+     half of it, so a growing keyspace can double before the
+     next resize
+   - more than autopilot_garbage_ratio of the data file (of at
+     least AUTOPILOT_MIN_BYTES) is garbage.  A key's operands
+     count as live, and no more than what was appended since the
+     last compaction (compacted_eof) counts as garbage, so the
+     pad records clustering leaves don't
+   - the data and blob files pass autopilot_disk_bytes and at
+     least AUTOPILOT_CEILING_GARBAGE of the data file is garbage;
+     blob files are collected then too, unless they haven't grown
+     by a tenth since last time
+
+   Only the ceiling may act outside the hour window.  The gaps
+   between thresholds are the hysteresis: a compaction leaves the
+   db well inside all of them.  Autopilots in one process take
+   turns, so shards sharing options don't all compact at once. */
+
+#define AUTOPILOT_SAMPLE 1024
+#define AUTOPILOT_MIN_BUCKETS 1024
+#define AUTOPILOT_MIN_BYTES (1024 * 1024)
+#define AUTOPILOT_CEILING_GARBAGE 0.1
+
+static pthread_mutex_t autopilot_turn = PTHREAD_MUTEX_INITIALIZER;
+
+/* Walk up to AUTOPILOT_SAMPLE buckets from `*next` on, adding up
+   the live keys (the newest record of each, unless a tombstone)
+   and the bytes of their records (that one, plus any operands
+   and base below it).  Returns how many buckets it walked, of
+   `*num_buckets`. */
+static uint32_t springfield_autopilot_sample(springfield_t *r, uint32_t *next,
+        uint32_t *num_buckets, uint64_t *live, uint64_t *live_bytes) {
+    uint32_t n;
+
+    for (n = 0; n < AUTOPILOT_SAMPLE && !r->closing; n++) {
+        springfield_keyent_t *seen = NULL, *key, *ktmp;
+        springfield_rdlock(r);
+        if (n && *num_buckets != r->num_buckets) {
+            /* compacted under us */
+            pthread_rwlock_unlock(&r->main_lock);
+            return 0;
+        }
+        *num_buckets = r->num_buckets;
+        if (n == *num_buckets) {
+            pthread_rwlock_unlock(&r->main_lock);
+            break;
+        }
+        uint64_t off = r->offsets[(*next)++ % *num_buckets];
+        while (off != NO_BACKTRACE) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_rec h;
+            uint8_t *p = springfield_rec_pin(r, off, &h, 0, &pin);
+            char *keyptr = (char *)p + h.hlen;
+            HASH_FIND(hh, seen, keyptr, h.klen - 1, key);
+            if (!key) {
+                key = calloc(1, sizeof(springfield_keyent_t));
+                key->key = r->pool ? strdup(keyptr) : keyptr;
+                HASH_ADD_KEYPTR(hh, seen, key->key, h.klen - 1, key);
+                if (h.vlen) {
+                    ++*live;
+                    *live_bytes += (uint64_t)h.hlen + h.klen + h.vlen;
+                    /* hash marks a key whose value is still being folded */
+                    key->hash = !!(h.flags & FLAG_OPERAND);
+                }
+            } else if (key->hash) {
+                *live_bytes += (uint64_t)h.hlen + h.klen + h.vlen;
+                key->hash = !!(h.flags & FLAG_OPERAND);
+            }
+            springfield_unpin(r, &pin);
+            off = h.last;
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+        HASH_ITER(hh, seen, key, ktmp) {
+            HASH_DEL(seen, key);
+            if (r->pool)
+                free(key->key);
+            free(key);
+        }
+    }
+    return n;
+}
+
+static int springfield_autopilot_window(springfield_options_t *o) {
+    if (o->autopilot_hour_start == o->autopilot_hour_end)
+        return 1;
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    if (o->autopilot_hour_start < o->autopilot_hour_end)
+        return tm.tm_hour >= o->autopilot_hour_start &&
+            tm.tm_hour < o->autopilot_hour_end;
+    return tm.tm_hour >= o->autopilot_hour_start ||
+        tm.tm_hour < o->autopilot_hour_end;
+}
+
+typedef struct springfield_autopilot_t {
+    uint32_t next;
+    uint64_t blob_bytes_gced; /* blob bytes left by the last gc */
+} springfield_autopilot_t;
+
+static void springfield_autopilot_check(springfield_t *r,
+        springfield_autopilot_t *ap) {
+    springfield_options_t *o = &r->opts;
+    double target = o->autopilot_chain_length ? o->autopilot_chain_length : 2;
+    double max_garbage = o->autopilot_garbage_ratio ?
+        o->autopilot_garbage_ratio : 0.5;
+    uint64_t live = 0, live_bytes = 0, eof, compacted, blob_bytes = 0;
+    uint32_t num_buckets = 0, sampled;
+    int i;
+
+    sampled = springfield_autopilot_sample(r, &ap->next, &num_buckets,
+        &live, &live_bytes);
+    pthread_rwlock_rdlock(&r->main_lock);
+    if (r->compact_running || num_buckets != r->num_buckets)
+        sampled = 0;
+    eof = r->eof;
+    compacted = r->compacted_eof;
+    for (i = 0; i < BLOB_GENS; i++) {
+        if (r->blobs[i])
+            blob_bytes += r->blobs[i]->eof;
+    }
+    pthread_rwlock_unlock(&r->main_lock);
+    if (!sampled || r->closing)
+        return;
+
+    double scale = (double)num_buckets / sampled;
+    double per_bucket = (double)live / sampled;
+    double garbage = 1 - live_bytes * scale / eof;
+    if (compacted && garbage > (double)(eof - compacted) / eof)
+        garbage = (double)(eof - compacted) / eof;
+    uint32_t buckets = num_buckets;
+    if (per_bucket > target ||
+            (per_bucket < target / 8 && num_buckets > AUTOPILOT_MIN_BUCKETS)) {
+        double want = live * scale / (target / 2);
+        if (want < AUTOPILOT_MIN_BUCKETS)
+            want = AUTOPILOT_MIN_BUCKETS;
+        if (want > UINT32_MAX)
+            want = UINT32_MAX;
+        buckets = (uint32_t)want;
+    }
+
+    int over = o->autopilot_disk_bytes &&
+        eof + blob_bytes > o->autopilot_disk_bytes;
+    int compact = over && garbage >= AUTOPILOT_CEILING_GARBAGE;
+    int gc = over && blob_bytes > ap->blob_bytes_gced * 1.1;
+    if (!compact && springfield_autopilot_window(o))
+        compact = buckets != num_buckets ||
+            (garbage > max_garbage && eof >= AUTOPILOT_MIN_BYTES);
+    if ((!compact && !gc) || pthread_mutex_trylock(&autopilot_turn))
+        return;
+
+    if (compact)
+        springfield_compact_i(r, buckets, o->autopilot_bytes_per_sec);
+    if (gc) {
+        springfield_blob_gc(r);
+        ap->blob_bytes_gced = 0;
+        pthread_rwlock_rdlock(&r->main_lock);
+        for (i = 0; i < BLOB_GENS; i++) {
+            if (r->blobs[i])
+                ap->blob_bytes_gced += r->blobs[i]->eof;
+        }
+        pthread_rwlock_unlock(&r->main_lock);
+    }
+    pthread_mutex_unlock(&autopilot_turn);
+}
+
+static void * springfield_autopilot_thread(void *arg) {
+    springfield_t *r = (springfield_t *)arg;
+    springfield_autopilot_t ap = {0, 0};
+    uint64_t interval = (uint64_t)(r->opts.autopilot_interval ?
+        r->opts.autopilot_interval : 60) * 1000000000ULL;
+
+    while (!r->closing) {
+        springfield_sleep_until(r, springfield_now_ns() + interval);
+        if (!r->closing)
+            springfield_autopilot_check(r, &ap);
+    }
+    return NULL;
+}
+
+void springfield_close(springfield_t *r) {
+    r->closing = 1;
+    if (r->autopilot_running)
+        pthread_join(r->autopilot_thread, NULL);
+    springfield_wbuf_stop(r);
+    if (r->warmup_running) {
+        pthread_join(r->warmup_thread, NULL);
+        r->warmup_running = 0;
+    }
+    if (r->scrub_running)
+        pthread_join(r->scrub_thread, NULL);
+    if (r->opts.trusted_open && r->stats)
+        springfield_index_save(r);
+    if (r->map)
+        munmap(r->map, r->mmap_alloc);
+    if (r->mapfd > -1)
+        close(r->mapfd);
+    if (r->pool)
+        springfield_pool_destroy(r->pool);
+    free(r->scratch);
+
+    if (r->cache)
+        springfield_cache_destroy(r->cache);
+    if (r->bloom)
+        springfield_bloom_destroy(&r->opts, r->bloom);
+    if (r->bloom_next)
+        springfield_bloom_destroy(&r->opts, r->bloom_next);
+    int i;
+    for (i = 0; i < BLOB_GENS; i++) {
+        if (r->blobs[i])
+            springfield_blobs_close(r->blobs[i]);
+    }
+    free(r->stats);
+    free(r->path);
+    springfield_index_free(&r->opts, r->offsets,
+        r->num_buckets * sizeof(uint64_t));
+    free(r);
+}
 
-        s = madvise(r->map, r->mmap_alloc, MADV_SEQUENTIAL);
-        assert(!s);
+/* -- change stream --
 
-        uint8_t *p = r->map;
+   The file is already an ordered log of CRC-checked records, so
+   a tail is only a position in it: next copies out the record
+   there under the read lock.  Pad records are skipped, and blob
+   records go out as plain ones carrying the value, since the
+   pointer means nothing to another db.
 
-        r->num_buckets = *(uint32_t *)p;
-        r->offsets = malloc(r->num_buckets * sizeof(uint64_t));
-        memset(r->offsets, 0xff, r->num_buckets * sizeof(uint64_t));
+   Positions are offsets plus r->tail_base, which a compaction
+   moves past the old file's end, so they keep growing.  Every
+   compacted file starts with a pad record holding the new base
+   and the offset the stream goes on from (the end of the copy),
+   so positions survive a reopen too.  At the swap, the records
+   a tail hasn't read yet are copied out of the old file onto its
+   backlog, which it reads before going on in the new one; only a
+   tail more than TAIL_BACKLOG_MAX behind gets
+   SPRINGFIELD_TAIL_RESET.
+   A position handed to springfield_tail_create() may be from
+   before a crash, so the record there is decoded and CRC checked
+   before anything is trusted.
 
-        uint64_t off = 4;
-        p += 4;
+   Appends only signal a tail's eventfd once it has come up empty
+   (`armed`), so streaming costs writers a pointer test while the
+   tail keeps up.  The list of tails and `armed` are guarded by
+   main_lock. */
 
-        while (1) {
-            if (off + 8 > r->eof) {
-                r->eof = off;
-                break;
-            }
-            springfield_header_v1 *h = (springfield_header_v1 *)p;
-            if (h->version == 0) {
-                r->eof = off;
-                break;
-            }
-            assert(h->version == 1);
-            if (off + HEADER_SIZE > r->eof) {
-                r->eof = off;
-                break;
-            }
-            if (h->klen == 0) {
-                r->eof = off;
-                break;
-            }
-            assert(h->vlen <= MAX_VLEN);
-            uint32_t jump = h->vlen + h->klen + HEADER_SIZE;
-            if (off + jump > r->eof) {
-                r->eof = off;
-                break;
-            }
+#define TAIL_BACKLOG_MAX (64 * 1024 * 1024)
 
-            /* Check CRC32 */
-            if (crc32(0, p + 4, HEADER_SIZE_MINUS_CRC + h->klen + h->vlen) != h->crc) {
-                r->eof = off;
-                break;
-            }
+/* Records a tail hadn't read from a file a compaction replaced */
+typedef struct springfield_backlog_t {
+    uint8_t *data;
+    uint64_t len;
+    uint64_t read;
+    uint64_t pos;   /* position of data[0] */
+    struct springfield_backlog_t *next;
+} springfield_backlog_t;
 
-            char *key = (char *)(p + HEADER_SIZE);
+struct springfield_tail_t {
+    springfield_t *r;
+    uint64_t off;
+    int checked;        /* off is known to start a record */
+    int reset;          /* report SPRINGFIELD_TAIL_RESET next */
+    int armed;
+    int efd;
+    uint8_t *buf;
+    uint64_t alloc;
+    springfield_backlog_t *backlog; /* oldest first */
+    uint64_t backlog_bytes;
+    springfield_tail_t *next;
+};
 
-            uint64_t prev = springfield_index_keyval(r, key, off);
-            assert(prev == h->last);
+static void springfield_backlog_free(springfield_tail_t *t) {
+    while (t->backlog) {
+        springfield_backlog_t *b = t->backlog;
+        t->backlog = b->next;
+        free(b->data);
+        free(b);
+    }
+    t->backlog_bytes = 0;
+}
 
-            off += jump;
-            p += jump;
-        }
+/* Encode the base record: a pad with a 1 byte key whose value is
+   the stream position of offset 0 and the offset to resume from */
+static uint32_t springfield_tail_base_rec(uint8_t *p, uint64_t base,
+        uint64_t resume) {
+    uint32_t vlen = 2 * sizeof(uint64_t);
+    uint32_t hlen = springfield_rec_hlen(1, vlen);
+    springfield_rec_encode(p, FLAG_PAD, 1, vlen, NO_BACKTRACE);
+    p[hlen] = 0;
+    memcpy(p + hlen + 1, &base, sizeof(base));
+    memcpy(p + hlen + 1 + sizeof(base), &resume, sizeof(resume));
+    *(uint32_t *)p = crc32(0, p + 4, hlen + 1 + vlen - 4);
+    return hlen + 1 + vlen;
+}
 
-        munmap(r->map, r->mmap_alloc);
-    }
+/* Load's look at the first record: if it's a base record, adopt it */
+static void springfield_tail_base_parse(springfield_t *r, uint8_t *p,
+        uint64_t avail) {
+    springfield_rec h;
+    uint64_t v[2];
+    if (!springfield_rec_decode(p, 4, avail, &h) || !(h.flags & FLAG_PAD) ||
+            h.klen != 1 || h.vlen != sizeof(v) ||
+            h.hlen + 1 + sizeof(v) > avail ||
+            crc32(0, p + 4, h.hlen + 1 + sizeof(v) - 4) != *(uint32_t *)p)
+        return;
+    memcpy(v, p + h.hlen + 1, sizeof(v));
+    r->tail_base = v[0];
+    r->compacted_eof = v[1];
+}
 
-    r->mmap_alloc = r->eof + MMAP_OVERFLOW;
-    s = ftruncate(r->mapfd, (off_t)r->mmap_alloc);
-    assert(!s);
+/* Hold the start of a compaction's new file for the base record,
+   filled in by springfield_tail_swap() */
+static void springfield_tail_reserve(springfield_t *tmp) {
+    assert(tmp->eof == 4);
+    uint8_t *p = springfield_append_begin(tmp, TAIL_BASE_MAX);
+    uint32_t len = springfield_tail_base_rec(p, 0, 0);
+    springfield_append_end(tmp, p, len);
+    tmp->eof += len;
+}
 
-    r->map = (uint8_t *)mmap(
-        NULL, r->mmap_alloc, PROT_READ | PROT_WRITE, MAP_SHARED, r->mapfd, 0);
-    s = madvise(r->map, r->mmap_alloc, MADV_RANDOM);
-    assert(!s);
+springfield_tail_t * springfield_tail_create(springfield_t *r, uint64_t from) {
+    springfield_tail_t *t = calloc(1, sizeof(springfield_tail_t));
+    t->r = r;
+    t->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(t->efd > -1);
 
-    uint32_t buckets_on_record = *(uint32_t *)r->map;
-    if (buckets_on_record) {
-        assert(buckets_on_record == r->num_buckets);
+    springfield_wrlock(r);
+    t->checked = 1;
+    if (from == SPRINGFIELD_TAIL_END) {
+        t->off = r->eof;
+    } else if (from == SPRINGFIELD_TAIL_START) {
+        t->off = 4;
+    } else if (from == r->tail_base) {
+        t->off = r->compacted_eof;
+    } else if (from < r->tail_base) {
+        t->reset = 1; /* from before the last compaction */
     } else {
-        *(uint32_t *)r->map = r->num_buckets;
-        assert(r->eof == 0);
-        r->eof = 4;
+        t->off = from - r->tail_base < 4 ? 4 : from - r->tail_base;
+        t->checked = t->off == 4 || t->off == r->eof;
     }
-
-    assert(r->map);
+    t->next = r->tails;
+    r->tails = t;
+    pthread_rwlock_unlock(&r->main_lock);
+    return t;
 }
 
-springfield_t * springfield_create(char *path, uint32_t num_buckets) {
-    assert(sizeof(void *) == 8); // Springfield needs 64-bit system
-    springfield_t *r = calloc(1, sizeof(springfield_t));
-    r->num_buckets = num_buckets;
-    r->path = malloc(strlen(path) + 1);
-    strcpy(r->path, path);
-    r->mmap_alloc = 0;
+int springfield_tail_fd(springfield_tail_t *t) {
+    return t->efd;
+}
 
-    pthread_rwlockattr_t attr;
-    pthread_rwlockattr_init(&attr);
-    int res = pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
-    assert(!res);
-    pthread_rwlock_init(&r->main_lock, &attr);
-    pthread_mutex_init(&r->iter_lock, NULL);
+void springfield_tail_destroy(springfield_tail_t *t) {
+    springfield_t *r = t->r;
+    springfield_tail_t **p;
+    springfield_wrlock(r);
+    for (p = &r->tails; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    pthread_rwlock_unlock(&r->main_lock);
+    close(t->efd);
+    free(t->buf);
+    springfield_backlog_free(t);
+    free(t);
+}
 
-    springfield_load(r);
+/* Whether a whole, intact record starts at t->off */
+static int springfield_tail_check(springfield_tail_t *t) {
+    springfield_t *r = t->r;
+    springfield_pin_t pin = PIN_INIT;
+    springfield_rec h;
+    uint8_t hdr[HEADER_MAX_SIZE];
+    uint64_t avail = r->eof - t->off;
+    uint64_t n = avail < HEADER_MAX_SIZE ? avail : HEADER_MAX_SIZE;
 
-    return r;
+    memcpy(hdr, springfield_bytes(r, t->off, n, &pin), n);
+    springfield_unpin(r, &pin);
+    if (!springfield_rec_decode(hdr, t->off, avail, &h))
+        return 0;
+    uint64_t jump = (uint64_t)h.hlen + h.klen + h.vlen;
+    if (jump > avail)
+        return 0;
+    uint8_t *p = springfield_bytes(r, t->off, jump, &pin);
+    int ok = crc32(0, p + 4, jump - 4) == *(uint32_t *)p;
+    springfield_unpin(r, &pin);
+    return ok;
 }
 
-static uint8_t * springfield_get_i(springfield_t *r, char *key, uint32_t *len) {
-    uint64_t off = springfield_index_lookup(r, key);
+/* A compaction is about to replace r's file with tmp's: give each
+   tail what it hasn't read of the old one, and move it to the end
+   of the new one.  Caller holds main_lock for write. */
+static void springfield_tail_swap(springfield_t *r, springfield_t *tmp) {
+    uint8_t rec[TAIL_BASE_MAX];
+    uint64_t base = r->tail_base + r->eof;
+    uint32_t len = springfield_tail_base_rec(rec, base, tmp->eof);
+    ssize_t n;
+    while ((n = pwrite(tmp->mapfd, rec, len, 4)) < 0 && errno == EINTR)
+        ;
+    assert(n == len);
+    if (tmp->pool)
+        springfield_pool_wrote(tmp->pool, 4, rec, len);
 
-    int seeks = 0;
-    while (off != NO_BACKTRACE) {
-        ++seeks;
-        uint8_t *p = &r->map[off];
-        springfield_header_v1 *h = (springfield_header_v1 *)p;
-        if (!strncmp((char *)(p + HEADER_SIZE), key, h->klen)) {
-            int seek_ind = __sync_fetch_and_add(&r->seek_pos, 1);
-            uint32_t *addr = &(r->seeks[seek_ind % 100]);
-            int ok;
-            do {
-                ok = __sync_bool_compare_and_swap(
-                    addr, *addr, seeks);
-            } while (!ok);
-
-            if (h->vlen == 0) {
-                return NULL;
-            }
-            uint8_t *res = malloc(h->vlen);
-            *len = h->vlen;
-            memmove(res, p + HEADER_SIZE + h->klen, h->vlen);
-            return res;
+    springfield_tail_t *t;
+    for (t = r->tails; t; t = t->next) {
+        uint64_t behind = r->eof - t->off;
+        if (t->reset || t->off > r->eof ||
+                t->backlog_bytes + behind > TAIL_BACKLOG_MAX ||
+                (!t->checked && behind && !springfield_tail_check(t))) {
+            t->reset = 1;
+            continue;
+        }
+        if (behind) {
+            springfield_pin_t pin = PIN_INIT;
+            springfield_backlog_t *b = malloc(sizeof(springfield_backlog_t)), **p;
+            b->data = malloc(behind);
+            memcpy(b->data, springfield_bytes(r, t->off, behind, &pin), behind);
+            springfield_unpin(r, &pin);
+            b->len = behind;
+            b->read = 0;
+            b->pos = r->tail_base + t->off;
+            b->next = NULL;
+            for (p = &t->backlog; *p; p = &(*p)->next)
+                ;
+            *p = b;
+            t->backlog_bytes += behind;
         }
-        off = h->last;
+        t->off = tmp->eof;
+        t->checked = 1;
     }
-
-    return NULL;
+    r->tail_base = base;
+    r->compacted_eof = tmp->eof;
 }
 
-uint8_t * springfield_get(springfield_t *r, char *key, uint32_t *len) {
-    pthread_rwlock_rdlock(&r->main_lock);
-    uint8_t *res = springfield_get_i(r, key, len);
-    pthread_rwlock_unlock(&r->main_lock);
-    return res;
+/* Caller holds main_lock for write */
+static void springfield_tail_notify(springfield_t *r) {
+    springfield_tail_t *t;
+    uint64_t one = 1;
+    for (t = r->tails; t; t = t->next) {
+        if (t->armed) {
+            t->armed = 0;
+            ssize_t w = write(t->efd, &one, sizeof(one));
+            assert(w == sizeof(one));
+        }
+    }
 }
 
-double springfield_seek_average(springfield_t *r) {
-    double tot = 0;
-    int i;
-    for(i=0; i < 100; i++) {
-        tot += r->seeks[i];
+static uint8_t * springfield_tail_buf(springfield_tail_t *t, uint64_t len) {
+    if (len > t->alloc) {
+        t->alloc = len * 2;
+        t->buf = realloc(t->buf, t->alloc);
     }
-    return tot / 100.0;
+    return t->buf;
 }
 
-void springfield_sync(springfield_t *r) {
-    pthread_rwlock_rdlock(&r->main_lock);
-    int s = msync(r->map, r->mmap_alloc, MS_SYNC);
-    pthread_rwlock_unlock(&r->main_lock);
-    assert(!s);
-}
+/* Caller holds main_lock for read */
+static int springfield_tail_read(springfield_tail_t *t, springfield_change_t *c) {
+    springfield_t *r = t->r;
+    springfield_pin_t pin = PIN_INIT;
+    springfield_rec h;
 
-static void springfield_set_i(springfield_t *r, char *key, uint8_t *val, uint32_t vlen) {
-    int klen = strlen(key) + 1;
-    assert(klen < MAX_KLEN);
-    assert(vlen < MAX_VLEN);
+    if (t->reset || t->off > r->eof ||
+            (!t->checked && t->off < r->eof && !springfield_tail_check(t))) {
+        t->reset = 0;
+        t->off = 4;
+        t->checked = 1;
+        springfield_backlog_free(t);
+        return SPRINGFIELD_TAIL_RESET;
+    }
+    t->checked = 1;
 
-    uint32_t step = HEADER_SIZE + klen + vlen;
-    springfield_header_v1 h = {0};
-    h.klen = klen;
-    h.vlen = vlen;
-    h.version = 1;
+    while (t->backlog || t->off < r->eof) {
+        uint64_t pos, jump;
+        uint8_t *p;
+        springfield_backlog_t *b = t->backlog;
+        if (b && b->read == b->len) {
+            t->backlog = b->next;
+            t->backlog_bytes -= b->len;
+            free(b->data);
+            free(b);
+            continue;
+        }
+        if (b) {
+            p = b->data + b->read;
+            springfield_rec_decode(p, NO_BACKTRACE, b->len - b->read, &h);
+            pos = b->pos + b->read;
+            jump = (uint64_t)h.hlen + h.klen + h.vlen;
+            b->read += jump;
+        } else {
+            pos = r->tail_base + t->off;
+            p = springfield_rec_pin(r, t->off, &h, 1, &pin);
+            jump = (uint64_t)h.hlen + h.klen + h.vlen;
+            t->off += jump;
+        }
+        if (h.flags & FLAG_PAD) {
+            springfield_unpin(r, &pin);
+            continue;
+        }
 
-    if (r->in_rewrite) {
-        springfield_key_t *kobj = NULL;
-        HASH_FIND(hh, r->rewrite_keys, key, klen, kobj);
-        if (!kobj) {
-            kobj = calloc(1, sizeof(springfield_key_t));
-            kobj->key = strdup(key);
-            HASH_ADD_KEYPTR(hh, r->rewrite_keys, key, klen, kobj);
+        uint8_t *val = p + h.hlen + h.klen, *buf;
+        uint32_t hlen = h.hlen, vlen = h.vlen;
+        if (h.flags & FLAG_BLOB) {
+            springfield_blob_ptr ptr;
+            memcpy(&ptr, val, sizeof(ptr));
+            val = springfield_blob_value(r, val);
+            if (!val) {
+                /* superseded, and its blob collected since */
+                springfield_unpin(r, &pin);
+                continue;
+            }
+            vlen = ptr.vlen;
+            hlen = springfield_rec_hlen(h.klen, vlen);
+            buf = springfield_tail_buf(t, (uint64_t)hlen + h.klen + vlen);
+            springfield_rec_encode(buf, h.flags & ~FLAG_BLOB, h.klen, vlen,
+                NO_BACKTRACE);
+            memcpy(buf + hlen, p + h.hlen, h.klen);
+            memcpy(buf + hlen + h.klen, val, vlen);
+            *(uint32_t *)buf = crc32(0, buf + 4, hlen + h.klen + vlen - 4);
+        } else {
+            buf = springfield_tail_buf(t, jump);
+            memcpy(buf, p, jump);
+        }
+        springfield_unpin(r, &pin);
+
+        if (h.flags & FLAG_MERGE)
+            c->kind = SPRINGFIELD_CHANGE_MERGE;
+        else if (h.flags & FLAG_APPEND)
+            c->kind = SPRINGFIELD_CHANGE_APPEND;
+        else
+            c->kind = vlen ? SPRINGFIELD_CHANGE_SET : SPRINGFIELD_CHANGE_DEL;
+        c->pos = pos;
+        if (b && b->read == b->len)
+            b = b->next;
+        c->next = b ? b->pos + b->read : r->tail_base + t->off;
+        c->key = (char *)buf + hlen;
+        c->val = vlen ? buf + hlen + h.klen : NULL;
+        c->vlen = vlen;
+        c->rec = buf;
+        c->rec_len = hlen + h.klen + vlen;
+        return 1;
+    }
+    t->armed = 1;
+    return 0;
+}
+
+int springfield_tail_next(springfield_tail_t *t, springfield_change_t *c) {
+    springfield_rdlock(t->r);
+    int got = springfield_tail_read(t, c);
+    pthread_rwlock_unlock(&t->r->main_lock);
+    return got;
+}
+
+int springfield_tail_poll(springfield_tail_t *t, springfield_tail_cb cb,
+        void *passthrough, int wait) {
+    springfield_change_t c;
+    uint64_t drain;
+    int ran = 0, got;
+    while (1) {
+        if (read(t->efd, &drain, sizeof(drain)) < 0)
+            assert(errno == EAGAIN);
+        while ((got = springfield_tail_next(t, &c)) == 1) {
+            cb(t, &c, passthrough);
+            ran++;
         }
+        if (got == SPRINGFIELD_TAIL_RESET)
+            return got;
+        if (ran || !wait)
+            return ran;
+        struct pollfd pfd = {t->efd, POLLIN, 0};
+        while (poll(&pfd, 1, -1) < 0)
+            assert(errno == EINTR);
     }
+}
 
-    if (r->eof + step > r->mmap_alloc) {
-        msync(r->map, r->mmap_alloc, MS_SYNC);
-        int s = munmap(r->map, r->mmap_alloc);
-        assert(!s);
-        uint64_t new_size = r->mmap_alloc + ((r->eof + step) * 2);
-        r->mmap_alloc = new_size;
-        s = ftruncate(r->mapfd, (off_t)r->mmap_alloc);
-        assert(!s);
-        r->map = (uint8_t *)mmap(
-            NULL, r->mmap_alloc, PROT_READ | PROT_WRITE, MAP_SHARED, r->mapfd, 0);
-        /* TODO mremap() on linux */
-        s = madvise(r->map, r->mmap_alloc, MADV_RANDOM);
-        assert(!s);
+int springfield_apply_record(springfield_t *r, uint8_t *rec, uint32_t len) {
+    springfield_rec h;
+    if (!springfield_rec_decode(rec, NO_BACKTRACE, len, &h) ||
+            (uint64_t)h.hlen + h.klen + h.vlen != len ||
+            (h.flags & FLAG_BLOB) ||
+            memchr(rec + h.hlen, 0, h.klen) != rec + h.hlen + h.klen - 1 ||
+            crc32(0, rec + 4, len - 4) != *(uint32_t *)rec)
+        return 0;
+    if (h.flags & FLAG_PAD)
+        return 1;
+
+    springfield_key_t k;
+    springfield_key_init(&k, (char *)rec + h.hlen);
+    uint8_t *val = rec + h.hlen + h.klen;
+    uint32_t flag = h.flags & FLAG_OPERAND;
+    /* The CRC is linear: take the header's share out of it and
+       what's left is the key and value's, for append_crc() */
+    uint32_t kvcrc = *(uint32_t *)rec ^
+        crc32_combine(crc32(0, rec + 4, h.hlen - 4), 0, h.klen + h.vlen);
+
+    uint64_t start = springfield_op_start(r);
+    if (r->opts.write_buffer_bytes && flag == FLAG_APPEND) {
+        springfield_append_t a = {val, h.vlen, NULL};
+        springfield_push_operand(r, &k, flag, val, h.vlen,
+            springfield_append_fn, &a);
+        free(a.res);
+    } else if (r->opts.write_buffer_bytes && flag) {
+        assert(r->opts.merge);
+        springfield_merge_t m = {r, val, h.vlen, NULL};
+        springfield_push_operand(r, &k, flag, val, h.vlen,
+            springfield_merge_fn_i, &m);
+        free(m.res);
+    } else if (r->opts.write_buffer_bytes) {
+        springfield_wbuf_put(r, &k, val, h.vlen);
+    } else {
+        springfield_wrlock(r);
+        if (!flag && springfield_is_blob(r, h.vlen))
+            springfield_set_i(r, &k, val, h.vlen, NULL);
+        else
+            springfield_append_crc(r, &k, flag, val, h.vlen, &kvcrc);
+        pthread_rwlock_unlock(&r->main_lock);
+        springfield_bloom_maintain(r);
     }
 
-    h.last = springfield_index_keyval(r, key, r->eof);
-    uint8_t *p = &r->map[r->eof];
+    if (flag)
+        STAT_BUMP(r, rmws, 1);
+    else if (h.vlen)
+        STAT_BUMP(r, sets, 1);
+    else
+        STAT_BUMP(r, dels, 1);
+    springfield_op_end(r, !flag && !h.vlen ? SPRINGFIELD_OP_DEL :
+        SPRINGFIELD_OP_SET, start);
+    return 1;
+}
 
-    springfield_header_v1 *ph = (springfield_header_v1 *)p;
+/* -- sharding --
 
-    *ph = h;
+   A sharded handle is just N ordinary databases and a routing
+   rule, so each shard keeps its own file, locks, index, write
+   buffer and compaction: a writer only contends with writers on
+   the same shard, and compacting one shard stalls nobody else.
 
-    memmove(p + HEADER_SIZE, key, klen);
-    if (vlen)
-        memmove(p + HEADER_SIZE + klen, val, vlen);
+   Routing depends on the shard count and each shard's place in
+   the list, so every shard has a `<path>.shard` file next to it
+   naming both.  Opening a shard at another place, or in a set of
+   another size, would hide or duplicate keys, so it's refused. */
 
-    ph->crc = crc32(0, p + 4, HEADER_SIZE_MINUS_CRC + klen + vlen);
+struct springfield_sharded_t {
+    int count;
+    springfield_t **shards;
+};
 
-    r->eof += step;
+/* Shards pick buckets with hash % num_buckets, which reads the
+   low bits; route on the high bits of a remix so the two choices
+   stay independent */
+static inline int springfield_shard_index(springfield_sharded_t *s,
+        springfield_key_t *k) {
+    uint32_t mixed = k->hash * 0x9e3779b1u;
+    return ((uint64_t)mixed * s->count) >> 32;
 }
-void springfield_set(springfield_t *r, char *key, uint8_t *val, uint32_t vlen) {
-    pthread_rwlock_wrlock(&r->main_lock);
-    springfield_set_i(r, key, val, vlen);
-    pthread_rwlock_unlock(&r->main_lock);
+
+static inline springfield_t * springfield_shard_for(springfield_sharded_t *s,
+        springfield_key_t *k) {
+    return s->shards[springfield_shard_index(s, k)];
 }
 
-void springfield_del(springfield_t *r, char *key) {
-    springfield_set(r, key, NULL, 0);
+#define SHARD_MANIFEST "springfield shard %d of %d\n"
+
+/* 1 if the shard at `path` is shard `i` of `count`, 0 if it has
+   no manifest yet (is new, or predates them), else -1 with errno
+   set (EINVAL: it's another shard) */
+static int springfield_shard_check(char *path, int i, int count) {
+    char buf[1200];
+    int at, of;
+    snprintf(buf, sizeof(buf), "%s.shard", path);
+    FILE *f = fopen(buf, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+    int ok = fscanf(f, SHARD_MANIFEST, &at, &of) == 2 && at == i && of == count;
+    fclose(f);
+    if (!ok)
+        errno = EINVAL;
+    return ok ? 1 : -1;
 }
 
-static void springfield_iter_i(springfield_t *r, springfield_iter_cb cb,
-        springfield_readonly_iter_cb rocb, void *passthrough) {
-    /* Copy into temporary buffer */
-    if (cb) {
-        assert(!rocb);
-    } else {
-        assert(rocb);
+static int springfield_shard_claim(char *path, int i, int count) {
+    char buf[1200], tmp[1220];
+    snprintf(buf, sizeof(buf), "%s.shard", path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", buf);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    int bad = fprintf(f, SHARD_MANIFEST, i, count) < 0;
+    bad |= fflush(f) || fsync(fileno(f));
+    bad |= fclose(f);
+    if (bad || rename(tmp, buf)) {
+        unlink(tmp);
+        return -1;
     }
-    int i;
-    for (i = 0; i < r->num_buckets; i++) {
-        uint64_t off = r->offsets[i];
-        springfield_key_t *key = NULL, *tmp = NULL;
-        springfield_key_t *keys = NULL;
-        pthread_rwlock_rdlock(&r->main_lock);
-        while (off != NO_BACKTRACE) {
-            springfield_header_v1 *h = (springfield_header_v1 *)(r->map + off);
-            int klen = h->klen - 1;
-            char *keyptr = (char *)(r->map + off + HEADER_SIZE);
-            HASH_FIND(hh, keys, keyptr, klen, key);
-            uint64_t last = h->last;
-            if (!key) {
-                /* not found */
-                key = calloc(1, sizeof(springfield_key_t));
-                key->key = strdup(keyptr);
-                int do_callback = h->vlen > 0;
-                if (do_callback) {
-                    if (cb) {
-                        pthread_rwlock_unlock(&r->main_lock);
-                        cb(r, key->key, passthrough);
-                        pthread_rwlock_rdlock(&r->main_lock);
-                    } else {
-                        pthread_rwlock_unlock(&r->main_lock);
-                        rocb(r, key->key,
-                            r->map + off + HEADER_SIZE + h->klen,
-                            h->vlen, passthrough);
-                        pthread_rwlock_rdlock(&r->main_lock);
-                    }
-                }
-                /* set in hash */
-                HASH_ADD_KEYPTR(hh, keys, key->key, klen, key);
-            }
+    return 0;
+}
 
-            off = last;
+springfield_sharded_t * springfield_sharded_create(char **paths, int count,
+        uint32_t num_buckets, springfield_options_t *opts) {
+    assert(count > 0);
+    int *had = malloc(count * sizeof(int));
+    int i, err;
+    for (i = 0; i < count; i++) {
+        if ((had[i] = springfield_shard_check(paths[i], i, count)) < 0) {
+            free(had);
+            return NULL;
         }
-        pthread_rwlock_unlock(&r->main_lock);
-        /* cleanup keys XXX */
-        HASH_ITER(hh, keys, key, tmp) {
-            HASH_DEL(keys, key);
-            free(key->key);
-            free(key);
+    }
+    /* all or nothing: a half-claimed set would refuse the next
+       open at another count */
+    for (i = 0; i < count; i++) {
+        if (!had[i] && springfield_shard_claim(paths[i], i, count)) {
+            err = errno;
+            while (i--) {
+                char buf[1200];
+                snprintf(buf, sizeof(buf), "%s.shard", paths[i]);
+                if (!had[i])
+                    unlink(buf);
+            }
+            free(had);
+            errno = err;
+            return NULL;
         }
     }
+    free(had);
+
+    springfield_sharded_t *s = calloc(1, sizeof(springfield_sharded_t));
+    s->count = count;
+    s->shards = malloc(count * sizeof(springfield_t *));
+    for (i = 0; i < count; i++)
+        s->shards[i] = springfield_create_opts(paths[i], num_buckets, opts);
+    return s;
 }
 
-void springfield_iter(springfield_t *r, springfield_iter_cb cb, void *passthrough) {
-    pthread_mutex_lock(&r->iter_lock);
-    springfield_iter_i(r, cb, NULL, passthrough);
-    pthread_mutex_unlock(&r->iter_lock);
+int springfield_sharded_count(springfield_sharded_t *s) {
+    return s->count;
 }
 
-void springfield_readonly_iter(springfield_t *r, springfield_readonly_iter_cb cb, void *passthrough) {
-    pthread_mutex_lock(&r->iter_lock);
-    springfield_iter_i(r, NULL, cb, passthrough);
-    pthread_mutex_unlock(&r->iter_lock);
+springfield_t * springfield_sharded_shard(springfield_sharded_t *s, int i) {
+    assert(i >= 0 && i < s->count);
+    return s->shards[i];
 }
 
-static void springfield_rewrite_cb(springfield_t *r, char *key, uint8_t *data,
-        uint32_t length, void *pass)
-{
-   springfield_t *new = (springfield_t *)pass;
-   springfield_set_i(new, key, data, length);
+void springfield_sharded_close(springfield_sharded_t *s) {
+    int i;
+    for (i = 0; i < s->count; i++)
+        springfield_close(s->shards[i]);
+    free(s->shards);
+    free(s);
 }
 
-void springfield_compact(springfield_t *r, uint32_t num_buckets) {
-    char path[1200] = {0};
-    pthread_mutex_lock(&r->iter_lock);
+void springfield_sharded_sync(springfield_sharded_t *s) {
+    int i;
+    for (i = 0; i < s->count; i++)
+        springfield_sync(s->shards[i]);
+}
 
-    assert(strlen(r->path) < 1100);
+void springfield_sharded_compact(springfield_sharded_t *s, uint32_t num_buckets) {
+    int i;
+    for (i = 0; i < s->count; i++)
+        springfield_compact(s->shards[i], num_buckets);
+}
 
-    strcat(path, r->path);
-    strcat(path, ".springfield_rewrite");
+int springfield_sharded_checkpoint(springfield_sharded_t *s, char **paths,
+        uint64_t bytes_per_sec) {
+    int i;
+    for (i = 0; i < s->count; i++) {
+        if (springfield_checkpoint(s->shards[i], paths[i], bytes_per_sec) ||
+                springfield_shard_claim(paths[i], i, s->count))
+            return -1;
+    }
+    return 0;
+}
 
-    springfield_t *tmp = springfield_create(path, num_buckets ?
-       num_buckets : r->num_buckets);
+void springfield_sharded_stats(springfield_sharded_t *s, springfield_stats_t *out) {
+    springfield_stats_t st;
+    int i, j;
+    memset(out, 0, sizeof(springfield_stats_t));
+    for (i = 0; i < s->count; i++) {
+        springfield_stats(s->shards[i], &st);
+        for (j = 0; j < SPRINGFIELD_OP_COUNT; j++)
+            springfield_histogram_merge(&out->ops[j], &st.ops[j]);
+        for (j = 0; j < SPRINGFIELD_LOCK_COUNT; j++)
+            springfield_histogram_merge(&out->lock_waits[j], &st.lock_waits[j]);
+        for (j = 0; j < SPRINGFIELD_CHAIN_BUCKETS; j++)
+            out->chain_lengths[j] += st.chain_lengths[j];
+        out->gets += st.gets;
+        out->get_hits += st.get_hits;
+        out->sets += st.sets;
+        out->dels += st.dels;
+        out->dels_skipped += st.dels_skipped;
+        out->cache_hits += st.cache_hits;
+        out->cache_misses += st.cache_misses;
+        out->cache_bytes += st.cache_bytes;
+        out->bloom_negatives += st.bloom_negatives;
+        out->try_wouldblocks += st.try_wouldblocks;
+        out->rmws += st.rmws;
+        out->merge_folds += st.merge_folds;
+        out->grows += st.grows;
+        out->bytes_appended += st.bytes_appended;
+        out->num_buckets += st.num_buckets;
+        out->eof += st.eof;
+        out->mmap_alloc += st.mmap_alloc;
+        out->compactions += st.compactions;
+        out->compact_running |= st.compact_running;
+        out->compact_buckets_done += st.compact_buckets_done;
+        out->compact_buckets_total += st.compact_buckets_total;
+        out->blob_bytes += st.blob_bytes;
+        out->blob_gcs += st.blob_gcs;
+        out->checkpoints += st.checkpoints;
+        out->crc_errors += st.crc_errors;
+        out->scrub_bytes += st.scrub_bytes;
+        out->scrub_passes += st.scrub_passes;
+        out->wbuf_bytes += st.wbuf_bytes;
+        out->wbuf_flushes += st.wbuf_flushes;
+        out->wbuf_stalls += st.wbuf_stalls;
+    }
+}
 
-    /* set up "rewrite" mode */
-    pthread_rwlock_wrlock(&r->main_lock);
-    r->in_rewrite = 1;
-    r->rewrite_keys = NULL;
-    pthread_rwlock_unlock(&r->main_lock);
+uint8_t * springfield_sharded_get_k(springfield_sharded_t *s, springfield_key_t *k,
+        uint32_t *len) {
+    return springfield_get_k(springfield_shard_for(s, k), k, len);
+}
 
-    springfield_iter_i(r, NULL, springfield_rewrite_cb, (void *)tmp);
+void springfield_sharded_set_k(springfield_sharded_t *s, springfield_key_t *k,
+        uint8_t *val, uint32_t vlen) {
+    springfield_set_k(springfield_shard_for(s, k), k, val, vlen);
+}
 
-    /* tear down "rewrite" mode */
-    pthread_rwlock_wrlock(&r->main_lock);
+void springfield_sharded_del_k(springfield_sharded_t *s, springfield_key_t *k) {
+    springfield_del_k(springfield_shard_for(s, k), k);
+}
 
-    r->in_rewrite = 0;
-    springfield_key_t *key, *ktmp;
-    HASH_ITER(hh, r->rewrite_keys, key, ktmp) {
+uint8_t * springfield_sharded_get(springfield_sharded_t *s, char *key, uint32_t *len) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_sharded_get_k(s, &k, len);
+}
 
-        uint32_t length;
-        uint8_t *data = springfield_get_i(r, key->key, &length);
-        /* Note: incl' delete (which is set NULL) */
-        springfield_set_i(tmp, key->key, data, length);
-        free(data);
-        HASH_DEL(r->rewrite_keys, key);
-        free(key->key);
-        free(key);
-    }
-    r->rewrite_keys = NULL;
-    r->num_buckets = tmp->num_buckets;
-    munmap(r->map, r->mmap_alloc);
-    close(r->mapfd);
-    r->mapfd = tmp->mapfd;
-    r->map = tmp->map;
-    r->mmap_alloc = tmp->mmap_alloc;
-    r->eof = tmp->eof;
+void springfield_sharded_set(springfield_sharded_t *s, char *key, uint8_t *val,
+        uint32_t vlen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_sharded_set_k(s, &k, val, vlen);
+}
 
-    free(r->offsets);
-    r->offsets = tmp->offsets;
+void springfield_sharded_del(springfield_sharded_t *s, char *key) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_sharded_del_k(s, &k);
+}
 
-    tmp->map = NULL;
-    tmp->mapfd = -1;
-    tmp->offsets = NULL;
+int springfield_sharded_cas(springfield_sharded_t *s, char *key, uint8_t *expect,
+        uint32_t elen, uint8_t *val, uint32_t vlen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_cas_k(springfield_shard_for(s, &k), &k, expect, elen, val, vlen);
+}
 
-    rename(path, r->path);
+int springfield_sharded_incr(springfield_sharded_t *s, char *key, int64_t delta,
+        int64_t *result) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    return springfield_incr_k(springfield_shard_for(s, &k), &k, delta, result);
+}
 
-    pthread_rwlock_unlock(&r->main_lock);
+void springfield_sharded_merge(springfield_sharded_t *s, char *key, uint8_t *operand,
+        uint32_t olen) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_merge_k(springfield_shard_for(s, &k), &k, operand, olen);
+}
 
-    springfield_close(tmp);
+void springfield_sharded_append(springfield_sharded_t *s, char *key, uint8_t *frag,
+        uint32_t len) {
+    springfield_key_t k;
+    springfield_key_init(&k, key);
+    springfield_append_k(springfield_shard_for(s, &k), &k, frag, len);
+}
 
-    pthread_mutex_unlock(&r->iter_lock);
+int springfield_sharded_apply_record(springfield_sharded_t *s, uint8_t *rec,
+        uint32_t len) {
+    springfield_rec h;
+    if (!springfield_rec_decode(rec, NO_BACKTRACE, len, &h) ||
+            (uint64_t)h.hlen + h.klen > len ||
+            memchr(rec + h.hlen, 0, h.klen) != rec + h.hlen + h.klen - 1)
+        return 0;
+    springfield_key_t k;
+    springfield_key_init(&k, (char *)rec + h.hlen);
+    return springfield_apply_record(springfield_shard_for(s, &k), rec, len);
 }
 
-void springfield_close(springfield_t *r) {
-    if (r->map) {
-        munmap(r->map, r->mmap_alloc);
-        close(r->mapfd);
+void springfield_sharded_get_multi(springfield_sharded_t *s, springfield_key_t *keys,
+        int count, uint8_t **vals, uint32_t *lens) {
+    if (s->count == 1) {
+        springfield_get_multi(s->shards[0], keys, count, vals, lens);
+        return;
     }
 
-    free(r->path);
-    free(r->offsets);
-    free(r);
+    /* Sort the keys by shard (counting sort, routing each key
+       once), fetch each shard's run as one batch, scatter */
+    springfield_key_t *sk = malloc(count * sizeof(springfield_key_t));
+    uint8_t **sv = malloc(count * sizeof(uint8_t *));
+    uint32_t *sl = malloc(count * sizeof(uint32_t));
+    int *pos = malloc(count * sizeof(int));
+    int *shard = malloc(count * sizeof(int));
+    int *starts = calloc(s->count + 1, sizeof(int));
+    int i, j;
+    for (j = 0; j < count; j++) {
+        shard[j] = springfield_shard_index(s, &keys[j]);
+        starts[shard[j] + 1]++;
+    }
+    for (i = 0; i < s->count; i++)
+        starts[i + 1] += starts[i];
+    for (j = 0; j < count; j++) {
+        int n = starts[shard[j]]++;
+        sk[n] = keys[j];
+        pos[n] = j;
+    }
+    /* starts[i] is now where shard i + 1's run begins */
+    for (i = 0; i < s->count; i++) {
+        int lo = i ? starts[i - 1] : 0, n = starts[i] - lo;
+        if (!n)
+            continue;
+        springfield_get_multi(s->shards[i], sk + lo, n, sv + lo, sl + lo);
+    }
+    for (j = 0; j < count; j++) {
+        vals[pos[j]] = sv[j];
+        lens[pos[j]] = sl[j];
+    }
+    free(sk);
+    free(sv);
+    free(sl);
+    free(pos);
+    free(shard);
+    free(starts);
+}
+
+uint64_t springfield_sharded_del_prefix(springfield_sharded_t *s, char *prefix) {
+    uint64_t n = 0;
+    int i;
+    for (i = 0; i < s->count; i++)
+        n += springfield_del_prefix(s->shards[i], prefix);
+    return n;
+}
+
+void springfield_sharded_iter(springfield_sharded_t *s, springfield_iter_cb cb,
+        void *passthrough) {
+    int i;
+    for (i = 0; i < s->count; i++)
+        springfield_iter(s->shards[i], cb, passthrough);
+}
+
+void springfield_sharded_readonly_iter(springfield_sharded_t *s,
+        springfield_readonly_iter_cb cb, void *passthrough) {
+    int i;
+    for (i = 0; i < s->count; i++)
+        springfield_readonly_iter(s->shards[i], cb, passthrough);
 }
 
 /* From Bob Jenkins/Dr. Dobbs */
@@ -599,3 +6258,53 @@ static uint32_t crc32(uint32_t crc, uint8_t *buf, int len) {
     } while (--len);
     return crc ^ 0xffffffffL;
 }
+
+/* ========================================================================= */
+/* crc32_combine() as of zlib 1.2.12: x^(2^n) mod p(x) table and
+   polynomial multiplication modulo p(x) */
+#define POLY 0xedb88320
+
+static const uint32_t x2n_table[32] = {
+  0x40000000UL, 0x20000000UL, 0x08000000UL, 0x00800000UL, 0x00008000UL,
+  0xedb88320UL, 0xb1e6b092UL, 0xa06a2517UL, 0xed627daeUL, 0x88d14467UL,
+  0xd7bbfe6aUL, 0xec447f11UL, 0x8e7ea170UL, 0x6427800eUL, 0x4d47bae0UL,
+  0x09fe548fUL, 0x83852d0fUL, 0x30362f1aUL, 0x7b5a9cc3UL, 0x31fec169UL,
+  0x9fec022aUL, 0x6c8dedc4UL, 0x15d6874dUL, 0x5fde7a4eUL, 0xbad90e37UL,
+  0x2e4e5eefUL, 0x4eaba214UL, 0xa8a472c0UL, 0x429a969eUL, 0x148d302aUL,
+  0xc40ba6d0UL, 0xc4e22c3cUL
+};
+
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m, p;
+
+    m = (uint32_t)1 << 31;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p;
+
+    p = (uint32_t)1 << 31;           /* x^0 == 1 */
+    while (n) {
+        if (n & 1)
+            p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* CRC of A followed by B, given the CRCs of both and B's length */
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
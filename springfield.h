@@ -6,18 +6,328 @@
 /* This is your database, friend. */
 typedef struct springfield_t springfield_t;
 
+/* A key prepared for repeated use: the key bytes, their
+   length (including the trailing NUL, as stored on disk)
+   and their hash.  Prepare it once with springfield_key_init()
+   and pass it to the *_k calls; the library never hashes a
+   prepared key again.  You still own `key`. */
+typedef struct springfield_key_t {
+    char *key;
+    uint32_t klen;
+    uint32_t hash;
+} springfield_key_t;
+
+/* The hash springfield uses to pick a bucket for `key`.  Use
+   it to route between shards so the same value can be handed
+   back via springfield_key_init_hashed() */
+uint32_t springfield_hash(char *key);
+
+/* Prepare `k` for `key`, computing its hash */
+void springfield_key_init(springfield_key_t *k, char *key);
+
+/* Prepare `k` for `key` with a hash you already have; `hash`
+   must be springfield_hash(key) */
+void springfield_key_init_hashed(springfield_key_t *k, char *key, uint32_t hash);
+
 /* Create a database (in a single file) at `path`.
    If `path` does not exist, it will be created;
    otherwise, it will be loaded. */
 springfield_t * springfield_create(char *path, uint32_t num_buckets);
 
+/* Values for springfield_options_t.map_advice: the madvise()
+   hint given for the data map */
+#define SPRINGFIELD_ADVICE_RANDOM 0
+#define SPRINGFIELD_ADVICE_NORMAL 1
+#define SPRINGFIELD_ADVICE_SEQUENTIAL 2
+#define SPRINGFIELD_ADVICE_WILLNEED 3
+
+/* Values for springfield_options_t.backend */
+/* The data file is mmap()ed; the kernel manages caching */
+#define SPRINGFIELD_BACKEND_MMAP 0
+/* pread()/pwrite() through a fixed size buffer pool */
+#define SPRINGFIELD_BACKEND_POOL 1
+
+/* A merge operator (see springfield_merge()): combine `key`'s
+   `existing` value (NULL if it has none) with `operand`, and
+   return the result in a malloc()ed buffer of `*len` bytes, or
+   NULL to leave the key without a value */
+typedef uint8_t * (*springfield_merge_fn) (char *key, uint8_t *existing,
+        uint32_t elen, uint8_t *operand, uint32_t olen, uint32_t *len,
+        void *passthrough);
+
+/* Values for springfield_options_t.warmup */
+#define SPRINGFIELD_WARMUP_NONE 0
+/* MAP_POPULATE: create doesn't return until the file is resident */
+#define SPRINGFIELD_WARMUP_POPULATE 1
+/* A thread reads the file in after create returns */
+#define SPRINGFIELD_WARMUP_BACKGROUND 2
+
+/* Tunables for springfield_create_opts().  Start from
+   springfield_options_init() and change what you need. */
+typedef struct springfield_options_t {
+    /* Byte budget for the in-process cache of hot values;
+       0 (the default) disables it */
+    uint64_t cache_bytes;
+
+    /* Bits per key for an in-memory Bloom filter that lets most
+       lookups of absent keys finish without touching the file;
+       10 gives about 1% false positives.  0 (the default)
+       disables it */
+    uint32_t bloom_bits_per_key;
+
+    /* SPRINGFIELD_ADVICE_*; RANDOM by default */
+    int map_advice;
+
+    /* SPRINGFIELD_WARMUP_*; NONE by default */
+    int warmup;
+
+    /* Back the bucket index and Bloom filter with transparent
+       huge pages (best effort) */
+    int index_hugepages;
+
+    /* mlock() the bucket index and Bloom filter (best effort,
+       subject to RLIMIT_MEMLOCK) */
+    int index_mlock;
+
+    /* Time every operation and lock acquisition into the
+       histograms reported by springfield_stats() */
+    int latency_stats;
+
+    /* Values of at least this many bytes are stored out of line
+       in a blob file and the record keeps only a pointer, so
+       compaction doesn't copy them; see springfield_blob_gc().
+       0 (the default) keeps every value inline */
+    uint32_t blob_threshold;
+
+    /* Buffer up to this many bytes of sets and deletes in memory
+       and append them from a background thread, so writers never
+       wait on the write lock or on page faults.  Reads see
+       buffered writes at once; springfield_sync() flushes them
+       first.  Buffered writes are lost if the process dies before
+       a flush (at most ~10ms).  0 (the default) writes through */
+    uint64_t write_buffer_bytes;
+
+    /* SPRINGFIELD_BACKEND_*; MMAP by default.  The pool backend
+       keeps memory use at pool_bytes plus the index, never
+       page-faults on the data file and has no address space or
+       remapping cost as the file grows; map_advice doesn't apply
+       to it, and warmup fills the pool rather than the page
+       cache.  Blob files are mapped either way. */
+    int backend;
+
+    /* Pool backend: bytes of buffer pool (64MB if 0) */
+    uint64_t pool_bytes;
+
+    /* Pool backend: read with O_DIRECT, and drop written pages
+       from the page cache on sync, so the pool is the only cache
+       (best effort: falls back to buffered reads where the
+       filesystem refuses).  try_get then only hits the pool. */
+    int direct_io;
+
+    /* The operator springfield_merge() applies, and its
+       passthrough */
+    springfield_merge_fn merge;
+    void *merge_passthrough;
+
+    /* Store merge operands as they come and fold them in on read
+       and at compaction, so a merge is one append with no read.
+       A read then applies every operand since the key was last
+       set or compacted.  A db that has ever been written this
+       way must always be opened with the same operator. */
+    int merge_lazy;
+
+    /* Write an index file at close, and at open take the one
+       close or springfield_checkpoint() left, so open only scans
+       what was appended after it, without checking the CRCs of
+       what it covers (even to fill a Bloom filter).  Leave
+       catching rot in that part to verify_reads and the
+       scrubber.  Without it, open ignores index files. */
+    int trusted_open;
+
+    /* Check the CRC of one in this many records springfield_get()
+       reads from the file (1 for all, 0, the default, for none).
+       A get that fails the check returns NULL and counts in
+       stats.crc_errors. */
+    uint32_t verify_reads;
+
+    /* Run a thread that reads the file through end to end, over
+       and over, checking every record's CRC at up to this many
+       bytes a second.  0 (the default) runs none. */
+    uint64_t scrub_bytes_per_sec;
+
+    /* Run a thread that watches the db and compacts it, picking
+       the bucket count, when one of the policies below calls for
+       it; see the README.  The autopilot_* fields are its
+       policies, and 0 means the default for each. */
+    int autopilot;
+
+    /* Resize once live keys per bucket pass this (2), or drop
+       under an eighth of it, to half of it */
+    double autopilot_chain_length;
+
+    /* Compact once this fraction of the data file is garbage
+       (0.5) */
+    double autopilot_garbage_ratio;
+
+    /* Compact (and collect blob files) whenever the data and blob
+       files together pass this many bytes, outside the window
+       too (no ceiling) */
+    uint64_t autopilot_disk_bytes;
+
+    /* Only resize or collect garbage from this hour of the day
+       (local time, 0-23) up to, not including, that one; they
+       may wrap midnight, and equal hours (the default) allow any
+       time */
+    int autopilot_hour_start;
+    int autopilot_hour_end;
+
+    /* Write compactions out at up to this many bytes a second (no
+       limit) */
+    uint64_t autopilot_bytes_per_sec;
+
+    /* Seconds between looks at the db (60) */
+    uint32_t autopilot_interval;
+} springfield_options_t;
+
+/* Fill `o` with the defaults springfield_create() uses */
+void springfield_options_init(springfield_options_t *o);
+
+/* springfield_create(), with tunables.  `opts` is copied;
+   NULL means defaults */
+springfield_t * springfield_create_opts(char *path, uint32_t num_buckets,
+        springfield_options_t *opts);
+
 /* Force the database to be sync'd to disk (msync) */
 void springfield_sync(springfield_t *r);
 
-/* Get the average number of seeks on a record hit in the
-   last 100 fetches */
+/* Get the average number of seeks on a record hit over
+   recent fetches */
 double springfield_seek_average(springfield_t *r);
 
+/* Non-blocking gets for event loops.  A springfield_async_t
+   walks chains with io_uring reads of the file instead of
+   touching the map (pread() inside poll where io_uring isn't
+   available), so the calling thread never page-faults.  One per
+   thread; it is not itself thread-safe. */
+typedef struct springfield_async_t springfield_async_t;
+
+/* Called from springfield_async_poll() with the value (heap
+   allocated and yours to free(), or NULL if not found) */
+typedef void(*springfield_async_cb) (springfield_t *r, char *key, uint8_t *val, uint32_t len, void *passthrough);
+
+/* Allow up to `depth` gets in flight at once */
+springfield_async_t * springfield_async_create(springfield_t *r, int depth);
+
+/* Start a get; returns -1 if `depth` are already in flight.  The
+   key is copied.  `cb` always runs from a later poll, even when
+   the answer is known at once. */
+int springfield_async_get(springfield_async_t *a, char *key,
+        springfield_async_cb cb, void *passthrough);
+int springfield_async_get_k(springfield_async_t *a, springfield_key_t *k,
+        springfield_async_cb cb, void *passthrough);
+
+/* Run the callbacks of finished gets and return how many ran;
+   with `wait`, block until at least one has (if any are pending) */
+int springfield_async_poll(springfield_async_t *a, int wait);
+
+/* An eventfd that is readable whenever poll has work; hand it
+   to epoll */
+int springfield_async_fd(springfield_async_t *a);
+
+/* Gets started whose callbacks haven't run yet */
+int springfield_async_pending(springfield_async_t *a);
+
+/* Finish any pending gets (running their callbacks) and free `a`.
+   Destroy it before closing its db. */
+void springfield_async_destroy(springfield_async_t *a);
+
+/* Latency histograms: log-linear buckets of nanoseconds, four
+   per power of two */
+#define SPRINGFIELD_HIST_BUCKETS 160
+typedef struct springfield_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[SPRINGFIELD_HIST_BUCKETS];
+} springfield_histogram_t;
+
+/* Upper bound (ns) of the bucket holding the `p` (0-1) quantile */
+uint64_t springfield_histogram_percentile(springfield_histogram_t *h, double p);
+
+/* Add one sample to `h`, or fold all of `from` into `into`; for
+   callers keeping their own histograms in the same buckets */
+void springfield_histogram_record(springfield_histogram_t *h, uint64_t v);
+void springfield_histogram_merge(springfield_histogram_t *into,
+        springfield_histogram_t *from);
+
+#define SPRINGFIELD_OP_GET 0
+#define SPRINGFIELD_OP_SET 1
+#define SPRINGFIELD_OP_DEL 2
+#define SPRINGFIELD_OP_SYNC 3
+#define SPRINGFIELD_OP_COMPACT 4
+#define SPRINGFIELD_OP_COUNT 5
+
+#define SPRINGFIELD_LOCK_MAIN_READ 0
+#define SPRINGFIELD_LOCK_MAIN_WRITE 1
+#define SPRINGFIELD_LOCK_ITER 2
+#define SPRINGFIELD_LOCK_COUNT 3
+
+/* chain_lengths[n] counts lookups that visited n records;
+   the last slot collects everything longer */
+#define SPRINGFIELD_CHAIN_BUCKETS 64
+
+typedef struct springfield_stats_t {
+    /* Filled only with options.latency_stats */
+    springfield_histogram_t ops[SPRINGFIELD_OP_COUNT];
+    springfield_histogram_t lock_waits[SPRINGFIELD_LOCK_COUNT];
+
+    uint64_t chain_lengths[SPRINGFIELD_CHAIN_BUCKETS];
+    uint64_t gets;
+    uint64_t get_hits;
+    uint64_t sets;
+    uint64_t dels;
+    uint64_t dels_skipped; /* of keys that didn't exist */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_bytes;
+    uint64_t bloom_negatives;
+    uint64_t try_wouldblocks; /* try_gets that gave up */
+    uint64_t rmws; /* cas, incr and merge calls */
+    uint64_t merge_folds; /* merge operands and fragments applied by reads */
+    uint64_t grows;
+    uint64_t bytes_appended;
+
+    uint32_t num_buckets;
+    uint64_t eof;
+    uint64_t mmap_alloc;
+
+    uint64_t compactions;
+    int compact_running;
+    uint32_t compact_buckets_done;
+    uint32_t compact_buckets_total;
+
+    uint64_t blob_bytes;
+    uint64_t blob_gcs;
+    uint64_t checkpoints;
+
+    uint64_t crc_errors; /* damaged records found by gets or the scrubber */
+    uint64_t scrub_bytes;
+    uint64_t scrub_passes;
+
+    uint64_t wbuf_bytes;
+    uint64_t wbuf_flushes;
+    uint64_t wbuf_stalls; /* sets that waited for a flush */
+} springfield_stats_t;
+
+/* Snapshot the counters into `out`; cheap enough to poll */
+void springfield_stats(springfield_t *r, springfield_stats_t *out);
+
+/* Read the whole file into the page cache now, e.g. after a
+   restart and before taking traffic */
+void springfield_warmup(springfield_t *r);
+
+/* The fraction (0-1) of the file currently in the page cache */
+double springfield_residency(springfield_t *r);
+
 /* Get the current bucket count */
 double springfield_bucket_count(springfield_t *r);
 
@@ -28,6 +338,18 @@ void springfield_close(springfield_t *r);
    and potentially expand/contract # of buckets */
 void springfield_compact(springfield_t *r, uint32_t num_buckets);
 
+/* Reclaim space in the blob files: copy the still-live values
+   into a fresh file and delete the old ones.  Runs online, like
+   springfield_compact(), and independently of it */
+void springfield_blob_gc(springfield_t *r);
+
+/* Copy the db as it stands to `path` (and its blob files next
+   to it) while writers carry on, along with an index so opening
+   the copy with options.trusted_open doesn't scan it.  At most `bytes_per_sec` bytes a
+   second are copied (0 for no limit).  Returns 0, or -1 with
+   errno set if writing the copy failed. */
+int springfield_checkpoint(springfield_t *r, char *path, uint64_t bytes_per_sec);
+
 /* Set `key` to byte array `val` of `vlen` bytes; you still
    own key and val, they are not retained */
 void springfield_set(springfield_t *r, char *key, uint8_t *val, uint32_t vlen);
@@ -38,10 +360,84 @@ void springfield_set(springfield_t *r, char *key, uint8_t *val, uint32_t vlen);
    You own it, you must free() it eventually. */
 uint8_t * springfield_get(springfield_t *r, char *key, uint32_t *len);
 
+/* springfield_try_get() results */
+#define SPRINGFIELD_TRY_MISS 0
+#define SPRINGFIELD_TRY_HIT 1
+#define SPRINGFIELD_TRY_WOULDBLOCK 2
+
+/* springfield_try_get() flags: on WOULDBLOCK, ask the kernel to
+   start reading in the page it stopped at (MADV_WILLNEED) */
+#define SPRINGFIELD_TRY_PREFETCH 1
+
+/* springfield_get() that never waits on disk: if any page the
+   lookup needs isn't in the page cache (per mincore(), or for
+   the pool backend, isn't pooled and can't be read with
+   RWF_NOWAIT) it gives up with SPRINGFIELD_TRY_WOULDBLOCK, to
+   be retried later.
+   On SPRINGFIELD_TRY_HIT `*val` and `*len` are as get sets them. */
+int springfield_try_get(springfield_t *r, char *key, uint8_t **val, uint32_t *len,
+        int flags);
+int springfield_try_get_k(springfield_t *r, springfield_key_t *k, uint8_t **val,
+        uint32_t *len, int flags);
+
+/* Get `count` prepared keys under a single lock acquisition.
+   `vals[i]` and `lens[i]` are filled in as springfield_get()
+   would for `keys[i]` */
+void springfield_get_multi(springfield_t *r, springfield_key_t *keys, int count,
+        uint8_t **vals, uint32_t *lens);
+
 /* Remove the value `key` from the database.  Harmless NOOP
-   if `key` does not exist */
+   if `key` does not exist: nothing is written then */
 void springfield_del(springfield_t *r, char *key);
 
+/* Delete `count` prepared keys under a single lock acquisition;
+   returns how many existed */
+uint64_t springfield_del_many(springfield_t *r, springfield_key_t *keys, int count);
+
+/* Delete every key starting with `prefix`; returns how many.
+   Scans the whole index, like springfield_iter() */
+uint64_t springfield_del_prefix(springfield_t *r, char *prefix);
+
+/* Prepared-key variants of get/set/del */
+uint8_t * springfield_get_k(springfield_t *r, springfield_key_t *k, uint32_t *len);
+void springfield_set_k(springfield_t *r, springfield_key_t *k, uint8_t *val, uint32_t vlen);
+void springfield_del_k(springfield_t *r, springfield_key_t *k);
+
+/* Atomic read-modify-write: each reads the current value and
+   writes the new one under a single lock hold. */
+
+/* Set `key` to `val` (NULL/0 to delete it) if its value is
+   currently `expect` (NULL: if it has none).  Returns 1 if it
+   did */
+int springfield_cas(springfield_t *r, char *key, uint8_t *expect, uint32_t elen,
+        uint8_t *val, uint32_t vlen);
+
+/* Add `delta` to the counter at `key`, putting the result in
+   `*result` (if not NULL).  A counter is an 8 byte int64 in host
+   order; no value counts as 0.  Returns 0, or -1 with errno
+   EINVAL (and nothing written) if `key` holds something else */
+int springfield_incr(springfield_t *r, char *key, int64_t delta, int64_t *result);
+
+/* Apply options.merge to `key`'s value and `operand`, or with
+   options.merge_lazy, just record the operand */
+void springfield_merge(springfield_t *r, char *key, uint8_t *operand, uint32_t olen);
+
+/* Add `len` bytes to the end of `key`'s value (or make them its
+   value, if it has none).  Writes only the new bytes, as a
+   fragment that gets and compaction join back up, so the cost
+   doesn't grow with the value.  Reads walk every fragment since
+   the key was last set or compacted. */
+void springfield_append(springfield_t *r, char *key, uint8_t *frag, uint32_t len);
+
+int springfield_cas_k(springfield_t *r, springfield_key_t *k, uint8_t *expect,
+        uint32_t elen, uint8_t *val, uint32_t vlen);
+int springfield_incr_k(springfield_t *r, springfield_key_t *k, int64_t delta,
+        int64_t *result);
+void springfield_merge_k(springfield_t *r, springfield_key_t *k, uint8_t *operand,
+        uint32_t olen);
+void springfield_append_k(springfield_t *r, springfield_key_t *k, uint8_t *frag,
+        uint32_t len);
+
 /* Iterate over all keys in the database.  See the note in the
    README.md about caveats associated with iteration and mutation */
 typedef void(*springfield_iter_cb) (springfield_t *r, char *key, void *passthrough);
@@ -50,4 +446,126 @@ void springfield_iter(springfield_t *r, springfield_iter_cb cb, void *passthroug
 typedef void(*springfield_readonly_iter_cb) (springfield_t *r, char *key, uint8_t *val, uint32_t len, void *passthrough);
 void springfield_readonly_iter(springfield_t *r, springfield_readonly_iter_cb cb, void *passthrough);
 
+/* A change stream: every record appended to the file after a
+   given position, in order, for shipping to a follower (which
+   applies them with springfield_apply_record()) or invalidating
+   caches.  Positions keep growing across compactions and
+   reopens, so a follower can save one and resume from it.  One
+   per thread; destroy it before closing its db. */
+typedef struct springfield_tail_t springfield_tail_t;
+
+#define SPRINGFIELD_CHANGE_SET 0
+#define SPRINGFIELD_CHANGE_DEL 1
+#define SPRINGFIELD_CHANGE_MERGE 2  /* val is a merge operand */
+#define SPRINGFIELD_CHANGE_APPEND 3 /* val is a fragment */
+
+/* Start of the file, and wherever it ends now */
+#define SPRINGFIELD_TAIL_START 0
+#define SPRINGFIELD_TAIL_END (~(uint64_t)0)
+
+/* springfield_tail_next/poll: the position was from before a
+   compaction the tail didn't see, or wasn't a record boundary, or
+   the tail fell too far behind (64MB) across a compaction; the
+   stream starts over from SPRINGFIELD_TAIL_START, so a follower
+   should start empty */
+#define SPRINGFIELD_TAIL_RESET -1
+
+/* One change; everything points into the tail's buffer, good
+   until its next call */
+typedef struct springfield_change_t {
+    int kind;           /* SPRINGFIELD_CHANGE_* */
+    uint64_t pos;       /* this record's position */
+    uint64_t next;      /* the position after it, to resume from */
+    char *key;
+    uint8_t *val;       /* NULL for deletes */
+    uint32_t vlen;
+    uint8_t *rec;       /* the record, for springfield_apply_record() */
+    uint32_t rec_len;
+} springfield_change_t;
+
+springfield_tail_t * springfield_tail_create(springfield_t *r, uint64_t from);
+
+/* 1 and the next change in `c`, 0 if there is none yet, or
+   SPRINGFIELD_TAIL_RESET */
+int springfield_tail_next(springfield_tail_t *t, springfield_change_t *c);
+
+/* Run `cb` on each change available and return how many ran (or
+   SPRINGFIELD_TAIL_RESET); with `wait`, block until there's one */
+typedef void(*springfield_tail_cb) (springfield_tail_t *t, springfield_change_t *c, void *passthrough);
+int springfield_tail_poll(springfield_tail_t *t, springfield_tail_cb cb,
+        void *passthrough, int wait);
+
+/* An eventfd that turns readable when changes arrive after next
+   or poll has come up empty; hand it to epoll */
+int springfield_tail_fd(springfield_tail_t *t);
+void springfield_tail_destroy(springfield_tail_t *t);
+
+/* Append a record from another db's change stream as it stands,
+   reusing its CRC.  Returns 0 (and changes nothing) if `rec`
+   is damaged. */
+int springfield_apply_record(springfield_t *r, uint8_t *rec, uint32_t len);
+
+/* A database hash-partitioned across several files, e.g. one
+   per drive.  Every shard is a full springfield_t with its own
+   locks and compaction, so writers on different shards don't
+   contend and compacting one shard doesn't pause the others */
+typedef struct springfield_sharded_t springfield_sharded_t;
+
+/* Open (or create) shards at `paths[0..count)`, each with
+   `num_buckets` buckets and `opts` (NULL means defaults).  Keys
+   are routed by hash, so reopen with the same paths in the same
+   order: each shard records its place in a `<path>.shard` file,
+   and a shard opened at a different place or count makes this
+   return NULL with errno EINVAL.  If a manifest can't be written,
+   the ones this call wrote are removed again before it returns
+   NULL. */
+springfield_sharded_t * springfield_sharded_create(char **paths, int count,
+        uint32_t num_buckets, springfield_options_t *opts);
+
+/* The shards themselves, for per-shard stats or for scheduling
+   compaction yourself */
+int springfield_sharded_count(springfield_sharded_t *s);
+springfield_t * springfield_sharded_shard(springfield_sharded_t *s, int i);
+
+void springfield_sharded_close(springfield_sharded_t *s);
+void springfield_sharded_sync(springfield_sharded_t *s);
+
+/* Compact the shards one at a time; only the shard being
+   rewritten is ever paused */
+void springfield_sharded_compact(springfield_sharded_t *s, uint32_t num_buckets);
+
+/* Checkpoint shard i to `paths[i]`, one after the other; each
+   shard's copy is of its own moment */
+int springfield_sharded_checkpoint(springfield_sharded_t *s, char **paths,
+        uint64_t bytes_per_sec);
+
+/* Counters and histograms summed over all shards */
+void springfield_sharded_stats(springfield_sharded_t *s, springfield_stats_t *out);
+
+/* As the unsharded calls.  Iteration visits one shard after
+   another, and callbacks get that shard's springfield_t */
+uint8_t * springfield_sharded_get(springfield_sharded_t *s, char *key, uint32_t *len);
+void springfield_sharded_set(springfield_sharded_t *s, char *key, uint8_t *val, uint32_t vlen);
+void springfield_sharded_del(springfield_sharded_t *s, char *key);
+uint8_t * springfield_sharded_get_k(springfield_sharded_t *s, springfield_key_t *k, uint32_t *len);
+void springfield_sharded_set_k(springfield_sharded_t *s, springfield_key_t *k, uint8_t *val, uint32_t vlen);
+void springfield_sharded_del_k(springfield_sharded_t *s, springfield_key_t *k);
+void springfield_sharded_get_multi(springfield_sharded_t *s, springfield_key_t *keys, int count,
+        uint8_t **vals, uint32_t *lens);
+uint64_t springfield_sharded_del_prefix(springfield_sharded_t *s, char *prefix);
+int springfield_sharded_cas(springfield_sharded_t *s, char *key, uint8_t *expect,
+        uint32_t elen, uint8_t *val, uint32_t vlen);
+int springfield_sharded_incr(springfield_sharded_t *s, char *key, int64_t delta,
+        int64_t *result);
+void springfield_sharded_merge(springfield_sharded_t *s, char *key, uint8_t *operand,
+        uint32_t olen);
+void springfield_sharded_append(springfield_sharded_t *s, char *key, uint8_t *frag,
+        uint32_t len);
+/* Tail each shard (springfield_sharded_shard()) on its own; this
+   routes a record from any of them to the shard its key hashes to */
+int springfield_sharded_apply_record(springfield_sharded_t *s, uint8_t *rec,
+        uint32_t len);
+void springfield_sharded_iter(springfield_sharded_t *s, springfield_iter_cb cb, void *passthrough);
+void springfield_sharded_readonly_iter(springfield_sharded_t *s, springfield_readonly_iter_cb cb, void *passthrough);
+
 #endif /* SPRINGFIELD_H */
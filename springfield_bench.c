@@ -0,0 +1,543 @@
+/* YCSB-style benchmark.
+
+   Loads `--records` keys, then runs `--ops` operations of one of
+   the YCSB core workload mixes across `--threads` threads, and
+   prints throughput and per-op latency percentiles as a single
+   JSON object on stdout (progress goes to stderr):
+
+     A  50% read, 50% update                  (zipfian)
+     B  95% read,  5% update                  (zipfian)
+     C 100% read                              (zipfian)
+     D  95% read,  5% insert                  (latest)
+     E  95% scan,  5% insert                  (zipfian)
+     F  50% read, 50% read-modify-write       (zipfian)
+
+   Springfield is a hash store, so E's "scan" is a get_multi of
+   1-100 consecutive record ids.  With --shards N the db is
+   split across N files (PATH.0 ...) behind a springfield_sharded_t.
+   Run with --help for options. */
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "springfield.h"
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPFIAN 1
+#define DIST_LATEST 2
+
+#define OP_READ 0
+#define OP_UPDATE 1
+#define OP_INSERT 2
+#define OP_SCAN 3
+#define OP_RMW 4
+#define OP_COUNT 5
+
+#define ZIPF_THETA 0.99
+#define MAX_SCAN 100
+#define KEY_SIZE 32
+
+static const char *op_names[OP_COUNT] = {
+    "read", "update", "insert", "scan", "rmw"
+};
+
+typedef struct bench_config {
+    char *path;
+    char workload;
+    uint64_t records;
+    uint64_t ops;
+    int threads;
+    int dist;
+    int dist_set;
+    uint32_t value_min;
+    uint32_t value_max;
+    double ram_ratio;
+    uint32_t buckets;
+    int shards;
+    int reuse;
+    springfield_options_t opts;
+} bench_config;
+
+typedef struct zipfian {
+    uint64_t items;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+    double half_pow_theta;
+} zipfian;
+
+typedef struct bench_thread {
+    pthread_t t;
+    int id;
+    uint64_t ops;
+    uint64_t rng;
+    springfield_histogram_t hist[OP_COUNT];
+    uint64_t misses;
+} bench_thread;
+
+static bench_config cfg;
+static springfield_sharded_t *db;
+static zipfian zipf;
+static uint64_t insert_next;
+
+double doublenow() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return (double)tv.tv_sec
+        + (((double)tv.tv_usec) / 1000000.0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_double(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Gray et al., "Quickly generating billion-record synthetic
+   databases", as used by YCSB */
+static void zipfian_init(zipfian *z, uint64_t items, double theta) {
+    double zeta2 = 0;
+    uint64_t i;
+    z->items = items;
+    z->theta = theta;
+    z->zetan = 0;
+    for (i = 1; i <= items; i++) {
+        z->zetan += 1.0 / pow((double)i, theta);
+        if (i == 2)
+            zeta2 = z->zetan;
+    }
+    if (items < 2)
+        zeta2 = z->zetan;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / z->zetan);
+    z->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+static uint64_t zipfian_next(zipfian *z, uint64_t *rng) {
+    double u = rng_double(rng);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < z->half_pow_theta)
+        return 1;
+    uint64_t v = (uint64_t)(z->items * pow(z->eta * u - z->eta + 1, z->alpha));
+    return v < z->items ? v : z->items - 1;
+}
+
+/* FNV-1a over the rank, so zipfian's hot items aren't all
+   adjacent ids */
+static uint64_t scramble(uint64_t v) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < 8; i++) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3ULL;
+        v >>= 8;
+    }
+    return h;
+}
+
+static uint64_t next_id(bench_thread *bt) {
+    uint64_t count = __atomic_load_n(&insert_next, __ATOMIC_RELAXED);
+    switch (cfg.dist) {
+    case DIST_UNIFORM:
+        return rng_next(&bt->rng) % count;
+    case DIST_LATEST: {
+        uint64_t back = zipfian_next(&zipf, &bt->rng);
+        return back < count ? count - 1 - back : 0;
+    }
+    default:
+        return scramble(zipfian_next(&zipf, &bt->rng)) % count;
+    }
+}
+
+static void make_key(char *buf, uint64_t id) {
+    snprintf(buf, KEY_SIZE, "user%016llx", (unsigned long long)scramble(id));
+}
+
+static uint32_t make_value(uint8_t *buf, uint64_t *rng) {
+    uint32_t len = cfg.value_min;
+    uint32_t i;
+    if (cfg.value_max > cfg.value_min)
+        len += rng_next(rng) % (cfg.value_max - cfg.value_min + 1);
+    for (i = 0; i < len; i += 8) {
+        uint64_t x = rng_next(rng);
+        memcpy(buf + i, &x, len - i < 8 ? len - i : 8);
+    }
+    return len;
+}
+
+static int pick_op(bench_thread *bt) {
+    int roll = rng_next(&bt->rng) % 100;
+    switch (cfg.workload) {
+    case 'A':
+        return roll < 50 ? OP_READ : OP_UPDATE;
+    case 'B':
+        return roll < 95 ? OP_READ : OP_UPDATE;
+    case 'D':
+        return roll < 95 ? OP_READ : OP_INSERT;
+    case 'E':
+        return roll < 95 ? OP_SCAN : OP_INSERT;
+    case 'F':
+        return roll < 50 ? OP_READ : OP_RMW;
+    default:
+        return OP_READ;
+    }
+}
+
+static void do_op(bench_thread *bt, int op, uint8_t *vbuf) {
+    char key[KEY_SIZE];
+    uint32_t len;
+    uint8_t *p;
+
+    switch (op) {
+    case OP_READ:
+        make_key(key, next_id(bt));
+        p = springfield_sharded_get(db, key, &len);
+        if (!p)
+            bt->misses++;
+        free(p);
+        break;
+    case OP_UPDATE:
+        make_key(key, next_id(bt));
+        len = make_value(vbuf, &bt->rng);
+        springfield_sharded_set(db, key, vbuf, len);
+        break;
+    case OP_INSERT:
+        make_key(key, __atomic_fetch_add(&insert_next, 1, __ATOMIC_RELAXED));
+        len = make_value(vbuf, &bt->rng);
+        springfield_sharded_set(db, key, vbuf, len);
+        break;
+    case OP_SCAN: {
+        springfield_key_t keys[MAX_SCAN];
+        char kbufs[MAX_SCAN][KEY_SIZE];
+        uint8_t *vals[MAX_SCAN];
+        uint32_t lens[MAX_SCAN];
+        uint64_t start = next_id(bt);
+        int i, n = 1 + rng_next(&bt->rng) % MAX_SCAN;
+        for (i = 0; i < n; i++) {
+            make_key(kbufs[i], start + i);
+            springfield_key_init(&keys[i], kbufs[i]);
+        }
+        springfield_sharded_get_multi(db, keys, n, vals, lens);
+        for (i = 0; i < n; i++)
+            free(vals[i]);
+        break;
+    }
+    case OP_RMW:
+        make_key(key, next_id(bt));
+        p = springfield_sharded_get(db, key, &len);
+        if (!p)
+            bt->misses++;
+        free(p);
+        len = make_value(vbuf, &bt->rng);
+        springfield_sharded_set(db, key, vbuf, len);
+        break;
+    }
+}
+
+static void *run_thread(void *d) {
+    bench_thread *bt = (bench_thread *)d;
+    uint8_t *vbuf = malloc(cfg.value_max + 8);
+    uint64_t i;
+
+    for (i = 0; i < bt->ops; i++) {
+        int op = pick_op(bt);
+        uint64_t start = now_ns();
+        do_op(bt, op, vbuf);
+        springfield_histogram_record(&bt->hist[op], now_ns() - start);
+    }
+
+    free(vbuf);
+    return NULL;
+}
+
+static void *load_thread(void *d) {
+    bench_thread *bt = (bench_thread *)d;
+    uint8_t *vbuf = malloc(cfg.value_max + 8);
+    char key[KEY_SIZE];
+    uint64_t i;
+
+    for (i = bt->id; i < cfg.records; i += cfg.threads) {
+        uint32_t len = make_value(vbuf, &bt->rng);
+        make_key(key, i);
+        springfield_sharded_set(db, key, vbuf, len);
+    }
+
+    free(vbuf);
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: springfield_bench [options]\n"
+        "  --db PATH            database file (bench.db)\n"
+        "  --workload A-F       YCSB core workload (A)\n"
+        "  --records N          records to load (1000000)\n"
+        "  --ram-ratio R        size the load to R x physical memory\n"
+        "  --ops N              operations in the run phase (1000000)\n"
+        "  --threads N          worker threads (4)\n"
+        "  --dist D             uniform|zipfian|latest (per workload)\n"
+        "  --value-size N[-M]   value bytes, fixed or uniform in [N,M] (100)\n"
+        "  --buckets N          total bucket count for a new db (records / 4)\n"
+        "  --shards N           split the db across N files (1)\n"
+        "  --cache BYTES        options.cache_bytes\n"
+        "  --bloom BITS         options.bloom_bits_per_key\n"
+        "  --write-buffer BYTES options.write_buffer_bytes\n"
+        "  --pool BYTES         use the buffer pool backend, this big\n"
+        "  --direct-io          with --pool, read with O_DIRECT\n"
+        "  --verify-reads N     options.verify_reads\n"
+        "  --scrub BYTES        options.scrub_bytes_per_sec\n"
+        "  --autopilot SECS     options.autopilot, looking every SECS\n"
+        "  --reuse              skip the load phase; use the db as is\n");
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+    int i;
+    cfg.path = "bench.db";
+    cfg.workload = 'A';
+    cfg.records = 1000000;
+    cfg.ops = 1000000;
+    cfg.threads = 4;
+    cfg.shards = 1;
+    cfg.value_min = cfg.value_max = 100;
+    springfield_options_init(&cfg.opts);
+
+    for (i = 1; i < argc; i++) {
+        char *a = argv[i];
+        char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--reuse")) {
+            cfg.reuse = 1;
+            continue;
+        }
+        if (!strcmp(a, "--direct-io")) {
+            cfg.opts.direct_io = 1;
+            continue;
+        }
+        if (!v)
+            usage();
+        i++;
+        if (!strcmp(a, "--db")) {
+            cfg.path = v;
+        } else if (!strcmp(a, "--workload")) {
+            cfg.workload = v[0] & ~0x20;
+            if (cfg.workload < 'A' || cfg.workload > 'F')
+                usage();
+        } else if (!strcmp(a, "--records")) {
+            cfg.records = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--ram-ratio")) {
+            cfg.ram_ratio = atof(v);
+        } else if (!strcmp(a, "--ops")) {
+            cfg.ops = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--threads")) {
+            cfg.threads = atoi(v);
+        } else if (!strcmp(a, "--dist")) {
+            cfg.dist_set = 1;
+            if (!strcmp(v, "uniform"))
+                cfg.dist = DIST_UNIFORM;
+            else if (!strcmp(v, "zipfian"))
+                cfg.dist = DIST_ZIPFIAN;
+            else if (!strcmp(v, "latest"))
+                cfg.dist = DIST_LATEST;
+            else
+                usage();
+        } else if (!strcmp(a, "--value-size")) {
+            char *dash = strchr(v, '-');
+            cfg.value_min = cfg.value_max = atoi(v);
+            if (dash)
+                cfg.value_max = atoi(dash + 1);
+            if (cfg.value_max < cfg.value_min || !cfg.value_min)
+                usage();
+        } else if (!strcmp(a, "--buckets")) {
+            cfg.buckets = atoi(v);
+        } else if (!strcmp(a, "--shards")) {
+            cfg.shards = atoi(v);
+        } else if (!strcmp(a, "--cache")) {
+            cfg.opts.cache_bytes = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--bloom")) {
+            cfg.opts.bloom_bits_per_key = atoi(v);
+        } else if (!strcmp(a, "--write-buffer")) {
+            cfg.opts.write_buffer_bytes = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--pool")) {
+            cfg.opts.backend = SPRINGFIELD_BACKEND_POOL;
+            cfg.opts.pool_bytes = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--verify-reads")) {
+            cfg.opts.verify_reads = atoi(v);
+        } else if (!strcmp(a, "--scrub")) {
+            cfg.opts.scrub_bytes_per_sec = strtoull(v, NULL, 10);
+        } else if (!strcmp(a, "--autopilot")) {
+            cfg.opts.autopilot = 1;
+            cfg.opts.autopilot_interval = atoi(v);
+        } else {
+            usage();
+        }
+    }
+
+    if (cfg.threads < 1 || cfg.shards < 1)
+        usage();
+    if (!cfg.dist_set)
+        cfg.dist = cfg.workload == 'D' ? DIST_LATEST : DIST_ZIPFIAN;
+    if (cfg.ram_ratio > 0) {
+        double ram = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        double per = (cfg.value_min + cfg.value_max) / 2.0 + KEY_SIZE + 12;
+        cfg.records = (uint64_t)(cfg.ram_ratio * ram / per);
+    }
+    if (cfg.records < 1)
+        cfg.records = 1;
+    if (!cfg.buckets)
+        cfg.buckets = cfg.records / 4 > 1024 ? cfg.records / 4 : 1024;
+    /* --buckets is the total; each shard gets its share */
+    if (cfg.shards > 1)
+        cfg.buckets = cfg.buckets / cfg.shards > 1024 ? cfg.buckets / cfg.shards : 1024;
+}
+
+static void print_hist(const char *name, springfield_histogram_t *h, int *first) {
+    if (!h->count)
+        return;
+    printf("%s\n    \"%s\": {\"count\": %llu, \"avg_us\": %.3f, "
+        "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+        *first ? "" : ",", name,
+        (unsigned long long)h->count,
+        h->sum / 1000.0 / h->count,
+        springfield_histogram_percentile(h, 0.50) / 1000.0,
+        springfield_histogram_percentile(h, 0.99) / 1000.0,
+        springfield_histogram_percentile(h, 0.999) / 1000.0);
+    *first = 0;
+}
+
+int main(int argc, char **argv) {
+    double start, load_secs = 0, run_secs;
+    int i, j;
+
+    parse_args(argc, argv);
+
+    char **paths = calloc(cfg.shards, sizeof(char *));
+    for (i = 0; i < cfg.shards; i++) {
+        paths[i] = malloc(strlen(cfg.path) + 16);
+        if (cfg.shards == 1)
+            strcpy(paths[i], cfg.path);
+        else
+            sprintf(paths[i], "%s.%d", cfg.path, i);
+        if (!cfg.reuse) {
+            char manifest[1100];
+            snprintf(manifest, sizeof(manifest), "%s.shard", paths[i]);
+            unlink(paths[i]);
+            unlink(manifest);
+        }
+    }
+    db = springfield_sharded_create(paths, cfg.shards, cfg.buckets, &cfg.opts);
+    if (!db) {
+        fprintf(stderr, "%s: %s\n", cfg.path, errno == EINVAL ?
+            "shards were written with another --shards" : strerror(errno));
+        exit(1);
+    }
+
+    bench_thread *bts = calloc(cfg.threads, sizeof(bench_thread));
+    for (i = 0; i < cfg.threads; i++) {
+        bts[i].id = i;
+        bts[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+
+    if (!cfg.reuse) {
+        fprintf(stderr, "-- load %llu records --\n",
+            (unsigned long long)cfg.records);
+        start = doublenow();
+        for (i = 0; i < cfg.threads; i++)
+            pthread_create(&bts[i].t, NULL, load_thread, &bts[i]);
+        for (i = 0; i < cfg.threads; i++)
+            pthread_join(bts[i].t, NULL);
+        load_secs = doublenow() - start;
+        fprintf(stderr, "load took %.3f (%.3f/s)\n",
+            load_secs, cfg.records / load_secs);
+    }
+
+    insert_next = cfg.records;
+    zipfian_init(&zipf, cfg.records, ZIPF_THETA);
+
+    fprintf(stderr, "-- run workload %c, %llu ops --\n", cfg.workload,
+        (unsigned long long)cfg.ops);
+    for (i = 0; i < cfg.threads; i++) {
+        bts[i].ops = cfg.ops / cfg.threads +
+            (i < (int)(cfg.ops % cfg.threads));
+    }
+    start = doublenow();
+    for (i = 0; i < cfg.threads; i++)
+        pthread_create(&bts[i].t, NULL, run_thread, &bts[i]);
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(bts[i].t, NULL);
+    run_secs = doublenow() - start;
+
+    springfield_histogram_t total[OP_COUNT], all;
+    uint64_t misses = 0;
+    memset(total, 0, sizeof(total));
+    memset(&all, 0, sizeof(all));
+    for (i = 0; i < cfg.threads; i++) {
+        misses += bts[i].misses;
+        for (j = 0; j < OP_COUNT; j++) {
+            springfield_histogram_merge(&total[j], &bts[i].hist[j]);
+            springfield_histogram_merge(&all, &bts[i].hist[j]);
+        }
+    }
+
+    springfield_stats_t st;
+    double seeks = 0;
+    springfield_sharded_stats(db, &st);
+    for (i = 0; i < cfg.shards; i++)
+        seeks += springfield_seek_average(springfield_sharded_shard(db, i));
+
+    printf("{\n  \"workload\": \"%c\",\n  \"distribution\": \"%s\",\n"
+        "  \"threads\": %d,\n  \"shards\": %d,\n  \"backend\": \"%s\",\n"
+        "  \"records\": %llu,\n"
+        "  \"value_min\": %u,\n  \"value_max\": %u,\n"
+        "  \"db_bytes\": %llu,\n  \"load_seconds\": %.3f,\n"
+        "  \"run_seconds\": %.3f,\n  \"ops\": %llu,\n"
+        "  \"throughput\": %.1f,\n  \"read_misses\": %llu,\n"
+        "  \"seek_average\": %.3f,\n  \"latency\": {",
+        cfg.workload,
+        cfg.dist == DIST_UNIFORM ? "uniform" :
+            cfg.dist == DIST_LATEST ? "latest" : "zipfian",
+        cfg.threads, cfg.shards,
+        cfg.opts.backend == SPRINGFIELD_BACKEND_POOL ? "pool" : "mmap",
+        (unsigned long long)cfg.records,
+        cfg.value_min, cfg.value_max,
+        (unsigned long long)st.eof, load_secs, run_secs,
+        (unsigned long long)all.count, all.count / run_secs,
+        (unsigned long long)misses, seeks / cfg.shards);
+    int first = 1;
+    print_hist("all", &all, &first);
+    for (j = 0; j < OP_COUNT; j++)
+        print_hist(op_names[j], &total[j], &first);
+    printf("\n  }\n}\n");
+
+    springfield_sharded_close(db);
+    for (i = 0; i < cfg.shards; i++)
+        free(paths[i]);
+    free(paths);
+    free(bts);
+
+    return 0;
+}
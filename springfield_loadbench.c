@@ -0,0 +1,278 @@
+/* Startup and recovery benchmark.
+
+   Generates a db with `--keys` live keys, padded out with
+   overwrites until `--garbage` of its records are dead, then
+   times springfield_create() on copies of it:
+
+     clean      the db as written
+     truncated  the last record torn in half
+     badcrc     a record `--corrupt-at` of the way in failing
+                its CRC (load keeps only what precedes it)
+     indexed    the db with the index file close wrote for it
+                (options.trusted_open), so load needn't scan
+
+   each both cold (the copy fsync'd and dropped from the page
+   cache with posix_fadvise(DONTNEED)) and warm (straight after
+   writing the copy).  Prints one JSON object per line.
+
+   Records vary in length (v2 lengths are varints), so
+   badcrc flips a byte at that fraction of the file instead of
+   at a record boundary: whichever record holds it then fails
+   its CRC or no longer decodes, and load stops there. */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "springfield.h"
+
+#define KEY_FMT "key%015llu"
+
+typedef struct load_config {
+    char *dir;
+    uint64_t keys;
+    double garbage;
+    uint32_t value_size;
+    uint32_t buckets;
+    double corrupt_at;
+    int runs;
+} load_config;
+
+static load_config cfg;
+static uint64_t total_records;
+static uint64_t clean_eof;
+
+double doublenow() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return (double)tv.tv_sec
+        + (((double)tv.tv_usec) / 1000000.0);
+}
+
+static void db_path(char *buf, size_t len, const char *name) {
+    snprintf(buf, len, "%s/%s", cfg.dir, name);
+}
+
+static void generate(void) {
+    char path[1024], key[32];
+    uint8_t *val = calloc(1, cfg.value_size);
+    uint64_t i, x = 88172645463325252ULL;
+
+    db_path(path, sizeof(path), "loadbench_base.db");
+    unlink(path);
+    springfield_options_t opts;
+    springfield_options_init(&opts);
+    opts.trusted_open = 1;
+    springfield_t *db = springfield_create_opts(path, cfg.buckets, &opts);
+
+    total_records = (uint64_t)(cfg.keys / (1.0 - cfg.garbage));
+    for (i = 0; i < total_records; i++) {
+        uint64_t id = i;
+        if (i >= cfg.keys) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            id = x % cfg.keys;
+        }
+        snprintf(key, sizeof(key), KEY_FMT, (unsigned long long)id);
+        memcpy(val, &i, cfg.value_size < 8 ? cfg.value_size : 8);
+        springfield_set(db, key, val, cfg.value_size);
+    }
+
+    springfield_stats_t st;
+    springfield_stats(db, &st);
+    clean_eof = st.eof;
+
+    springfield_sync(db);
+    springfield_close(db);
+    free(val);
+}
+
+static void copy_file(const char *from, const char *to) {
+    static char buf[1 << 20];
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    ssize_t n;
+    assert(in > -1 && out > -1);
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        ssize_t w = write(out, buf, n);
+        assert(w == n);
+    }
+    close(in);
+    close(out);
+}
+
+/* Copy the base db to `path` and damage it per `scenario` */
+static void prepare(const char *scenario, const char *path) {
+    char base[1024], idx[1100], base_idx[1100];
+    db_path(base, sizeof(base), "loadbench_base.db");
+    copy_file(base, path);
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    snprintf(base_idx, sizeof(base_idx), "%s.idx", base);
+    if (!strcmp(scenario, "indexed"))
+        copy_file(base_idx, idx);
+    else
+        unlink(idx);
+
+    if (!strcmp(scenario, "truncated")) {
+        /* Tear the last record inside its value */
+        int s = truncate(path, (off_t)(clean_eof - cfg.value_size / 2 - 1));
+        assert(!s);
+    } else if (!strcmp(scenario, "badcrc")) {
+        int fd = open(path, O_RDWR);
+        uint8_t b;
+        off_t off = (off_t)(4 + cfg.corrupt_at * (clean_eof - 5));
+        assert(fd > -1);
+        ssize_t n = pread(fd, &b, 1, off);
+        assert(n == 1);
+        b ^= 0xff;
+        n = pwrite(fd, &b, 1, off);
+        assert(n == 1);
+        close(fd);
+    }
+}
+
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    assert(fd > -1);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void run(const char *scenario, int cold) {
+    char path[1024];
+    double best = 1e30, sum = 0;
+    uint64_t eof = 0;
+    int i;
+
+    db_path(path, sizeof(path), "loadbench_run.db");
+    for (i = 0; i < cfg.runs; i++) {
+        prepare(scenario, path);
+        if (cold) {
+            char idx[1100];
+            snprintf(idx, sizeof(idx), "%s.idx", path);
+            drop_cache(path);
+            if (!access(idx, F_OK))
+                drop_cache(idx);
+        }
+
+        /* open only takes an index file when told to trust it */
+        springfield_options_t opts;
+        springfield_options_init(&opts);
+        opts.trusted_open = !strcmp(scenario, "indexed");
+
+        double start = doublenow();
+        springfield_t *db = springfield_create_opts(path, cfg.buckets, &opts);
+        double took = doublenow() - start;
+
+        springfield_stats_t st;
+        springfield_stats(db, &st);
+        eof = st.eof;
+        springfield_close(db);
+
+        sum += took;
+        if (took < best)
+            best = took;
+    }
+    unlink(path);
+    strcat(path, ".idx");
+    unlink(path);
+
+    printf("{\"scenario\": \"%s\", \"cache\": \"%s\", \"keys\": %llu, "
+        "\"records\": %llu, \"bytes\": %llu, \"garbage\": %.2f, "
+        "\"runs\": %d, \"min_ms\": %.3f, \"avg_ms\": %.3f, "
+        "\"recovered_bytes\": %llu}\n",
+        scenario, cold ? "cold" : "warm",
+        (unsigned long long)cfg.keys, (unsigned long long)total_records,
+        (unsigned long long)clean_eof, cfg.garbage, cfg.runs,
+        best * 1000, sum * 1000 / cfg.runs, (unsigned long long)eof);
+    fflush(stdout);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: springfield_loadbench [options]\n"
+        "  --dir DIR           where to put the dbs (.)\n"
+        "  --keys N            live keys (1000000)\n"
+        "  --size BYTES        derive --keys from a target file size\n"
+        "  --garbage R         fraction of dead records, 0-0.95 (0)\n"
+        "  --value-size N      value bytes (100)\n"
+        "  --buckets N         bucket count (keys / 4)\n"
+        "  --corrupt-at R      badcrc position, 0-1 (0.9)\n"
+        "  --runs N            opens per scenario (3)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t size = 0;
+    int i;
+
+    cfg.dir = ".";
+    cfg.keys = 1000000;
+    cfg.value_size = 100;
+    cfg.corrupt_at = 0.9;
+    cfg.runs = 3;
+
+    for (i = 1; i < argc; i += 2) {
+        char *a = argv[i], *v = argv[i + 1];
+        if (!v)
+            usage();
+        if (!strcmp(a, "--dir"))
+            cfg.dir = v;
+        else if (!strcmp(a, "--keys"))
+            cfg.keys = strtoull(v, NULL, 10);
+        else if (!strcmp(a, "--size"))
+            size = strtoull(v, NULL, 10);
+        else if (!strcmp(a, "--garbage"))
+            cfg.garbage = atof(v);
+        else if (!strcmp(a, "--value-size"))
+            cfg.value_size = atoi(v);
+        else if (!strcmp(a, "--buckets"))
+            cfg.buckets = atoi(v);
+        else if (!strcmp(a, "--corrupt-at"))
+            cfg.corrupt_at = atof(v);
+        else if (!strcmp(a, "--runs"))
+            cfg.runs = atoi(v);
+        else
+            usage();
+    }
+    if (cfg.garbage < 0 || cfg.garbage > 0.95 || cfg.runs < 1 ||
+            cfg.corrupt_at < 0 || cfg.corrupt_at > 1)
+        usage();
+    if (size) {
+        /* 12 byte v2 header + key + NUL + value */
+        uint64_t per = 12 + 19 + cfg.value_size;
+        cfg.keys = (uint64_t)(size / per * (1.0 - cfg.garbage));
+    }
+    if (cfg.keys < 1)
+        usage();
+    if (!cfg.buckets)
+        cfg.buckets = cfg.keys / 4 > 1024 ? cfg.keys / 4 : 1024;
+
+    fprintf(stderr, "-- generate --\n");
+    double start = doublenow();
+    generate();
+    fprintf(stderr, "generate took %.3f (%llu records, %llu bytes)\n",
+        doublenow() - start, (unsigned long long)total_records,
+        (unsigned long long)clean_eof);
+
+    const char *scenarios[] = {"clean", "truncated", "badcrc", "indexed"};
+    for (i = 0; i < 4; i++) {
+        run(scenarios[i], 1);
+        run(scenarios[i], 0);
+    }
+
+    char base[1024];
+    db_path(base, sizeof(base), "loadbench_base.db");
+    unlink(base);
+    strcat(base, ".idx");
+    unlink(base);
+
+    return 0;
+}
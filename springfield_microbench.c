@@ -0,0 +1,386 @@
+/* Microbenchmarks for the hot-path primitives.
+
+   This includes springfield.c directly so the static internals
+   (hash, crc32, index lookup, chain walk, record serialization,
+   grow) can be timed in isolation, single-threaded and without
+   locks.  Each benchmark runs several trials and keeps the best.
+
+     springfield_microbench [--dir DIR] [--save FILE]
+                            [--baseline FILE] [--threshold PCT]
+
+   --save writes "name ns/op" lines; --baseline compares against
+   such a file, flags anything more than --threshold percent (10)
+   slower and exits non-zero if anything was flagged. */
+#include "springfield.c"
+
+#include <sys/time.h>
+
+#define TRIALS 7
+#define MAX_BENCHES 32
+#define LOOKUP_KEYS 4096
+#define CHAIN_BUCKETS 1024
+#define SERIALIZE_RECORDS 100000
+#define GROW_FILL (16 * 1024 * 1024)
+#define MULTI_BATCH 64
+
+typedef struct microbench {
+    const char *name;
+    uint64_t iters;
+    uint64_t bytes_per_op;
+    void (*setup)(struct microbench *b);
+    void (*run)(struct microbench *b, uint64_t iters);
+    springfield_t *db;
+    uint32_t len;
+    uint32_t chain;
+    uint32_t buckets;
+    double ns_per_op;
+    double cycles_per_op;
+} microbench;
+
+static char *bench_dir = ".";
+static uint8_t buf[64 * 1024 + 64];
+static char keybufs[LOOKUP_KEYS][32];
+static springfield_key_t keys[LOOKUP_KEYS];
+static springfield_staged_t staged[LOOKUP_KEYS];
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static springfield_t * fresh_db(const char *name, uint32_t buckets) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, name);
+    unlink(path);
+    return springfield_create(path, buckets);
+}
+
+static void drop_db(springfield_t *r) {
+    unlink(r->path);
+    springfield_close(r);
+}
+
+static void make_keys(const char *prefix) {
+    int i;
+    for (i = 0; i < LOOKUP_KEYS; i++) {
+        snprintf(keybufs[i], sizeof(keybufs[i]), "%s%08d", prefix, i);
+        springfield_key_init(&keys[i], keybufs[i]);
+    }
+}
+
+/* -- benchmarks -- */
+
+static void run_hash(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    for (i = 0; i < iters; i++)
+        acc += jenkins_one_at_a_time_hash((char *)buf + (i & 63), b->len);
+    sink = acc;
+}
+
+static void run_crc32(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    for (i = 0; i < iters; i++)
+        acc += crc32(0, buf + (i & 63), b->len);
+    sink = acc;
+}
+
+static void setup_index(microbench *b) {
+    if (!b->db) {
+        b->db = fresh_db("microbench_index.db", 1 << 22);
+        make_keys("index-key-");
+    }
+}
+
+static void run_index(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    for (i = 0; i < iters; i++)
+        acc += springfield_index_lookup(b->db, &keys[i % LOOKUP_KEYS]);
+    sink = acc;
+}
+
+/* `buckets` (CHAIN_BUCKETS) buckets holding `chain` records each
+   on average; looking up absent keys (no Bloom filter) walks
+   whole chains */
+static void setup_chain(microbench *b) {
+    if (!b->db) {
+        char name[64], k[32];
+        uint32_t i, buckets = b->buckets ? b->buckets : CHAIN_BUCKETS;
+        snprintf(name, sizeof(name), "microbench_chain%u_%u.db", b->chain, buckets);
+        b->db = fresh_db(name, buckets);
+        for (i = 0; i < buckets * b->chain; i++) {
+            springfield_key_t sk;
+            snprintf(k, sizeof(k), "chain-key-%u", i);
+            springfield_key_init(&sk, k);
+            springfield_set_i(b->db, &sk, buf, 8, NULL);
+        }
+        make_keys("absent-key-");
+    }
+}
+
+static void run_chain(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    uint32_t len;
+    for (i = 0; i < iters; i++)
+        acc += (uint64_t)springfield_get_i(b->db, &keys[i % LOOKUP_KEYS], &len, NULL);
+    sink = acc;
+}
+
+/* The same walks, MULTI_BATCH keys at a time through get_multi's
+   interleaved walker */
+static void run_multi(microbench *b, uint64_t iters) {
+    uint8_t *vals[MULTI_BATCH];
+    uint32_t lens[MULTI_BATCH];
+    uint64_t i;
+    for (i = 0; i < iters; i += MULTI_BATCH)
+        springfield_get_multi_i(b->db, &keys[i % LOOKUP_KEYS], MULTI_BATCH,
+            vals, lens);
+    sink = (uint64_t)vals[0];
+}
+
+/* Rewind to an empty but already-grown db, so only what a set
+   does under the write lock is timed: header building, copying,
+   the header's crc and linking.  The staging set_k does first is
+   timed separately by stage/. */
+static void setup_serialize(microbench *b) {
+    int i;
+    if (!b->db) {
+        b->db = fresh_db("microbench_serialize.db", CHAIN_BUCKETS);
+        springfield_grow(b->db,
+            b->iters * (HEADER_MAX_SIZE + 32 + b->len));
+        make_keys("set-key-");
+        for (i = 0; i < LOOKUP_KEYS; i++)
+            springfield_stage(b->db, &keys[i], buf, b->len, &staged[i]);
+    }
+    b->db->eof = 4;
+    memset(b->db->offsets, 0xff, CHAIN_BUCKETS * sizeof(uint64_t));
+}
+
+static void run_serialize(microbench *b, uint64_t iters) {
+    uint64_t i;
+    for (i = 0; i < iters; i++)
+        springfield_set_i(b->db, &keys[i % LOOKUP_KEYS], buf, b->len,
+            &staged[i % LOOKUP_KEYS]);
+}
+
+static void setup_stage(microbench *b) {
+    if (!b->db) {
+        b->db = fresh_db("microbench_stage.db", CHAIN_BUCKETS);
+        make_keys("set-key-");
+    }
+}
+
+static void run_stage(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    springfield_staged_t st;
+    for (i = 0; i < iters; i++) {
+        springfield_stage(b->db, &keys[i % LOOKUP_KEYS], buf + (i & 63), b->len, &st);
+        acc += st.crc;
+    }
+    sink = acc;
+}
+
+static void run_combine(microbench *b, uint64_t iters) {
+    uint64_t i, acc = 0;
+    for (i = 0; i < iters; i++)
+        acc += crc32_combine((uint32_t)i, (uint32_t)acc, b->len + (i & 63));
+    sink = acc;
+}
+
+/* A db with GROW_FILL dirty bytes appended, about to grow */
+static void setup_grow(microbench *b) {
+    if (b->db)
+        drop_db(b->db);
+    b->db = fresh_db("microbench_grow.db", CHAIN_BUCKETS);
+    make_keys("grow-key-");
+    uint64_t i = 0;
+    while (b->db->eof < GROW_FILL)
+        springfield_set_i(b->db, &keys[i++ % LOOKUP_KEYS], buf, 4096, NULL);
+}
+
+static void run_grow(microbench *b, uint64_t iters) {
+    assert(iters == 1);
+    springfield_grow(b->db, HEADER_MAX_SIZE + 32 + 8);
+}
+
+/* -- runner -- */
+
+static microbench benches[MAX_BENCHES];
+static int num_benches;
+
+static microbench * add(const char *name, uint64_t iters,
+        void (*setup)(microbench *), void (*run)(microbench *, uint64_t)) {
+    microbench *b = &benches[num_benches++];
+    assert(num_benches <= MAX_BENCHES);
+    b->name = name;
+    b->iters = iters;
+    b->setup = setup;
+    b->run = run;
+    return b;
+}
+
+static void measure(microbench *b) {
+    int t;
+    b->ns_per_op = 1e30;
+    for (t = 0; t < TRIALS; t++) {
+        if (b->setup)
+            b->setup(b);
+        uint64_t c0 = cycles(), t0 = now_ns();
+        b->run(b, b->iters);
+        uint64_t t1 = now_ns(), c1 = cycles();
+        double ns = (double)(t1 - t0) / b->iters;
+        if (ns < b->ns_per_op) {
+            b->ns_per_op = ns;
+            b->cycles_per_op = (double)(c1 - c0) / b->iters;
+        }
+    }
+    if (b->db) {
+        drop_db(b->db);
+        b->db = NULL;
+    }
+}
+
+static double baseline_for(FILE *f, const char *name) {
+    char line[256], bname[128];
+    double ns;
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%127s %lf", bname, &ns) == 2 && !strcmp(bname, name))
+            return ns;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *save = NULL, *baseline = NULL;
+    double threshold = 10;
+    int i, regressions = 0;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--dir"))
+            bench_dir = argv[i + 1];
+        else if (!strcmp(argv[i], "--save"))
+            save = argv[i + 1];
+        else if (!strcmp(argv[i], "--baseline"))
+            baseline = argv[i + 1];
+        else if (!strcmp(argv[i], "--threshold"))
+            threshold = atof(argv[i + 1]);
+        else
+            break;
+    }
+    if (i != argc) {
+        fprintf(stderr, "usage: springfield_microbench [--dir DIR] "
+            "[--save FILE] [--baseline FILE] [--threshold PCT]\n");
+        return 2;
+    }
+
+    for (i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = 'a' + i % 26;
+
+    microbench *b;
+    b = add("hash/16B", 10000000, NULL, run_hash);
+    b->len = b->bytes_per_op = 16;
+    b = add("hash/64B", 5000000, NULL, run_hash);
+    b->len = b->bytes_per_op = 64;
+    b = add("crc32/64B", 5000000, NULL, run_crc32);
+    b->len = b->bytes_per_op = 64;
+    b = add("crc32/4KB", 100000, NULL, run_crc32);
+    b->len = b->bytes_per_op = 4096;
+    add("index_lookup", 10000000, setup_index, run_index);
+    b = add("chain_walk/1", 2000000, setup_chain, run_chain);
+    b->chain = 1;
+    b = add("chain_walk/4", 1000000, setup_chain, run_chain);
+    b->chain = 4;
+    b = add("chain_walk/16", 300000, setup_chain, run_chain);
+    b->chain = 16;
+    b = add("chain_walk/64", 100000, setup_chain, run_chain);
+    b->chain = 64;
+    b = add("multi_walk/16", 300000 / MULTI_BATCH * MULTI_BATCH, setup_chain, run_multi);
+    b->chain = 16;
+    b = add("multi_walk/64", 100000 / MULTI_BATCH * MULTI_BATCH, setup_chain, run_multi);
+    b->chain = 64;
+    /* 2M records, well past the LLC */
+    b = add("chain_walk/8x256K", 100000, setup_chain, run_chain);
+    b->chain = 8;
+    b->buckets = 1 << 18;
+    b = add("multi_walk/8x256K", 100000 / MULTI_BATCH * MULTI_BATCH, setup_chain, run_multi);
+    b->chain = 8;
+    b->buckets = 1 << 18;
+    b = add("serialize/8B", SERIALIZE_RECORDS, setup_serialize, run_serialize);
+    b->len = 8;
+    b->bytes_per_op = 8;
+    b = add("serialize/1KB", SERIALIZE_RECORDS, setup_serialize, run_serialize);
+    b->len = 1024;
+    b->bytes_per_op = 1024;
+    b = add("serialize/64KB", 2000, setup_serialize, run_serialize);
+    b->len = 65536;
+    b->bytes_per_op = 65536;
+    b = add("stage/1KB", 200000, setup_stage, run_stage);
+    b->len = b->bytes_per_op = 1024;
+    b = add("crc32_combine/1KB", 1000000, NULL, run_combine);
+    b->len = 1024;
+    add("grow/16MB", 1, setup_grow, run_grow);
+
+    FILE *bf = NULL;
+    if (baseline) {
+        bf = fopen(baseline, "r");
+        if (!bf) {
+            perror(baseline);
+            return 2;
+        }
+    }
+
+    printf("%-18s %14s %12s %12s %10s\n",
+        "benchmark", "ns/op", "cycles/op", "MB/s", "vs base");
+    for (i = 0; i < num_benches; i++) {
+        b = &benches[i];
+        measure(b);
+
+        char mbs[32] = "-", delta[32] = "";
+        if (b->bytes_per_op)
+            snprintf(mbs, sizeof(mbs), "%.1f",
+                b->bytes_per_op * 1000.0 / b->ns_per_op);
+        if (bf) {
+            double base = baseline_for(bf, b->name);
+            if (base > 0) {
+                double pct = (b->ns_per_op - base) * 100.0 / base;
+                int slow = pct > threshold;
+                snprintf(delta, sizeof(delta), "%+.1f%%%s", pct,
+                    slow ? " SLOWER" : "");
+                regressions += slow;
+            }
+        }
+        printf("%-18s %14.2f %12.1f %12s %10s\n", b->name,
+            b->ns_per_op, b->cycles_per_op, mbs, delta);
+    }
+
+    if (bf)
+        fclose(bf);
+
+    if (save) {
+        FILE *f = fopen(save, "w");
+        if (!f) {
+            perror(save);
+            return 2;
+        }
+        for (i = 0; i < num_benches; i++)
+            fprintf(f, "%s %.3f\n", benches[i].name, benches[i].ns_per_op);
+        fclose(f);
+    }
+
+    if (regressions) {
+        printf("%d benchmark(s) more than %.0f%% slower than baseline\n",
+            regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -1,123 +1,1232 @@
+/* Functional tests.
+
+   Each feature gets a round trip, then the same checks after a
+   reopen and after a compaction, on both backends.  Everything
+   lives in a fresh directory under /tmp, removed at the end.  The
+   first failed check aborts (via assert), so a clean exit means
+   every test passed. */
 #include <assert.h>
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "springfield.h"
 
-#define COUNT 1000000
-#define DCOUNT ((double)COUNT)
-#define BUCKETS (1024 * 120)
+static char dir[64];
+static int backend;
 
-double doublenow() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+static void path_of(char *buf, size_t len, const char *name) {
+    snprintf(buf, len, "%s/%s-%s", dir, backend ? "pool" : "mmap", name);
+}
 
-    return (double)tv.tv_sec
-        + (((double)tv.tv_usec) / 1000000.0);
+static void options(springfield_options_t *o) {
+    springfield_options_init(o);
+    o->backend = backend;
+    o->pool_bytes = 1 << 20;
 }
 
-void *do_compact(void *d) {
-    double start, final;
+static void put(springfield_t *r, char *key, const char *val) {
+    springfield_set(r, key, (uint8_t *)val, strlen(val));
+}
 
-    while (1) {
-        springfield_t *db = (springfield_t *)d;
+/* `key` holds `want` (NULL: nothing) */
+static void check(springfield_t *r, char *key, const char *want) {
+    uint32_t len;
+    uint8_t *val = springfield_get(r, key, &len);
+    if (!want) {
+        assert(!val);
+        return;
+    }
+    assert(val && len == strlen(want) && !memcmp(val, want, len));
+    free(val);
+}
+
+static springfield_t * reopen(springfield_t *r, char *path,
+        springfield_options_t *o) {
+    springfield_close(r);
+    return springfield_create_opts(path, 0, o);
+}
 
-        printf("-- start compact --\n");
-        /* Online compact */
-        start = doublenow();
-        springfield_compact(db, BUCKETS * 4);
-        final = doublenow();
-        printf("compact took %.3f (%.3f/s)\n",
-        final - start, DCOUNT / (final - start));
+static springfield_stats_t stats(springfield_t *r) {
+    springfield_stats_t st;
+    springfield_stats(r, &st);
+    return st;
+}
+
+/* -- plain sets, deletes and iteration -- */
+
+#define BASIC_KEYS 2000
+
+static void basic_check(springfield_t *r) {
+    char key[32], val[32];
+    int i;
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "%s-%d", i % 2 ? "new" : "old", i);
+        check(r, key, i % 3 == 0 ? NULL : val);
     }
+    check(r, "never", NULL);
+}
 
-    return NULL;
+static void count_cb(springfield_t *r, char *key, void *passthrough) {
+    ++*(int *)passthrough;
 }
 
-int main() {
-    double start;
-    printf("-- load --\n");
-    start = doublenow();
-    springfield_t *db = springfield_create("db", BUCKETS);
-    printf("load took %.3f\n",
-    doublenow() - start);
-
-    pthread_t t;
-    pthread_create(&t, NULL, do_compact, db);
-
-
-    while (1) {
-        int i;
-        char buf2[8] = {0};
-        printf("-- write --\n");
-
-        start = doublenow();
-        for (i=0; i < COUNT; i++) {
-            snprintf(buf2, 8, "%d", i % 2 ? i : 4);
-            springfield_set(db, buf2, (uint8_t *)buf2, 8);
+static void test_basic(void) {
+    char path[128], key[32], val[32];
+    springfield_options_t o;
+    int i, n = 0;
+    options(&o);
+    path_of(path, sizeof(path), "basic.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "old-%d", i);
+        put(r, key, val);
+    }
+    for (i = 1; i < BASIC_KEYS; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "new-%d", i);
+        put(r, key, val);
+    }
+    for (i = 0; i < BASIC_KEYS; i += 3) {
+        snprintf(key, sizeof(key), "key%d", i);
+        springfield_del(r, key);
+    }
+    springfield_del(r, "never");
+    basic_check(r);
+    springfield_iter(r, count_cb, &n);
+    assert(n == BASIC_KEYS - (BASIC_KEYS + 2) / 3);
+
+    r = reopen(r, path, &o);
+    basic_check(r);
+    springfield_compact(r, 1024);
+    assert(springfield_bucket_count(r) == 1024);
+    basic_check(r);
+    r = reopen(r, path, &o);
+    basic_check(r);
+    assert(stats(r).num_buckets == 1024);
+    springfield_close(r);
+}
+
+/* -- prepared keys, get_multi and del_many -- */
+
+static void test_prepared_keys(void) {
+    char path[128], names[100][16];
+    springfield_key_t keys[100];
+    uint8_t *vals[100];
+    uint32_t lens[100], len;
+    springfield_options_t o;
+    int i;
+    options(&o);
+    path_of(path, sizeof(path), "keys.db");
+    springfield_t *r = springfield_create_opts(path, 16, &o);
+    for (i = 0; i < 100; i++) {
+        snprintf(names[i], sizeof(names[i]), "k%d", i);
+        if (i % 2)
+            springfield_key_init(&keys[i], names[i]);
+        else
+            springfield_key_init_hashed(&keys[i], names[i],
+                springfield_hash(names[i]));
+        assert(keys[i].klen == strlen(names[i]) + 1);
+        springfield_set_k(r, &keys[i], (uint8_t *)names[i], keys[i].klen);
+    }
+    for (i = 0; i < 100; i += 4)
+        springfield_del_k(r, &keys[i]);
+    assert(springfield_del_many(r, keys + 1, 2) == 2);
+
+    int round;
+    for (round = 0; round < 3; round++) {
+        springfield_get_multi(r, keys, 100, vals, lens);
+        for (i = 0; i < 100; i++) {
+            int gone = i % 4 == 0 || i == 1 || i == 2;
+            assert(gone ? !vals[i] : vals[i] && lens[i] == keys[i].klen &&
+                !strcmp((char *)vals[i], names[i]));
+            free(vals[i]);
+        }
+        uint8_t *val = springfield_get_k(r, &keys[5], &len);
+        assert(val && !strcmp((char *)val, "k5"));
+        free(val);
+        if (round == 0)
+            r = reopen(r, path, &o);
+        else if (round == 1)
+            springfield_compact(r, 0);
+    }
+    springfield_close(r);
+}
+
+/* -- value cache -- */
+
+static void test_cache(void) {
+    char path[128];
+    springfield_options_t o;
+    options(&o);
+    o.cache_bytes = 1 << 20;
+    path_of(path, sizeof(path), "cache.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    put(r, "a", "one");
+    check(r, "a", "one");
+    check(r, "a", "one");
+    assert(stats(r).cache_hits >= 1);
+    put(r, "a", "two");
+    check(r, "a", "two");
+    springfield_del(r, "a");
+    check(r, "a", NULL);
+    put(r, "a", "three");
+    check(r, "a", "three");
+    springfield_compact(r, 0);
+    check(r, "a", "three");
+    put(r, "a", "four");
+    check(r, "a", "four");
+    r = reopen(r, path, &o);
+    check(r, "a", "four");
+    check(r, "a", "four");
+    assert(stats(r).cache_hits >= 1);
+    springfield_close(r);
+}
+
+/* -- Bloom filter -- */
+
+#define BLOOM_KEYS 5000
+
+static void bloom_check(springfield_t *r) {
+    char key[32];
+    int i;
+    uint64_t before = stats(r).bloom_negatives;
+    for (i = 0; i < BLOOM_KEYS; i++) {
+        snprintf(key, sizeof(key), "in%d", i);
+        check(r, key, i % 10 ? key : NULL);
+        snprintf(key, sizeof(key), "out%d", i);
+        check(r, key, NULL);
+    }
+    /* the deleted tenth may or may not be ruled out */
+    assert(stats(r).bloom_negatives - before > BLOOM_KEYS * 9 / 10);
+}
+
+static void test_bloom(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.bloom_bits_per_key = 10;
+    path_of(path, sizeof(path), "bloom.db");
+    /* far fewer buckets than keys: the filter has to grow */
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < BLOOM_KEYS; i++) {
+        snprintf(key, sizeof(key), "in%d", i);
+        put(r, key, key);
+        put(r, key, key);
+    }
+    for (i = 0; i < BLOOM_KEYS; i += 10) {
+        snprintf(key, sizeof(key), "in%d", i);
+        springfield_del(r, key);
+    }
+    bloom_check(r);
+    r = reopen(r, path, &o);
+    bloom_check(r);
+    springfield_compact(r, 4096);
+    bloom_check(r);
+    springfield_close(r);
+}
+
+/* -- mapping policy, warmup and residency -- */
+
+static void warm_check(springfield_t *r) {
+    char key[32];
+    int i;
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "warm%d", i);
+        check(r, key, key);
+    }
+}
+
+static void test_warmup(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.warmup = SPRINGFIELD_WARMUP_POPULATE;
+    o.map_advice = SPRINGFIELD_ADVICE_NORMAL;
+    o.index_hugepages = 1;
+    path_of(path, sizeof(path), "warm.db");
+    springfield_t *r = springfield_create_opts(path, 256, &o);
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "warm%d", i);
+        put(r, key, key);
+    }
+    springfield_warmup(r);
+    assert(springfield_residency(r) > 0.99);
+    warm_check(r);
+
+    o.warmup = SPRINGFIELD_WARMUP_BACKGROUND;
+    o.map_advice = SPRINGFIELD_ADVICE_SEQUENTIAL;
+    o.index_mlock = 1;
+    r = reopen(r, path, &o);
+    double res = springfield_residency(r);
+    assert(res >= 0 && res <= 1);
+    warm_check(r);
+    springfield_warmup(r);
+    assert(springfield_residency(r) > 0.99);
+
+    springfield_compact(r, 512);
+    warm_check(r);
+    springfield_warmup(r);
+    assert(springfield_residency(r) > 0.99);
+    springfield_close(r);
+}
+
+/* -- latency histograms and counters -- */
+
+static void test_histogram(void) {
+    springfield_histogram_t a, b;
+    uint64_t v;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    assert(springfield_histogram_percentile(&a, 0.5) == 0);
+    for (v = 1; v <= 1000; v++)
+        springfield_histogram_record(&a, v);
+    assert(a.count == 1000 && a.sum == 500500);
+    /* four buckets per power of two: within 19% above */
+    uint64_t p50 = springfield_histogram_percentile(&a, 0.5);
+    uint64_t p99 = springfield_histogram_percentile(&a, 0.99);
+    assert(p50 >= 500 && p50 <= 500 * 1.19);
+    assert(p99 >= 990 && p99 <= 990 * 1.19);
+    assert(springfield_histogram_percentile(&a, 1) >= 1000);
+
+    for (v = 0; v < 1000; v++)
+        springfield_histogram_record(&b, 1000000);
+    springfield_histogram_merge(&b, &a);
+    assert(b.count == 2000);
+    assert(springfield_histogram_percentile(&b, 0.25) <= 500 * 1.19);
+    assert(springfield_histogram_percentile(&b, 0.75) >= 1000000);
+}
+
+static void test_stats(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    springfield_stats_t st;
+    uint32_t len;
+    int i, round;
+    options(&o);
+    o.latency_stats = 1;
+    path_of(path, sizeof(path), "stats.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "s%d", i);
+            put(r, key, key);
         }
-        double final;
-        final = doublenow();
-        printf("write took %.3f (%.3f/s)\n",
-        final - start, DCOUNT / (final - start));
-        sleep(3);
-
-        printf("-- read --\n");
-        uint32_t sz;
-        start = doublenow();
-        for (i=0; i < COUNT; i++) {
-            snprintf(buf2, 8, "%d", i % 2 ? i : 4);
-            char *p = (char *)springfield_get(db, buf2, &sz);
-            assert(p && !strcmp(buf2, p));
-            free(p);
-            if (i % 100000 == 0) {
-                printf("%d\n", i);
-                printf("current seek average: %.1f\n",
-                springfield_seek_average(db));
-            }
+        for (i = 0; i < 200; i++) {
+            snprintf(key, sizeof(key), "s%d", i);
+            free(springfield_get(r, key, &len));
         }
-        final = doublenow();
-        printf("read took %.3f (%.3f/s)\n",
-        final - start, DCOUNT / (final - start));
-        sleep(3);
-
-
-        printf("-- read --\n");
-        start = doublenow();
-        for (i=0; i < COUNT; i++) {
-            snprintf(buf2, 8, "%d", i % 2 ? i : 4);
-            char *p = (char *)springfield_get(db, buf2, &sz);
-            assert(p && !strcmp(buf2, p));
-            free(p);
-            if (i % 100000 == 0) {
-                printf("%d\n", i);
-                printf("current seek average: %.1f\n",
-                springfield_seek_average(db));
-            }
+        for (i = 0; i < 10; i++) {
+            snprintf(key, sizeof(key), "s%d", i);
+            springfield_del(r, key);
         }
-        final = doublenow();
-        printf("read took %.3f (%.3f/s)\n",
-        final - start, DCOUNT / (final - start));
-        sleep(3);
+        springfield_sync(r);
 
+        springfield_stats(r, &st);
+        assert(st.sets == 100 && st.gets == 200 && st.get_hits == 100);
+        assert(st.dels == 10);
+        assert(st.ops[SPRINGFIELD_OP_SET].count == 100);
+        assert(st.ops[SPRINGFIELD_OP_GET].count == 200);
+        assert(st.ops[SPRINGFIELD_OP_DEL].count == 10);
+        assert(st.ops[SPRINGFIELD_OP_SYNC].count == 1);
+        assert(st.ops[SPRINGFIELD_OP_GET].sum > 0);
+        assert(springfield_histogram_percentile(&st.ops[SPRINGFIELD_OP_GET], 0.5) <=
+            springfield_histogram_percentile(&st.ops[SPRINGFIELD_OP_GET], 0.99));
+        assert(st.lock_waits[SPRINGFIELD_LOCK_MAIN_READ].count >= 200);
+        assert(st.lock_waits[SPRINGFIELD_LOCK_MAIN_WRITE].count >= 110);
+        uint64_t walks = 0;
+        for (i = 0; i < SPRINGFIELD_CHAIN_BUCKETS; i++)
+            walks += st.chain_lengths[i];
+        assert(walks >= 200);
 
-        snprintf(buf2, 8, "%d", 4);
-        char *p = (char *)springfield_get(db, buf2, &sz);
-        assert(p);
-        free(p);
-        springfield_del(db, buf2);
-        p = (char *)springfield_get(db, buf2, &sz);
-        assert(!p);
+        /* counters start over with the handle */
+        if (round == 0) {
+            r = reopen(r, path, &o);
+        } else if (round == 1) {
+            springfield_compact(r, 0);
+            springfield_stats(r, &st);
+            assert(st.compactions == 1);
+            assert(st.ops[SPRINGFIELD_OP_COMPACT].count == 1);
+            assert(st.lock_waits[SPRINGFIELD_LOCK_ITER].count >= 1);
+            r = reopen(r, path, &o);
+        }
     }
+    springfield_close(r);
+}
+
+/* -- blob files -- */
+
+static void blob_value(char *buf, int i, int round) {
+    int n = snprintf(buf, 32, "blob-%d-%d", i, round);
+    memset(buf + n, 'a' + (i + round) % 26, 5000 - n);
+    buf[5000] = 0;
+}
+
+static void blob_check(springfield_t *r) {
+    char key[32], want[5001];
+    int i;
+    for (i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "b%d", i);
+        blob_value(want, i, i % 2);
+        check(r, key, i % 5 == 4 ? NULL : want);
+    }
+    check(r, "small", "inline");
+}
+
+static void test_blobs(void) {
+    char path[128], key[32], val[5001];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.blob_threshold = 1000;
+    path_of(path, sizeof(path), "blob.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "b%d", i);
+        blob_value(val, i, 0);
+        put(r, key, val);
+    }
+    for (i = 1; i < 50; i += 2) {
+        snprintf(key, sizeof(key), "b%d", i);
+        blob_value(val, i, 1);
+        put(r, key, val);
+    }
+    for (i = 4; i < 50; i += 5) {
+        snprintf(key, sizeof(key), "b%d", i);
+        springfield_del(r, key);
+    }
+    put(r, "small", "inline");
+    blob_check(r);
+    assert(stats(r).blob_bytes > 50 * 5000);
+
+    springfield_sync(r);
+    r = reopen(r, path, &o);
+    blob_check(r);
+    springfield_blob_gc(r);
+    assert(stats(r).blob_gcs == 1);
+    assert(stats(r).blob_bytes < 50 * 5000);
+    blob_check(r);
+    springfield_compact(r, 0);
+    blob_check(r);
+    r = reopen(r, path, &o);
+    blob_check(r);
+    springfield_close(r);
+}
+
+/* -- v1 files --
+
+   Files written before the v2 header stay readable; new records
+   go in as v2 alongside them.  This writes a small v1 file by
+   hand. */
+
+typedef struct test_header_v1 {
+    uint32_t crc;
+    uint16_t version;
+    uint16_t klen;
+    uint32_t vlen;
+    uint32_t flags;
+    uint64_t last;
+} test_header_v1;
+
+static uint32_t test_crc32(uint8_t *p, size_t len) {
+    uint32_t crc = ~0U;
+    int b;
+    while (len--) {
+        crc ^= *p++;
+        for (b = 0; b < 8; b++)
+            crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void test_v1_file(void) {
+    char path[128], key[32], val[32];
+    uint8_t rec[128];
+    uint64_t last[8], off = 4;
+    uint32_t buckets = 8;
+    springfield_options_t o;
+    int i, fd;
+    options(&o);
+    path_of(path, sizeof(path), "v1.db");
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    assert(fd > -1);
+    assert(write(fd, &buckets, 4) == 4);
+    memset(last, 0xff, sizeof(last));
+    for (i = 0; i < 20; i++) {
+        test_header_v1 h;
+        snprintf(key, sizeof(key), "v1-%d", i % 15);
+        snprintf(val, sizeof(val), "value-%d", i);
+        uint32_t b = springfield_hash(key) % buckets;
+        h.version = 1;
+        h.klen = strlen(key) + 1;
+        h.vlen = i == 19 ? 0 : strlen(val);
+        h.flags = 0;
+        h.last = last[b];
+        memcpy(rec, &h, sizeof(h));
+        memcpy(rec + sizeof(h), key, h.klen);
+        memcpy(rec + sizeof(h) + h.klen, val, h.vlen);
+        uint32_t len = sizeof(h) + h.klen + h.vlen;
+        h.crc = test_crc32(rec + 4, len - 4);
+        memcpy(rec, &h.crc, 4);
+        assert(write(fd, rec, len) == len);
+        last[b] = off;
+        off += len;
+    }
+    close(fd);
+
+    springfield_t *r = springfield_create_opts(path, 0, &o);
+    int round;
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < 15; i++) {
+            snprintf(key, sizeof(key), "v1-%d", i);
+            snprintf(val, sizeof(val), "value-%d", i < 5 ? i + 15 : i);
+            check(r, key, i == 4 ? NULL : val);
+        }
+        if (round == 0) {
+            put(r, "v2", "new");
+            put(r, "v1-0", "value-15");
+            r = reopen(r, path, &o);
+        } else if (round == 1) {
+            springfield_compact(r, 0);
+        }
+        check(r, "v2", "new");
+    }
+    springfield_close(r);
+}
 
-    void *vres;
+/* -- write buffer -- */
 
-    pthread_join(t, &vres);
-    springfield_close(db);
+static void test_write_buffer(void) {
+    char path[128], key[32], val[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.write_buffer_bytes = 64 * 1024;
+    path_of(path, sizeof(path), "wbuf.db");
+    springfield_t *r = springfield_create_opts(path, 256, &o);
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "w%d", i % 1000);
+        snprintf(val, sizeof(val), "v%d", i);
+        put(r, key, val);
+        if (i % 7 == 0)
+            check(r, key, val);
+    }
+    for (i = 0; i < 1000; i += 9) {
+        snprintf(key, sizeof(key), "w%d", i);
+        springfield_del(r, key);
+        check(r, key, NULL);
+    }
+    int round;
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < 1000; i++) {
+            snprintf(key, sizeof(key), "w%d", i);
+            snprintf(val, sizeof(val), "v%d", 4000 + i);
+            check(r, key, i % 9 ? val : NULL);
+        }
+        if (round == 0)
+            r = reopen(r, path, &o);  /* close flushes */
+        else if (round == 1)
+            springfield_compact(r, 0);
+    }
+    springfield_sync(r);
+    assert(stats(r).wbuf_bytes == 0);
+    springfield_close(r);
+}
+
+/* -- deletes -- */
+
+static void prefix_check(springfield_t *r) {
+    char key[32];
+    int i, n = 0;
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "user:%d", i);
+        check(r, key, NULL);
+        snprintf(key, sizeof(key), "item:%d", i);
+        check(r, key, key);
+    }
+    check(r, "user", "no colon");
+    springfield_iter(r, count_cb, &n);
+    assert(n == 101);
+    assert(springfield_del_prefix(r, "user:") == 0);
+}
+
+static void test_deletes(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    path_of(path, sizeof(path), "del.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "user:%d", i);
+        put(r, key, key);
+        snprintf(key, sizeof(key), "item:%d", i);
+        put(r, key, key);
+    }
+    put(r, "user", "no colon");
+
+    /* deleting what isn't there writes nothing */
+    uint64_t eof = stats(r).eof;
+    springfield_del(r, "nope");
+    springfield_del(r, "user:100");
+    assert(stats(r).eof == eof);
+    assert(stats(r).dels == 0 && stats(r).dels_skipped == 2);
+
+    assert(springfield_del_prefix(r, "user:") == 100);
+    assert(stats(r).dels == 100 && stats(r).dels_skipped == 2);
+    springfield_del(r, "user:5");
+    assert(stats(r).dels_skipped == 3);
+    prefix_check(r);
+
+    r = reopen(r, path, &o);
+    prefix_check(r);
+    /* compaction drops the tombstones with what they hid */
+    eof = stats(r).eof;
+    springfield_compact(r, 0);
+    assert(stats(r).eof < eof * 2 / 3);
+    prefix_check(r);
+    r = reopen(r, path, &o);
+    prefix_check(r);
+    springfield_close(r);
+}
+
+/* -- sharded handles -- */
+
+#define SHARDS 4
+
+static void shard_paths(char paths[][128], char **ptrs, const char *name) {
+    int i;
+    for (i = 0; i <= SHARDS; i++) {
+        char shard[32];
+        snprintf(shard, sizeof(shard), "%s.%d", name, i);
+        path_of(paths[i], 128, shard);
+        ptrs[i] = paths[i];
+    }
+}
+
+static void sharded_check(springfield_sharded_t *s) {
+    char key[32];
+    uint32_t len;
+    int i, n = 0;
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "sh%d", i);
+        uint8_t *val = springfield_sharded_get(s, key, &len);
+        if (i % 5 == 0) {
+            assert(!val);
+            continue;
+        }
+        assert(val && len == strlen(key) && !memcmp(val, key, len));
+        free(val);
+    }
+    /* every shard got some of the keys */
+    for (i = 0; i < SHARDS; i++) {
+        int in_shard = 0;
+        springfield_iter(springfield_sharded_shard(s, i), count_cb, &in_shard);
+        assert(in_shard > 0);
+        n += in_shard;
+    }
+    assert(n == 800);
+}
+
+static void test_sharded(void) {
+    char paths[SHARDS + 1][128], copies[SHARDS + 1][128];
+    char *p[SHARDS + 1], *cp[SHARDS + 1], *swapped[SHARDS], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    shard_paths(paths, p, "shard");
+    shard_paths(copies, cp, "shard-copy");
+    springfield_sharded_t *s = springfield_sharded_create(p, SHARDS, 64, &o);
+    assert(s && springfield_sharded_count(s) == SHARDS);
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "sh%d", i);
+        springfield_sharded_set(s, key, (uint8_t *)key, strlen(key));
+    }
+    for (i = 0; i < 1000; i += 5) {
+        snprintf(key, sizeof(key), "sh%d", i);
+        springfield_sharded_del(s, key);
+    }
+    sharded_check(s);
+    springfield_sharded_close(s);
+
+    /* reordered or recounted sets are refused, and claim nothing */
+    for (i = 0; i < SHARDS; i++)
+        swapped[i] = p[i ^ 1];
+    errno = 0;
+    assert(!springfield_sharded_create(swapped, SHARDS, 64, &o) && errno == EINVAL);
+    errno = 0;
+    assert(!springfield_sharded_create(p, SHARDS - 1, 64, &o) && errno == EINVAL);
+    errno = 0;
+    assert(!springfield_sharded_create(p, SHARDS + 1, 64, &o) && errno == EINVAL);
+    char manifest[160];
+    snprintf(manifest, sizeof(manifest), "%s.shard", p[SHARDS]);
+    assert(access(manifest, F_OK) && access(p[SHARDS], F_OK));
+
+    s = springfield_sharded_create(p, SHARDS, 64, &o);
+    sharded_check(s);
+    springfield_sharded_compact(s, 256);
+    assert(springfield_bucket_count(springfield_sharded_shard(s, 0)) == 256);
+    sharded_check(s);
+    assert(!springfield_sharded_checkpoint(s, cp, 0));
+    springfield_sharded_close(s);
+
+    s = springfield_sharded_create(p, SHARDS, 64, &o);
+    sharded_check(s);
+    springfield_sharded_close(s);
+    s = springfield_sharded_create(cp, SHARDS, 64, &o);
+    sharded_check(s);
+    springfield_sharded_close(s);
+}
+
+/* -- async gets -- */
+
+static void async_cb(springfield_t *r, char *key, uint8_t *val, uint32_t len,
+        void *passthrough) {
+    uint32_t want_len;
+    uint8_t *want = springfield_get(r, key, &want_len);
+    assert(!want == !val && (!val || (len == want_len && !memcmp(val, want, len))));
+    free(want);
+    free(val);
+    ++*(int *)passthrough;
+}
+
+static void async_check(springfield_t *r) {
+    char key[32];
+    int i, done = 0;
+    springfield_async_t *a = springfield_async_create(r, 8);
+    for (i = 0; i < 220; i++) {
+        snprintf(key, sizeof(key), "a%d", i);
+        while (springfield_async_get(a, key, async_cb, &done) < 0)
+            springfield_async_poll(a, 1);
+    }
+    while (springfield_async_pending(a))
+        springfield_async_poll(a, 1);
+    springfield_async_destroy(a);
+    assert(done == 220);
+}
+
+static void test_async(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.blob_threshold = 1000;
+    path_of(path, sizeof(path), "async.db");
+    springfield_t *r = springfield_create_opts(path, 16, &o);
+    char big[3000];
+    memset(big, 'q', sizeof(big));
+    for (i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "a%d", i);
+        if (i % 3 == 0)
+            springfield_set(r, key, (uint8_t *)big, sizeof(big));
+        else if (i % 3 == 1)
+            put(r, key, key);
+        /* async gets fold fragments too */
+        if (i % 4 == 0)
+            springfield_append(r, key, (uint8_t *)"++", 2);
+    }
+    async_check(r);
+    r = reopen(r, path, &o);
+    async_check(r);
+    springfield_compact(r, 0);
+    async_check(r);
+    springfield_close(r);
+}
+
+/* -- non-blocking gets -- */
+
+#define TRY_KEYS 2000
+
+static void try_value(char *buf, int i) {
+    int n = snprintf(buf, 32, "try%d:", i);
+    memset(buf + n, 'a' + i % 26, 2000 - n);
+    buf[2000] = 0;
+}
+
+/* Every key, with try_get retried (prefetching) until it answers;
+   returns how many tries would have blocked */
+static int try_check(springfield_t *r) {
+    char key[32], want[2001];
+    int i, blocked = 0;
+    for (i = 0; i < TRY_KEYS; i++) {
+        uint8_t *val;
+        uint32_t len;
+        int res;
+        snprintf(key, sizeof(key), "try%d", i);
+        while ((res = springfield_try_get(r, key, &val, &len,
+                SPRINGFIELD_TRY_PREFETCH)) == SPRINGFIELD_TRY_WOULDBLOCK) {
+            assert(!val);
+            blocked++;
+            usleep(1000);
+        }
+        if (i % 7 == 0) {
+            assert(res == SPRINGFIELD_TRY_MISS && !val);
+            continue;
+        }
+        try_value(want, i);
+        assert(res == SPRINGFIELD_TRY_HIT && len == 2000 && !memcmp(val, want, len));
+        free(val);
+    }
+    return blocked;
+}
+
+/* Push `path` out of the page cache */
+static void drop_cache(char *path) {
+    int fd = open(path, O_RDONLY);
+    assert(fd > -1);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void test_try_get(void) {
+    char path[128], key[32], val[2001];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    path_of(path, sizeof(path), "try.db");
+    springfield_t *r = springfield_create_opts(path, 1024, &o);
+    for (i = 0; i < TRY_KEYS; i++) {
+        snprintf(key, sizeof(key), "try%d", i);
+        try_value(val, i);
+        if (i % 7)
+            put(r, key, val);
+    }
+    assert(try_check(r) == 0);
+
+    /* after a reopen, with the file pushed out of the page cache,
+       gets would block until the prefetches land */
+    r = reopen(r, path, &o);
+    drop_cache(path);
+    uint64_t before = stats(r).try_wouldblocks;
+    int blocked = try_check(r);
+    assert(blocked > 0 && stats(r).try_wouldblocks - before == blocked);
+    springfield_warmup(r);
+    assert(try_check(r) == 0);
+
+    springfield_compact(r, 0);
+    springfield_warmup(r);
+    assert(try_check(r) == 0);
+    springfield_close(r);
+}
+
+/* -- cas, incr, merge and append -- */
+
+static uint8_t * sum_merge(char *key, uint8_t *existing, uint32_t elen,
+        uint8_t *operand, uint32_t olen, uint32_t *len, void *passthrough) {
+    int64_t v = 0, d;
+    if (existing) {
+        assert(elen == 8);
+        memcpy(&v, existing, 8);
+    }
+    memcpy(&d, operand, 8);
+    v += d;
+    if (!v)
+        return NULL;
+    uint8_t *res = malloc(8);
+    memcpy(res, &v, 8);
+    *len = 8;
+    return res;
+}
+
+static void check_counter(springfield_t *r, char *key, int64_t want) {
+    uint32_t len;
+    int64_t v;
+    uint8_t *val = springfield_get(r, key, &len);
+    assert(val && len == 8);
+    memcpy(&v, val, 8);
+    assert(v == want);
+    free(val);
+}
+
+static void rmw_check(springfield_t *r) {
+    char want[64 * 5 + 1];
+    int i;
+    check(r, "cas", "b");
+    check_counter(r, "count", 45);
+    check(r, "text", "hello");
+    check_counter(r, "sum", 15);
+    check(r, "zero", NULL);
+    for (i = 0; i < 64; i++)
+        memcpy(want + i * 5, "frag-", 5);
+    want[64 * 5] = 0;
+    check(r, "log", want);
+    check(r, "based", "base+tail");
+}
+
+static void test_rmw(int lazy) {
+    char path[128];
+    springfield_options_t o;
+    int64_t d, res;
+    int i;
+    options(&o);
+    o.merge = sum_merge;
+    o.merge_lazy = lazy;
+    path_of(path, sizeof(path), lazy ? "lazy.db" : "rmw.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+
+    assert(springfield_cas(r, "cas", NULL, 0, (uint8_t *)"a", 1));
+    assert(!springfield_cas(r, "cas", NULL, 0, (uint8_t *)"x", 1));
+    assert(!springfield_cas(r, "cas", (uint8_t *)"x", 1, (uint8_t *)"y", 1));
+    assert(springfield_cas(r, "cas", (uint8_t *)"a", 1, (uint8_t *)"b", 1));
+
+    for (i = 0; i < 10; i++)
+        assert(!springfield_incr(r, "count", i, &res) && res == i * (i + 1) / 2);
+    put(r, "text", "hello");
+    errno = 0;
+    assert(springfield_incr(r, "text", 1, &res) == -1 && errno == EINVAL);
+
+    for (d = 1; d <= 5; d++)
+        springfield_merge(r, "sum", (uint8_t *)&d, 8);
+    d = 3;
+    springfield_merge(r, "zero", (uint8_t *)&d, 8);
+    d = -3;
+    springfield_merge(r, "zero", (uint8_t *)&d, 8);
+
+    /* more fragments than a get folds without writing them back */
+    for (i = 0; i < 64; i++)
+        springfield_append(r, "log", (uint8_t *)"frag-", 5);
+    put(r, "based", "base");
+    springfield_append(r, "based", (uint8_t *)"+tail", 5);
+    rmw_check(r);
+    /* the first get above folded "log" and wrote it back */
+    uint64_t folds = stats(r).merge_folds;
+    check(r, "based", "base+tail");
+    assert(stats(r).merge_folds == folds + 1);
+    uint32_t len;
+    free(springfield_get(r, "log", &len));
+    assert(stats(r).merge_folds == folds + 1);
+
+    r = reopen(r, path, &o);
+    rmw_check(r);
+    springfield_compact(r, 0);
+    rmw_check(r);
+    r = reopen(r, path, &o);
+    rmw_check(r);
+    springfield_close(r);
+}
+
+/* -- change stream -- */
+
+static springfield_t *follower;
+
+static void apply_cb(springfield_tail_t *t, springfield_change_t *c,
+        void *passthrough) {
+    assert(springfield_apply_record(follower, c->rec, c->rec_len));
+    *(uint64_t *)passthrough = c->next;
+}
+
+static void same(springfield_t *a, springfield_t *b, int keys) {
+    char key[32];
+    uint32_t la, lb;
+    int i;
+    for (i = 0; i < keys; i++) {
+        snprintf(key, sizeof(key), "t%d", i);
+        uint8_t *va = springfield_get(a, key, &la);
+        uint8_t *vb = springfield_get(b, key, &lb);
+        assert(!va == !vb && (!va || (la == lb && !memcmp(va, vb, la))));
+        free(va);
+        free(vb);
+    }
+}
+
+static void test_tail(void) {
+    char path[128], fpath[128], key[32], val[32];
+    springfield_options_t o;
+    springfield_change_t c;
+    uint64_t pos = 0;
+    int i;
+    options(&o);
+    o.blob_threshold = 100;
+    path_of(path, sizeof(path), "leader.db");
+    path_of(fpath, sizeof(fpath), "follower.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    follower = springfield_create_opts(fpath, 64, &o);
+    springfield_tail_t *t = springfield_tail_create(r, SPRINGFIELD_TAIL_START);
+    assert(springfield_tail_next(t, &c) == 0);
+
+    for (i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "t%d", i % 300);
+        if (i % 11 == 0) {
+            springfield_del(r, key);
+        } else if (i % 13 == 0) {
+            char big[200];
+            memset(big, 'x', sizeof(big));
+            springfield_set(r, key, (uint8_t *)big, sizeof(big));
+        } else {
+            snprintf(val, sizeof(val), "v%d", i);
+            put(r, key, val);
+        }
+        if (i % 500 == 250)
+            assert(springfield_tail_poll(t, apply_cb, &pos, 0) > 0);
+        /* the tail is behind when these land */
+        if (i % 1000 == 999)
+            springfield_compact(r, 0);
+    }
+    assert(springfield_tail_poll(t, apply_cb, &pos, 0) > 0);
+    assert(springfield_tail_next(t, &c) == 0);
+    same(r, follower, 300);
+    springfield_tail_destroy(t);
+
+    /* resume from a saved position after a reopen */
+    r = reopen(r, path, &o);
+    put(r, "t1", "resumed");
+    t = springfield_tail_create(r, pos);
+    assert(springfield_tail_next(t, &c) == 1);
+    assert(c.kind == SPRINGFIELD_CHANGE_SET && !strcmp(c.key, "t1"));
+    assert(springfield_apply_record(follower, c.rec, c.rec_len));
+    assert(springfield_tail_next(t, &c) == 0);
+    springfield_tail_destroy(t);
+    same(r, follower, 300);
+
+    /* a position that isn't a record boundary starts over */
+    t = springfield_tail_create(r, pos + 3);
+    assert(springfield_tail_next(t, &c) == SPRINGFIELD_TAIL_RESET);
+    assert(springfield_tail_next(t, &c) == 1);
+    springfield_tail_destroy(t);
+
+    springfield_close(follower);
+    springfield_close(r);
+}
+
+/* -- checkpoints and index files -- */
+
+static void test_checkpoint(void) {
+    char path[128], copy[128], key[32];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    o.blob_threshold = 1000;
+    path_of(path, sizeof(path), "live.db");
+    path_of(copy, sizeof(copy), "copy.db");
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "c%d", i);
+        put(r, key, key);
+    }
+    char big[2001];
+    memset(big, 'z', 2000);
+    big[2000] = 0;
+    put(r, "big", big);
+    assert(!springfield_checkpoint(r, copy, 0));
+    assert(stats(r).checkpoints == 1);
+    put(r, "c0", "after");
+
+    /* taken with trusted_open, ignored without: same data */
+    int trusted;
+    for (trusted = 1; trusted >= 0; trusted--) {
+        springfield_options_t co = o;
+        co.trusted_open = trusted;
+        springfield_t *c = springfield_create_opts(copy, 0, &co);
+        for (i = 0; i < BASIC_KEYS; i++) {
+            snprintf(key, sizeof(key), "c%d", i);
+            check(c, key, key);
+        }
+        check(c, "big", big);
+        springfield_close(c);
+    }
+
+    /* trusted_open writes its own index at close */
+    o.trusted_open = 1;
+    r = reopen(r, path, &o);
+    put(r, "late", "write");
+    r = reopen(r, path, &o);
+    check(r, "c0", "after");
+    check(r, "late", "write");
+    check(r, "big", big);
+    springfield_compact(r, 0);
+    r = reopen(r, path, &o);
+    check(r, "c1", "c1");
+    check(r, "late", "write");
+    springfield_close(r);
+}
+
+/* -- CRC checks after load -- */
+
+/* Flip the byte after the first `marker` in the file at `path` */
+static void corrupt(char *path, const char *marker) {
+    size_t mlen = strlen(marker);
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    assert(fd > -1 && !fstat(fd, &st));
+    uint8_t *buf = malloc(st.st_size);
+    assert(read(fd, buf, st.st_size) == st.st_size);
+    off_t off;
+    for (off = 0; off + mlen < st.st_size; off++) {
+        if (!memcmp(buf + off, marker, mlen))
+            break;
+    }
+    assert(off + mlen < st.st_size);
+    buf[off + mlen] ^= 1;
+    assert(pwrite(fd, buf + off + mlen, 1, off + mlen) == 1);
+    free(buf);
+    close(fd);
+}
+
+static void crc_value(char *buf, int i) {
+    snprintf(buf, 32, "v:crc%d;", i);
+}
+
+static void big_value(char *buf) {
+    memset(buf, 'b', 2000);
+    memcpy(buf + 1000, "BLOBMARK", 8);
+    buf[2000] = 0;
+}
+
+/* Wait for the scrubber's first pass since open */
+static springfield_stats_t scrubbed(springfield_t *r) {
+    int waited;
+    for (waited = 0; !stats(r).scrub_passes; waited++) {
+        assert(waited < 1000);
+        usleep(10000);
+    }
+    return stats(r);
+}
+
+static void test_verify(void) {
+    char path[128], blob[160], key[32], val[32], big[2001];
+    springfield_options_t o;
+    int i;
+    options(&o);
+    /* an indexed open doesn't check what the index covers */
+    o.trusted_open = 1;
+    o.blob_threshold = 1000;
+    path_of(path, sizeof(path), "crc.db");
+    snprintf(blob, sizeof(blob), "%s.blob.1", path);
+    springfield_t *r = springfield_create_opts(path, 64, &o);
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "crc%d", i);
+        crc_value(val, i);
+        put(r, key, val);
+    }
+    big_value(big);
+    put(r, "big", big);
+    springfield_close(r);
+    corrupt(path, "v:crc50");
+    corrupt(blob, "BLOBMARK");
+
+    o.verify_reads = 1;
+    r = springfield_create_opts(path, 0, &o);
+    check(r, "crc50", NULL);
+    assert(stats(r).crc_errors == 1);
+    check(r, "big", NULL);
+    assert(stats(r).crc_errors == 2);
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "crc%d", i);
+        crc_value(val, i);
+        if (i != 50)
+            check(r, key, val);
+    }
+    assert(stats(r).crc_errors == 2);
+
+    o.verify_reads = 0;
+    o.scrub_bytes_per_sec = 1 << 30;
+    r = reopen(r, path, &o);
+    springfield_stats_t st = scrubbed(r);
+    assert(st.crc_errors >= 2 && st.scrub_bytes > 0);
+
+    /* rewritten, compacted and collected, it all checks out */
+    crc_value(val, 50);
+    put(r, "crc50", val);
+    put(r, "big", big);
+    springfield_compact(r, 0);
+    springfield_blob_gc(r);
+    o.verify_reads = 1;
+    r = reopen(r, path, &o);
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "crc%d", i);
+        crc_value(val, i);
+        check(r, key, val);
+    }
+    check(r, "big", big);
+    st = scrubbed(r);
+    assert(st.crc_errors == 0);
+    springfield_close(r);
+}
+
+/* -- autopilot -- */
+
+static void auto_check(springfield_t *r) {
+    char key[32];
+    int i;
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "auto%d", i);
+        check(r, key, key);
+    }
+}
+
+static void test_autopilot(void) {
+    char path[128], key[32];
+    springfield_options_t o;
+    int i, waited;
+    options(&o);
+    o.autopilot = 1;
+    o.autopilot_interval = 1;
+    path_of(path, sizeof(path), "auto.db");
+    /* ~125 keys a bucket, against a target of 2 */
+    springfield_t *r = springfield_create_opts(path, 16, &o);
+    for (i = 0; i < BASIC_KEYS; i++) {
+        snprintf(key, sizeof(key), "auto%d", i);
+        put(r, key, key);
+    }
+    for (waited = 0; stats(r).num_buckets == 16; waited++) {
+        assert(waited < 1000);
+        usleep(10000);
+    }
+    springfield_stats_t st = stats(r);
+    assert(st.compactions == 1);
+    /* resized to half the target: a key a bucket, give or take */
+    assert(st.num_buckets >= BASIC_KEYS / 2 && st.num_buckets <= BASIC_KEYS * 2);
+    auto_check(r);
+
+    r = reopen(r, path, &o);
+    assert(stats(r).num_buckets == st.num_buckets);
+    auto_check(r);
+    springfield_compact(r, 0);
+    assert(stats(r).num_buckets == st.num_buckets);
+    auto_check(r);
+    springfield_close(r);
+}
+
+int main() {
+    strcpy(dir, "/tmp/springfield_test.XXXXXX");
+    assert(mkdtemp(dir));
+
+    for (backend = SPRINGFIELD_BACKEND_MMAP; backend <= SPRINGFIELD_BACKEND_POOL;
+            backend++) {
+        printf("-- %s backend --\n", backend ? "pool" : "mmap");
+        test_basic();
+        test_prepared_keys();
+        test_cache();
+        test_bloom();
+        test_warmup();
+        test_histogram();
+        test_stats();
+        test_blobs();
+        test_v1_file();
+        test_write_buffer();
+        test_deletes();
+        test_sharded();
+        test_async();
+        test_try_get();
+        test_rmw(0);
+        test_rmw(1);
+        test_tail();
+        test_checkpoint();
+        test_verify();
+        test_autopilot();
+        printf("ok\n");
+    }
 
-    return 0;
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd);
 }